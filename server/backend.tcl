@@ -48,9 +48,13 @@ proc SrmGet {requestType uniqueId userName SURL} {
 
 # -------------------------------------------------------------------------
 
-proc SrmPut {requestType uniqueId userName SURL} {
+proc SrmPut {requestType uniqueId userName SURL {fileSize 0}} {
 
-    set command "sudo -u $userName ./scripts/url_put.sh [ExtractHostFile $SURL]"
+    if {![string is wideinteger -strict $fileSize] || $fileSize < 0} {
+        set fileSize 0
+    }
+
+    set command "sudo -u $userName ./scripts/url_put.sh [ExtractHostFile $SURL] $fileSize"
     SubmitCommand $requestType $uniqueId $command
 }
 
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/statvfs.h>
@@ -148,12 +151,18 @@ static int make_realdir(const char *path,
   return 0;
 }
 
-static int make_path(const char *path, char *real_path, char *meta_path)
+/*
+  Only mounts that can hold the expected size on top of
+  MIN_FREE_BLOCKS take part in the weighted choice.
+*/
+
+static int make_path(const char *path, char *real_path, char *meta_path,
+            long long size)
 {
   struct statvfs stvfs;
   int res;
   int i, count, first, last, step;
-  double spaces[MAX_STORAGE], total_space, random_value;
+  double spaces[MAX_STORAGE], total_space, random_value, free_space;
 
   random_value = ((double)rand()/(double)RAND_MAX);
 
@@ -164,7 +173,8 @@ static int make_path(const char *path, char *real_path, char *meta_path)
     res = statvfs(storage.mounts[i], &stvfs);
     if(res == 0 && stvfs.f_bavail > MIN_FREE_BLOCKS)
     {
-      total_space += stvfs.f_bavail;
+      free_space = (double)(stvfs.f_bavail - MIN_FREE_BLOCKS) * stvfs.f_frsize;
+      if(free_space >= (double)size) total_space += free_space;
     }
     spaces[i] = total_space;
   }
@@ -200,20 +210,48 @@ static int make_path(const char *path, char *real_path, char *meta_path)
   return res;
 }
 
+/*
+  Preallocates the expected size without changing the file size, so
+  the space is taken out of statvfs for parallel puts right away.
+  File systems without fallocate support simply skip this step.
+*/
+
+static int reserve_file(const char *real_path, long long size)
+{
+  int fd;
+
+  fd = open(real_path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+  if(fd == -1) return -1;
+
+  if(size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1 &&
+     errno != EOPNOTSUPP && errno != ENOSYS)
+  {
+    close(fd);
+    unlink(real_path);
+    return -1;
+  }
+
+  return close(fd);
+}
+
 int main(int argc, char *argv[])
 {
   int res, len;
   char *config_file;
   char *path;
+  long long size;
   char real_path[MAX_PATH];
   char meta_path[MAX_PATH];
 
   storage.nmounts = 0;
 
-  if(argc != 3) return 1;
+  if(argc != 3 && argc != 4) return 1;
 
   config_file = argv[1];
   path = argv[2];
+  size = argc == 4 ? atoll(argv[3]) : 0;
+
+  if(size < 0) size = 0;
 
   get_config(config_file);
 
@@ -230,12 +268,20 @@ int main(int argc, char *argv[])
 
   if(path[0] != '/') return -1;
 
-  res = make_path(path, real_path, meta_path);
+  res = make_path(path, real_path, meta_path, size);
   if(res == -1) return -errno;
 
-  res = symlink(real_path, meta_path);
+  res = reserve_file(real_path, size);
   if(res == -1) return -errno;
 
+  res = symlink(real_path, meta_path);
+  if(res == -1)
+  {
+    res = errno;
+    unlink(real_path);
+    return -res;
+  }
+
   printf("%s\n", real_path);
 
   return 0;
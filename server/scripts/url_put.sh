@@ -3,6 +3,7 @@
 # Pick up arguments
 hostDst="$1"
 fileDst="$2"
+fileSize="${3:-0}"
 
 dirDst=`dirname $fileDst`
 
@@ -10,7 +11,7 @@ dirDst=`dirname $fileDst`
 
 checkFileDst $fileDst $dirDst
 
-result=`./putfile storage.cfg $fileDst`
+result=`./putfile storage.cfg $fileDst $fileSize`
 
 rc=$?
 if [ $rc != 0 ]
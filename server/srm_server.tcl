@@ -623,11 +623,11 @@ namespace eval ::srmlite::srm::server {
 # -------------------------------------------------------------------------
 
     SrmFile instproc srmPrepareToPut {} {
-        my instvar userName dstSURL
+        my instvar userName dstSURL fileSize
 
         my set state put
         [my info parent] setFile $dstSURL [self]
-        [my frontendService] process [list put [self] $userName $dstSURL]
+        [my frontendService] process [list put [self] $userName $dstSURL $fileSize]
     }
 
 # -------------------------------------------------------------------------
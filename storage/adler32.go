@@ -7,6 +7,7 @@ import (
 	"io"
 	"net"
 	"os"
+	"syscall"
 )
 
 func main() {
@@ -44,6 +45,11 @@ func handle(conn net.Conn) {
 
 	defer f.Close()
 
+	if sum, ok := stored(f); ok {
+		conn.Write([]byte(sum))
+		return
+	}
+
 	h := adler32.New()
 
 	_, err = io.Copy(h, f)
@@ -53,3 +59,34 @@ func handle(conn net.Conn) {
 
 	fmt.Fprintf(conn, "%08x", h.Sum32())
 }
+
+// stored returns the checksum saved by srmlite if the file still has
+// the size and modification time it was computed for.
+func stored(f *os.File) (string, bool) {
+	var sum string
+	var size, sec, nsec int64
+
+	buf := make([]byte, 64)
+
+	n, err := syscall.Getxattr(f.Name(), "user.adler32", buf)
+	if err != nil {
+		return "", false
+	}
+
+	_, err = fmt.Sscanf(string(buf[:n]), "%8s %d %d.%d", &sum, &size, &sec, &nsec)
+	if err != nil || len(sum) != 8 {
+		return "", false
+	}
+
+	info, err := f.Stat()
+	if err != nil {
+		return "", false
+	}
+
+	mtime := info.ModTime()
+	if info.Size() != size || mtime.Unix() != sec || int64(mtime.Nanosecond()) != nsec {
+		return "", false
+	}
+
+	return sum, true
+}
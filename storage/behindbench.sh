@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Shows how many backing writes write-behind saves. bench.sh writes
+# the same files with storage.writebehind 0 and with a write-behind
+# buffer, at several client block sizes, with an injected data
+# latency standing in for the NFS round trip. Every client write is
+# one loadgen call, and the backing requests are the data requests the
+# scheduler admitted to the data mounts, mostly pwrite calls.
+#
+
+usage() {
+    echo "Usage: behindbench.sh [-j threads] [-s file_size] [-b block_sizes]" >&2
+    echo "                      [-w buffer_size] [-L data_us] [-- bench.sh options]" >&2
+    exit 1
+}
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+threads=4
+size=64m
+blocks="4k 16k 64k"
+buffer=4194304
+data_us=200
+
+while getopts "j:s:b:w:L:h" opt
+do
+    case $opt in
+        j) threads=$OPTARG ;;
+        s) size=$OPTARG ;;
+        b) blocks=$OPTARG ;;
+        w) buffer=$OPTARG ;;
+        L) data_us=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+extra=$(mktemp "${TMPDIR:-/tmp}/behindbench.XXXXXX") || exit 1
+trap 'rm -f "$extra"' EXIT
+
+printf "%-11s %6s %9s %9s %9s %9s %12s %9s\n" writebehind block calls MB/s \
+    "p50 us" "p99 us" requests calls/req
+
+for capacity in 0 "$buffer"
+do
+    {
+        echo "storage.writebehind $capacity"
+        echo "storage.readahead 0"
+        echo "storage.iobackend threads"
+    } > "$extra"
+
+    for block in $blocks
+    do
+        "$here/bench.sh" -L "$data_us" -x "$extra" "$@" -- -j "$threads" \
+            -n 1 -s "$size" -b "$block" -p write |
+        awk -v capacity="$capacity" -v block="$block" '
+            $1 == "write" && calls == "" {
+                calls = $2; rate = $4; p50 = $5; p99 = $7
+            }
+            $1 == "scheduler" { sched = 1; next }
+            sched && NF == 0 { sched = 0 }
+            sched { requests += $4 }
+            END {
+                printf "%-11s %6s %9s %9s %9s %9s %12d %9.1f\n", capacity,
+                    block, calls, rate, p50, p99, requests,
+                    requests ? calls / requests : 0
+            }'
+    done
+done
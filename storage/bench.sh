@@ -0,0 +1,152 @@
+#!/bin/bash
+#
+# Mounts srmlite over local directories standing in for the meta and
+# data mounts and runs loadgen against it. As root the stand-ins are
+# tmpfs mounts, otherwise plain directories on the file system of the
+# bench directory. Latency of the backing calls is injected with
+# slowfs.so to simulate NFS round trips. With -H one data mount hangs
+# for the first seconds of the run, like an unresponsive NFS server.
+#
+
+usage() {
+    echo "Usage: bench.sh [-m mounts] [-l meta_us] [-L data_us] [-s tmpfs_size]" >&2
+    echo "                [-o fuse_options] [-x extra_config] [-H stalled_mount]" >&2
+    echo "                [-D stall_seconds] [-- loadgen options]" >&2
+    exit 1
+}
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+nmounts=3
+meta_us=0
+data_us=0
+size=1g
+options=direct_io
+extra=
+stall=
+stall_time=10
+
+while getopts "m:l:L:s:o:x:H:D:h" opt
+do
+    case $opt in
+        m) nmounts=$OPTARG ;;
+        l) meta_us=$OPTARG ;;
+        L) data_us=$OPTARG ;;
+        s) size=$OPTARG ;;
+        o) options=$OPTARG ;;
+        x) extra=$OPTARG ;;
+        H) stall=$OPTARG ;;
+        D) stall_time=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ -n "$stall" ] && { [ "$stall" -lt 1 ] || [ "$stall" -gt "$nmounts" ]; }
+then
+    echo "Stalled mount must be between 1 and $nmounts" >&2
+    exit 1
+fi
+
+for file in srmlite loadgen slowfs.so
+do
+    if [ ! -x "$here/$file" ] && [ ! -f "$here/$file" ]
+    then
+        echo "$here/$file is missing, run make bench" >&2
+        exit 1
+    fi
+done
+
+root=$(mktemp -d "${BENCHDIR:-/tmp}/srmlite-bench.XXXXXX") || exit 1
+cfgfile=$root/srmlite.cfg
+logfile=$root/srmlite.log
+mntpoint=$root/mnt
+stallfile=$root/stall
+stallpath=
+dirs="$root/meta"
+pid=
+
+for i in $(seq -w 1 "$nmounts")
+do
+    dirs="$dirs $root/ms$i"
+    [ -n "$stall" ] && [ $((10#$i)) -eq "$stall" ] && stallpath=$root/ms$i
+done
+
+cleanup() {
+    # release stalled calls first, the unmount waits for them
+    rm -f "$stallfile"
+    if mountpoint -q "$mntpoint"
+    then
+        fusermount -u "$mntpoint" 2> /dev/null || umount "$mntpoint"
+    fi
+    [ -n "$pid" ] && wait "$pid" 2> /dev/null
+    for dir in $dirs
+    do
+        mountpoint -q "$dir" && umount "$dir"
+    done
+    rm -rf "$root"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir "$mntpoint"
+paths=
+for dir in $dirs
+do
+    mkdir "$dir"
+    [ "$(id -u)" = 0 ] && mount -t tmpfs -o size="$size" tmpfs "$dir"
+    paths="$paths${paths:+:}$dir"
+done
+
+{
+    echo "storage.metapath $root/meta"
+    for dir in $dirs
+    do
+        [ "$dir" = "$root/meta" ] || echo "storage.datapath $dir"
+    done
+    [ -n "$extra" ] && cat "$extra"
+} > "$cfgfile"
+
+LD_PRELOAD=$here/slowfs.so SLOWFS_PATHS=$paths \
+SLOWFS_META_US=$meta_us SLOWFS_DATA_US=$data_us \
+SLOWFS_STALL_PATH=$stallpath SLOWFS_STALL_FILE=$stallfile \
+    "$here/srmlite" -c "$cfgfile" -f -o "$options" "$mntpoint" > "$logfile" 2>&1 &
+pid=$!
+
+for i in $(seq 50)
+do
+    mountpoint -q "$mntpoint" && break
+    if ! kill -0 "$pid" 2> /dev/null
+    then
+        echo "srmlite exited:" >&2
+        cat "$logfile" >&2
+        exit 1
+    fi
+    sleep 0.2
+done
+
+if ! mountpoint -q "$mntpoint"
+then
+    echo "srmlite did not mount $mntpoint" >&2
+    exit 1
+fi
+
+echo "$nmounts data mounts, meta latency $meta_us us, data latency $data_us us"
+
+if [ -n "$stallpath" ]
+then
+    touch "$stallfile"
+    (sleep "$stall_time"; rm -f "$stallfile") &
+    echo "$(basename "$stallpath") stalled for $stall_time s"
+fi
+
+"$here/loadgen" -d "$mntpoint" "$@"
+status=$?
+
+if [ -f "$mntpoint/.srmlite/stats" ]
+then
+    echo
+    cat "$mntpoint/.srmlite/stats"
+fi
+
+exit $status
@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Compares the threads and the uring I/O backend with bench.sh at 1,
+# 16 and 256 concurrent streams, one file per loadgen thread. slowfs.so
+# cannot delay transfers the kernel runs off the ring, so no data
+# latency is injected; to compare against real storage, run it as a
+# non-root user with BENCHDIR pointing there.
+#
+
+usage() {
+    echo "Usage: iobench.sh [-j streams] [-s file_size] [-b block_size]" >&2
+    echo "                  [-e uring_entries] [-- bench.sh options]" >&2
+    exit 1
+}
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+streams="1 16 256"
+size=4m
+block=128k
+entries=256
+
+while getopts "j:s:b:e:h" opt
+do
+    case $opt in
+        j) streams=$OPTARG ;;
+        s) size=$OPTARG ;;
+        b) block=$OPTARG ;;
+        e) entries=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+extra=$(mktemp "${TMPDIR:-/tmp}/iobench.XXXXXX") || exit 1
+trap 'rm -f "$extra"' EXIT
+
+printf "%-8s %7s %-8s %9s %11s %9s %9s %9s %9s %9s %7s\n" backend streams \
+    phase ops ops/s MB/s "p50 us" "p90 us" "p99 us" "max us" errors
+
+for backend in threads uring
+do
+    {
+        echo "storage.iobackend $backend"
+        echo "storage.uringentries $entries"
+        echo "storage.readahead 0"
+    } > "$extra"
+
+    for j in $streams
+    do
+        "$here/bench.sh" -x "$extra" "$@" -- -j "$j" -n 1 -s "$size" \
+            -b "$block" -p write,read |
+        awk -v backend="$backend" -v j="$j" '
+            $1 == "write" || $1 == "read" {
+                printf "%-8s %7s %s\n", backend, j, $0
+            }
+            $1 == "uring" { ring = 1; next }
+            ring && $1 == "total" { submitted = $4; ring = 0 }
+            END {
+                if (backend == "uring" && submitted == 0)
+                    print "uring: no transfers on the ring, check syslog" > "/dev/stderr"
+            }'
+    done
+done
@@ -0,0 +1,440 @@
+/*
+  gcc -O2 -Wall -pthread loadgen.c -o loadgen
+
+  Workload generator for benchmarking a mounted srmlite. Every
+  thread works in its own directory below the target and runs the
+  phases one after another:
+
+  create   create empty files
+  stat     stat every file
+  readdir  list the thread directory several times
+  write    write every file sequentially
+  read     read every file sequentially
+  rename   rename every file within its directory
+  unlink   remove every file
+
+  For each phase the number of operations, operations per second and
+  latency percentiles are reported. Write and read count every
+  read/write call as one operation and also report MB/s. Phases not
+  selected with -p are skipped, except create and unlink, which then
+  run untimed to set up and clean up the files.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define MAX_PATH 512
+
+#define MAX_THREADS 1024
+
+enum
+{
+  PH_CREATE,
+  PH_STAT,
+  PH_READDIR,
+  PH_WRITE,
+  PH_READ,
+  PH_RENAME,
+  PH_UNLINK,
+  PH_MAX
+};
+
+static const char *phase_names[PH_MAX] =
+{
+  "create", "stat", "readdir", "write", "read", "rename", "unlink"
+};
+
+struct lg_thread
+{
+  pthread_t thread;
+  unsigned long *lat;
+  size_t count;
+  unsigned long errors;
+  unsigned long long bytes;
+  char dir[MAX_PATH - 16];
+};
+
+static char *target = NULL;
+static char root[MAX_PATH - 32];
+static int nthreads = 8;
+static int nfiles = 1000;
+static int passes = 10;
+static size_t file_size = 1048576;
+static size_t block_size = 131072;
+static int selected[PH_MAX];
+static int renamed = 0;
+static int phase = PH_CREATE;
+
+static struct lg_thread threads[MAX_THREADS];
+
+/*----------------------------------------------------------------------------*/
+
+static unsigned long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void file_name(struct lg_thread *t, int i, int suffix, char *buf)
+{
+  snprintf(buf, MAX_PATH, "%s/f%06d%s", t->dir, i, suffix ? ".r" : "");
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void record(struct lg_thread *t, unsigned long start, int ok)
+{
+  t->lat[t->count++] = now_ns() - start;
+  if(!ok) ++t->errors;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void run_io(struct lg_thread *t, int i, char *buf)
+{
+  char path[MAX_PATH];
+  size_t done, size;
+  unsigned long start;
+  ssize_t res;
+  int fd;
+
+  file_name(t, i, 0, path);
+
+  fd = open(path, phase == PH_WRITE ? O_WRONLY | O_TRUNC : O_RDONLY);
+  if(fd == -1)
+  {
+    ++t->errors;
+    return;
+  }
+
+  for(done = 0; done < file_size; done += size)
+  {
+    size = file_size - done < block_size ? file_size - done : block_size;
+    start = now_ns();
+    if(phase == PH_WRITE)
+    {
+      res = write(fd, buf, size);
+    }
+    else
+    {
+      res = read(fd, buf, size);
+    }
+    record(t, start, res > 0);
+    if(res <= 0) break;
+    t->bytes += res;
+    size = res;
+  }
+
+  if(close(fd) == -1) ++t->errors;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void *worker(void *arg)
+{
+  struct lg_thread *t = arg;
+  char path[MAX_PATH], next[MAX_PATH];
+  struct stat stbuf;
+  struct dirent *de;
+  unsigned long start;
+  char *buf = NULL;
+  DIR *dp;
+  int i, fd, ok;
+
+  if(phase == PH_WRITE || phase == PH_READ)
+  {
+    buf = malloc(block_size);
+    memset(buf, 0x5a, block_size);
+  }
+
+  switch(phase)
+  {
+    case PH_READDIR:
+      for(i = 0; i < passes; ++i)
+      {
+        start = now_ns();
+        dp = opendir(t->dir);
+        ok = dp != NULL;
+        if(dp)
+        {
+          while((de = readdir(dp)) != NULL);
+          closedir(dp);
+        }
+        record(t, start, ok);
+      }
+      break;
+
+    case PH_WRITE:
+    case PH_READ:
+      for(i = 0; i < nfiles; ++i) run_io(t, i, buf);
+      break;
+
+    default:
+      for(i = 0; i < nfiles; ++i)
+      {
+        file_name(t, i, renamed, path);
+        start = now_ns();
+        switch(phase)
+        {
+          case PH_CREATE:
+            fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            ok = fd != -1 && close(fd) == 0;
+            break;
+          case PH_STAT:
+            ok = stat(path, &stbuf) == 0;
+            break;
+          case PH_RENAME:
+            file_name(t, i, 1, next);
+            start = now_ns();
+            ok = rename(path, next) == 0;
+            break;
+          default:
+            ok = unlink(path) == 0;
+            break;
+        }
+        record(t, start, ok);
+      }
+      break;
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int cmp_ulong(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+  return x < y ? -1 : x > y;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static double percentile(unsigned long *lat, size_t count, double q)
+{
+  if(count == 0) return 0.0;
+  return lat[(size_t) (q * (count - 1) + 0.5)] / 1000.0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static size_t phase_ops(void)
+{
+  switch(phase)
+  {
+    case PH_READDIR:
+      return passes;
+    case PH_WRITE:
+    case PH_READ:
+      return nfiles * ((file_size + block_size - 1) / block_size);
+    default:
+      return nfiles;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void run_phase(int quiet)
+{
+  unsigned long start, errors = 0;
+  unsigned long long bytes = 0;
+  unsigned long *lat;
+  size_t i, count = 0, ops = phase_ops();
+  double elapsed;
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    threads[i].lat = malloc((ops + 1) * sizeof(unsigned long));
+    threads[i].count = 0;
+    threads[i].errors = 0;
+    threads[i].bytes = 0;
+  }
+
+  start = now_ns();
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    pthread_create(&threads[i].thread, NULL, worker, &threads[i]);
+  }
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    pthread_join(threads[i].thread, NULL);
+  }
+
+  elapsed = (now_ns() - start) / 1e9;
+  if(elapsed <= 0) elapsed = 1e-9;
+
+  lat = malloc((nthreads * ops + 1) * sizeof(unsigned long));
+  for(i = 0; i < nthreads; ++i)
+  {
+    memcpy(lat + count, threads[i].lat, threads[i].count * sizeof(unsigned long));
+    count += threads[i].count;
+    errors += threads[i].errors;
+    bytes += threads[i].bytes;
+    free(threads[i].lat);
+  }
+
+  if(!quiet)
+  {
+    qsort(lat, count, sizeof(unsigned long), cmp_ulong);
+    printf("%-8s %9zu %11.1f %9.1f %9.1f %9.1f %9.1f %9.1f %7lu\n",
+      phase_names[phase], count, count / elapsed, bytes / elapsed / 1048576.0,
+      percentile(lat, count, 0.5), percentile(lat, count, 0.9),
+      percentile(lat, count, 0.99), percentile(lat, count, 1.0), errors);
+    fflush(stdout);
+  }
+  else if(errors > 0)
+  {
+    fprintf(stderr, "%s: %lu errors\n", phase_names[phase], errors);
+  }
+
+  free(lat);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static size_t parse_size(const char *arg)
+{
+  char *end;
+  size_t size = strtoull(arg, &end, 10);
+
+  switch(*end)
+  {
+    case 'g': case 'G': size <<= 10;
+    case 'm': case 'M': size <<= 10;
+    case 'k': case 'K': size <<= 10;
+  }
+
+  return size;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int select_phases(char *list)
+{
+  char *name, *save = NULL;
+  int i;
+
+  for(name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save))
+  {
+    for(i = 0; i < PH_MAX && strcmp(name, phase_names[i]) != 0; ++i);
+    if(i == PH_MAX)
+    {
+      fprintf(stderr, "Unknown phase %s\n", name);
+      return -1;
+    }
+    selected[i] = 1;
+  }
+
+  return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void usage(void)
+{
+  printf("Usage: loadgen -d directory [-j threads] [-n files] [-s size] [-b block]\n"
+         "               [-r passes] [-p phases]\n"
+         "  -j  worker threads (default 8)\n"
+         "  -n  files per thread (default 1000)\n"
+         "  -s  file size for write and read (default 1m)\n"
+         "  -b  size of each read and write call (default 128k)\n"
+         "  -r  readdir passes per thread (default 10)\n"
+         "  -p  comma separated phases to measure (default all)\n"
+         "      create,stat,readdir,write,read,rename,unlink\n");
+}
+
+/*----------------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+  int i, opt, all = 1;
+
+  while((opt = getopt(argc, argv, "d:j:n:s:b:r:p:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'd': target = optarg; break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'n': nfiles = atoi(optarg); break;
+      case 's': file_size = parse_size(optarg); break;
+      case 'b': block_size = parse_size(optarg); break;
+      case 'r': passes = atoi(optarg); break;
+      case 'p': all = 0; if(select_phases(optarg) == -1) return 1; break;
+      default: usage(); return 1;
+    }
+  }
+
+  if(target == NULL)
+  {
+    usage();
+    return 1;
+  }
+
+  if(nthreads < 1) nthreads = 1;
+  if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+  if(nfiles < 1) nfiles = 1;
+  if(passes < 1) passes = 1;
+  if(block_size < 1) block_size = 1;
+
+  for(i = 0; i < PH_MAX; ++i)
+  {
+    if(all) selected[i] = 1;
+  }
+
+  snprintf(root, sizeof(root), "%s/loadgen.%d", target, (int) getpid());
+  if(mkdir(root, 0755) == -1)
+  {
+    fprintf(stderr, "Cannot create %s: %s\n", root, strerror(errno));
+    return 1;
+  }
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    snprintf(threads[i].dir, sizeof(threads[i].dir), "%s/t%04d", root, i);
+    if(mkdir(threads[i].dir, 0755) == -1)
+    {
+      fprintf(stderr, "Cannot create %s: %s\n", threads[i].dir, strerror(errno));
+      return 1;
+    }
+  }
+
+  printf("%d threads, %d files per thread, %zu bytes per file, %zu bytes per call\n",
+    nthreads, nfiles, file_size, block_size);
+  printf("%-8s %9s %11s %9s %9s %9s %9s %9s %7s\n",
+    "phase", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us", "errors");
+
+  for(phase = 0; phase < PH_MAX; ++phase)
+  {
+    if(selected[phase] || phase == PH_CREATE || phase == PH_UNLINK)
+    {
+      run_phase(!selected[phase]);
+      if(phase == PH_RENAME) renamed = 1;
+    }
+  }
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    rmdir(threads[i].dir);
+  }
+  rmdir(root);
+
+  return 0;
+}
@@ -0,0 +1,647 @@
+/*
+  gcc -O2 -Wall -pthread nscheck.c -o nscheck
+
+  Checks that the meta tree and the data mounts agree. Every file on
+  a data mount should be reached by the meta symlink with the same
+  relative path, and every meta symlink should lead to an existing
+  file. The meta tree and all data mounts are scanned at the same
+  time by a pool of threads that steal directories from each other.
+
+  Reported problems:
+
+  dangling  meta symlink whose data file is gone
+  foreign   meta symlink that points outside the data mounts
+  orphan    data file without a meta symlink, or stripe file without
+            a layout record
+  shadowed  data file whose meta symlink points at another copy
+  emptydir  directory on a data mount without any entries
+
+  With -r, dangling symlinks and empty data directories are removed
+  and orphans get their meta symlink back when the meta directory
+  still exists. This completes the halfway states that an
+  interrupted unlink or rename leaves behind. Shadowed files,
+  foreign symlinks and orphaned stripes are only reported.
+
+  A data mount that is not mounted makes every symlink into it look
+  dangling, so a mount is only checked if its root is on another
+  device than its parent or holds a .srmlite-mount marker file.
+  Links into a mount that fails this are skipped, and so are the
+  .rebalance temp files that rebalance recovers itself.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define MAX_STORAGE 100
+
+#define MAX_PATH 512
+
+#define MAX_THREADS 256
+
+#define DEQUE_SIZE 4096
+
+#define REPORT_PERIOD 10
+
+#define STRIPE_PREFIX ".srmlite-stripe."
+#define LAYOUT_PREFIX ".srmlite-layout."
+
+#define TEMP_SUFFIX ".rebalance"
+
+#define MOUNT_MARKER ".srmlite-mount"
+
+struct nc_task
+{
+  int mount;
+  char path[MAX_PATH];
+};
+
+/*
+  Each worker owns a deque. The owner pushes and pops directories at
+  the tail, so it walks depth first and stays within one subtree,
+  while idle workers steal the oldest, usually largest, subtrees from
+  the head. A full deque makes the owner scan the directory inline.
+*/
+
+struct nc_deque
+{
+  struct nc_task *tasks[DEQUE_SIZE];
+  unsigned long head;
+  unsigned long tail;
+  pthread_mutex_t lock;
+}
+__attribute__((aligned(64)));
+
+struct nc_counter
+{
+  unsigned long entries;
+  unsigned long dirs;
+  unsigned long steals;
+}
+__attribute__((aligned(64)));
+
+static char *mounts[MAX_STORAGE];
+static size_t lengths[MAX_STORAGE];
+static int reachable[MAX_STORAGE];
+static int nmounts = 0;
+
+static int nthreads = 16;
+static int min_age = 3600;
+static int repair = 0;
+static FILE *report = NULL;
+
+static struct nc_deque deques[MAX_THREADS];
+static struct nc_counter counters[MAX_THREADS];
+
+static volatile long pending = 0;
+static volatile sig_atomic_t stopping = 0;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct
+{
+  unsigned long dangling;
+  unsigned long foreign;
+  unsigned long orphan;
+  unsigned long shadowed;
+  unsigned long emptydir;
+  unsigned long repaired;
+  unsigned long errors;
+}
+found;
+
+static struct timespec started;
+
+static int get_config(const char *cfile)
+{
+  FILE *fp;
+  char temp[132];
+  char text[132];
+
+  if(!(fp = fopen(cfile, "r")))
+  {
+    fprintf(stderr, "Couldn't open config file: \"%s\"\n", cfile);
+    return -1;
+  }
+
+  nmounts = 1;
+
+  while(fgets(text, 131, fp))
+  {
+    if(strncmp("storage.metapath", text, 16) == 0)
+    {
+      sscanf(text, "storage.metapath %s", temp);
+      mounts[0] = strdup(temp);
+    }
+    else if(strncmp("storage.datapath", text, 16) == 0)
+    {
+      if(nmounts == MAX_STORAGE)
+      {
+        fprintf(stderr, "Too many storage mount points, %d max\n", MAX_STORAGE);
+        fclose(fp);
+        return -1;
+      }
+
+      sscanf(text, "storage.datapath %s", temp);
+      mounts[nmounts] = strdup(temp);
+      ++nmounts;
+    }
+  }
+
+  fclose(fp);
+
+  if(!mounts[0])
+  {
+    fprintf(stderr, "No meta mount point defined\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int mount_index(const char *real_path)
+{
+  int i;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    if(strncmp(real_path, mounts[i], lengths[i]) == 0 &&
+       real_path[lengths[i]] == '/') return i;
+  }
+
+  return 0;
+}
+
+/*
+  An unmounted data path is an empty directory on the parent file
+  system, so a mount has to sit on its own device or be marked.
+*/
+
+static int mount_check(const char *root)
+{
+  struct stat st;
+  struct stat parent_st;
+  char path[MAX_PATH];
+
+  if(stat(root, &st) == -1 || !S_ISDIR(st.st_mode)) return 0;
+
+  if(snprintf(path, MAX_PATH, "%s/..", root) >= MAX_PATH ||
+     stat(path, &parent_st) == -1) return 0;
+
+  if(st.st_dev != parent_st.st_dev) return 1;
+
+  return snprintf(path, MAX_PATH, "%s/%s", root, MOUNT_MARKER) < MAX_PATH &&
+    access(path, F_OK) == 0;
+}
+
+static void found_add(unsigned long *counter, const char *kind,
+  const char *path, const char *target, int fixed)
+{
+  __sync_fetch_and_add(counter, 1);
+  if(fixed) __sync_fetch_and_add(&found.repaired, 1);
+
+  pthread_mutex_lock(&report_lock);
+
+  if(target) fprintf(report, "%s\t%s\t%s%s\n", kind, path, target, fixed ? "\trepaired" : "");
+  else fprintf(report, "%s\t%s%s\n", kind, path, fixed ? "\trepaired" : "");
+
+  pthread_mutex_unlock(&report_lock);
+}
+
+/* Entries younger than min_age may belong to an operation in progress */
+
+static int settled(const struct stat *st)
+{
+  time_t now = time(NULL);
+  return now - st->st_mtime >= min_age && now - st->st_ctime >= min_age;
+}
+
+static void push(int self, int mount, const char *path)
+{
+  struct nc_task *task;
+  struct nc_deque *d = &deques[self];
+
+  task = malloc(sizeof(struct nc_task));
+  if(task == NULL) return;
+
+  task->mount = mount;
+  snprintf(task->path, MAX_PATH, "%s", path);
+
+  __sync_fetch_and_add(&pending, 1);
+
+  pthread_mutex_lock(&d->lock);
+  d->tasks[d->tail % DEQUE_SIZE] = task;
+  ++d->tail;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static struct nc_task *pop(int self)
+{
+  struct nc_task *task = NULL;
+  struct nc_deque *d = &deques[self];
+
+  pthread_mutex_lock(&d->lock);
+  if(d->tail > d->head)
+  {
+    --d->tail;
+    task = d->tasks[d->tail % DEQUE_SIZE];
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  return task;
+}
+
+static struct nc_task *steal(int self)
+{
+  int i, victim;
+  struct nc_task *task = NULL;
+  struct nc_deque *d;
+
+  for(i = 1; i < nthreads && task == NULL; ++i)
+  {
+    victim = (self + i) % nthreads;
+    d = &deques[victim];
+
+    if(d->tail == d->head) continue;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->tail > d->head)
+    {
+      task = d->tasks[d->head % DEQUE_SIZE];
+      ++d->head;
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+
+  if(task) ++counters[self].steals;
+
+  return task;
+}
+
+static int deque_full(int self)
+{
+  struct nc_deque *d = &deques[self];
+  return d->tail - d->head >= DEQUE_SIZE;
+}
+
+/* A meta symlink has to lead to an entry on a data mount */
+
+static void check_meta(const char *meta_path, const struct stat *st)
+{
+  int res;
+  int index;
+  struct stat target_st;
+  char target[MAX_PATH];
+
+  res = readlink(meta_path, target, MAX_PATH - 1);
+  if(res == -1)
+  {
+    __sync_fetch_and_add(&found.errors, 1);
+    return;
+  }
+
+  target[res] = '\0';
+
+  index = mount_index(target);
+
+  if(index == 0)
+  {
+    found_add(&found.foreign, "foreign", meta_path, target, 0);
+    return;
+  }
+
+  if(!reachable[index]) return;
+
+  if(lstat(target, &target_st) == 0 || errno != ENOENT || !settled(st)) return;
+
+  /* the mount may have gone away since the scan started */
+  res = repair && mount_check(mounts[index]) && unlink(meta_path) == 0;
+
+  found_add(&found.dangling, "dangling", meta_path, target, res);
+}
+
+/*
+  Stripe i of a striped file is named .srmlite-stripe.<i>.<name> and
+  belongs to the layout record .srmlite-layout.<name> in the meta
+  tree. Stripes are never given a meta symlink of their own.
+*/
+
+static void check_stripe(const char *path, const char *real_path,
+  const struct stat *st)
+{
+  const char *name = strrchr(path, '/') + 1;
+  const char *rest = strchr(name + sizeof(STRIPE_PREFIX) - 1, '.');
+  char meta_path[MAX_PATH];
+
+  if(rest == NULL || snprintf(meta_path, MAX_PATH, "%s%.*s%s%s", mounts[0],
+     (int) (name - path), path, LAYOUT_PREFIX, rest + 1) >= MAX_PATH) return;
+
+  if(access(meta_path, F_OK) == 0 || errno != ENOENT || !settled(st)) return;
+
+  found_add(&found.orphan, "orphan", real_path, NULL, 0);
+}
+
+/* A data entry has to be reached by the meta symlink of the same name */
+
+static void check_data(const char *path, const char *real_path,
+  const struct stat *st)
+{
+  int res, error;
+  size_t size;
+  const char *name = strrchr(path, '/') + 1;
+  char target[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(strncmp(name, STRIPE_PREFIX, sizeof(STRIPE_PREFIX) - 1) == 0)
+  {
+    check_stripe(path, real_path, st);
+    return;
+  }
+
+  if(strcmp(path, "/" MOUNT_MARKER) == 0) return;
+
+  /* a temp copy of an interrupted move must not become a user file */
+  size = strlen(name);
+  if(size >= sizeof(TEMP_SUFFIX) - 1 &&
+     strcmp(name + size - sizeof(TEMP_SUFFIX) + 1, TEMP_SUFFIX) == 0) return;
+
+  if(snprintf(meta_path, MAX_PATH, "%s%s", mounts[0], path) >= MAX_PATH) return;
+
+  res = readlink(meta_path, target, MAX_PATH - 1);
+  error = errno;
+
+  if(res == -1 && error != ENOENT && error != EINVAL)
+  {
+    __sync_fetch_and_add(&found.errors, 1);
+    return;
+  }
+
+  if(res >= 0) target[res] = '\0';
+
+  if((res >= 0 && strcmp(target, real_path) == 0) || !settled(st)) return;
+
+  if(res >= 0 || error == EINVAL)
+  {
+    found_add(&found.shadowed, "shadowed", real_path, res >= 0 ? target : meta_path, 0);
+    return;
+  }
+
+  res = 0;
+
+  if(repair)
+  {
+    res = symlink(real_path, meta_path) == 0;
+    if(res && lchown(meta_path, st->st_uid, st->st_gid) == -1) res = 0;
+  }
+
+  found_add(&found.orphan, "orphan", real_path, NULL, res);
+}
+
+static void scan(int self, struct nc_task *task)
+{
+  DIR *dp;
+  struct dirent *de;
+  struct stat st;
+  int count, mount = task->mount;
+  char path[MAX_PATH];
+  char real_path[MAX_PATH];
+
+  if(snprintf(real_path, MAX_PATH, "%s%s", mounts[mount], task->path) >= MAX_PATH) return;
+
+  dp = opendir(real_path);
+  if(dp == NULL)
+  {
+    if(errno != ENOENT) __sync_fetch_and_add(&found.errors, 1);
+    return;
+  }
+
+  ++counters[self].dirs;
+
+  count = 0;
+
+  while(!stopping && (de = readdir(dp)))
+  {
+    if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+    ++count;
+    ++counters[self].entries;
+
+    if(snprintf(path, MAX_PATH, "%s/%s", task->path, de->d_name) >= MAX_PATH ||
+       snprintf(real_path, MAX_PATH, "%s%s", mounts[mount], path) >= MAX_PATH) continue;
+
+    if(lstat(real_path, &st) == -1) continue;
+
+    if(S_ISDIR(st.st_mode))
+    {
+      if(deque_full(self))
+      {
+        struct nc_task inline_task;
+        inline_task.mount = mount;
+        snprintf(inline_task.path, MAX_PATH, "%s", path);
+        scan(self, &inline_task);
+      }
+      else
+      {
+        push(self, mount, path);
+      }
+    }
+    else if(mount == 0)
+    {
+      if(S_ISLNK(st.st_mode)) check_meta(real_path, &st);
+    }
+    else
+    {
+      check_data(path, real_path, &st);
+    }
+  }
+
+  closedir(dp);
+
+  if(mount == 0 || count > 0 || task->path[0] == '\0' || stopping) return;
+
+  snprintf(real_path, MAX_PATH, "%s%s", mounts[mount], task->path);
+
+  if(lstat(real_path, &st) == -1 || !settled(&st)) return;
+
+  found_add(&found.emptydir, "emptydir", real_path, NULL, repair && rmdir(real_path) == 0);
+}
+
+static void *worker(void *arg)
+{
+  int self = (int) (long) arg;
+  struct nc_task *task;
+
+  while(!stopping)
+  {
+    task = pop(self);
+    if(task == NULL) task = steal(self);
+
+    if(task == NULL)
+    {
+      if(pending == 0) break;
+      usleep(1000);
+      continue;
+    }
+
+    scan(self, task);
+    free(task);
+
+    __sync_fetch_and_sub(&pending, 1);
+  }
+
+  return NULL;
+}
+
+static void progress(const char *prefix)
+{
+  int i;
+  unsigned long entries = 0, dirs = 0, steals = 0;
+  double elapsed;
+  struct timespec now;
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    entries += counters[i].entries;
+    dirs += counters[i].dirs;
+    steals += counters[i].steals;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  elapsed = now.tv_sec - started.tv_sec + (now.tv_nsec - started.tv_nsec) / 1e9;
+  if(elapsed <= 0) elapsed = 1e-9;
+
+  fprintf(stderr, "%s%lu entries, %lu directories, %lu steals in %.1f s (%.0f entries/s), "
+    "dangling %lu, foreign %lu, orphan %lu, shadowed %lu, emptydir %lu, "
+    "repaired %lu, errors %lu\n", prefix, entries, dirs, steals, elapsed,
+    (double) entries / elapsed, found.dangling, found.foreign, found.orphan,
+    found.shadowed, found.emptydir, found.repaired, found.errors);
+}
+
+static void sig_handler(int sig)
+{
+  (void) sig;
+  stopping = 1;
+}
+
+static void usage(void)
+{
+  printf("Usage: nscheck -c config [-j threads] [-a seconds] [-o report] [-r]\n"
+         "  -j  scanning threads (default 16)\n"
+         "  -a  ignore entries changed within this many seconds (default 3600)\n"
+         "  -o  write the report to a file instead of stdout\n"
+         "  -r  repair dangling symlinks, orphans and empty data directories\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int i, opt, unmounted = 0;
+  char *config_file = NULL;
+  char *report_file = NULL;
+  pthread_t threads[MAX_THREADS];
+  struct sigaction sa;
+  time_t last;
+
+  while((opt = getopt(argc, argv, "c:j:a:o:r")) != -1)
+  {
+    switch(opt)
+    {
+      case 'c': config_file = optarg; break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'a': min_age = atoi(optarg); break;
+      case 'o': report_file = optarg; break;
+      case 'r': repair = 1; break;
+      default: usage(); return 1;
+    }
+  }
+
+  if(config_file == NULL)
+  {
+    usage();
+    return 1;
+  }
+
+  if(nthreads < 1) nthreads = 1;
+  if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+  if(get_config(config_file) == -1) return 1;
+
+  for(i = 0; i < nmounts; ++i)
+  {
+    lengths[i] = strlen(mounts[i]);
+  }
+
+  report = stdout;
+  if(report_file && !(report = fopen(report_file, "w")))
+  {
+    fprintf(stderr, "Cannot open %s: %s\n", report_file, strerror(errno));
+    return 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    pthread_mutex_init(&deques[i].lock, NULL);
+  }
+
+  reachable[0] = 1;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    reachable[i] = mount_check(mounts[i]);
+    if(reachable[i]) continue;
+    fprintf(stderr, "%s is not mounted, skipping it and the links into it\n", mounts[i]);
+    ++unmounted;
+  }
+
+  /* the roots are spread over the workers, stealing balances the rest */
+  for(i = 0; i < nmounts; ++i)
+  {
+    if(reachable[i]) push(i % nthreads, i, "");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    pthread_create(&threads[i], NULL, worker, (void *) (long) i);
+  }
+
+  last = time(NULL);
+
+  while(pending > 0 && !stopping)
+  {
+    usleep(100000);
+    if(time(NULL) - last >= REPORT_PERIOD)
+    {
+      last = time(NULL);
+      progress("");
+    }
+  }
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  progress(stopping ? "interrupted: " : "done: ");
+
+  if(report != stdout) fclose(report);
+
+  return unmounted > 0 || found.dangling + found.foreign + found.orphan +
+    found.shadowed + found.emptydir > found.repaired ? 2 : 0;
+}
@@ -0,0 +1,1516 @@
+/*
+  gcc -O2 -Wall -pthread rebalance.c -o rebalance
+
+  Moves files from data mounts that are fuller than the average to
+  mounts that are emptier, while srmlite keeps serving the namespace.
+  Each file is copied to a temporary name, verified, renamed into
+  place and then published by swapping its meta symlink. The old copy
+  is removed after a grace period, so srmlite path caches that still
+  point at it can expire first.
+
+  Files open on this host are found in /proc. Files open on other
+  srmlite nodes are found in the lists the nodes write to the
+  storage.openlist directory. The age of a list is the lease of its
+  node: while any list is older than LEASE_TIME nothing is moved, and
+  an old copy is only removed once every list has been rewritten
+  after the cache TTL of the swap and none of them names the file.
+  With storage.locindex the longer of that and storage.locindexttl
+  applies. A node that is gone for good has to have its list removed
+  by hand.
+  Without storage.openlist, rebalance only runs with -s, which states
+  that no other host serves the namespace.
+
+  Every step is written to a journal. After an interruption the next
+  run finishes or rolls back the moves that were in progress.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+
+#define MAX_STORAGE 100
+
+#define MAX_PATH 512
+
+#define COPY_CHUNK (8 << 20)
+
+#define STRIPE_PREFIX ".srmlite-stripe."
+#define MIRROR_PREFIX ".srmlite-mirror."
+
+#define QUEUE_SIZE 64
+
+#define OPEN_REFRESH 5
+
+#define LEASE_TIME 30
+
+#define ADLER_XATTR "user.adler32"
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+#define TEMP_SUFFIX ".rebalance"
+
+struct rb_mount
+{
+  char *path;
+  size_t len;
+  long long total;
+  long long used;
+  long long shed;
+  long long room;
+};
+
+struct rb_job
+{
+  int src;
+  int dst;
+  char meta_path[MAX_PATH];
+  char src_path[MAX_PATH];
+  char dst_path[MAX_PATH];
+};
+
+struct rb_ident
+{
+  dev_t dev;
+  ino_t ino;
+};
+
+struct rb_unlink
+{
+  time_t due;
+  time_t swapped;
+  off_t size;
+  struct timespec mtime;
+  char meta_path[MAX_PATH];
+  char src_path[MAX_PATH];
+  char dst_path[MAX_PATH];
+  struct rb_unlink *next;
+};
+
+static struct rb_mount mounts[MAX_STORAGE];
+static int nmounts = 0;
+
+static int nthreads = 4;
+static long long bandwidth = 0;
+static int threshold = 5;
+static int min_age = 3600;
+static int grace = 30;
+static int dry_run = 0;
+static int single_host = 0;
+static int cache_ttl = 5;
+static int locindex = 0;
+static int locindex_ttl = 5;
+static char *openlist = NULL;
+static const char *journal_file = "rebalance.journal";
+
+static volatile sig_atomic_t stopping = 0;
+
+/* Jobs from the namespace walk to the copy workers */
+
+struct
+{
+  struct rb_job *jobs[QUEUE_SIZE];
+  int head;
+  int count;
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+}
+queue;
+
+/* Shared token bucket for the bandwidth budget */
+
+struct
+{
+  struct timespec next;
+  pthread_mutex_t lock;
+}
+budget;
+
+/*
+  Files held open by processes on this host, srmlite included, and
+  the names in the open file lists of all srmlite nodes. leased is
+  the time of the oldest list, stale is set while a list is missing
+  its lease.
+*/
+
+struct
+{
+  struct rb_ident *items;
+  size_t count;
+  char **names;
+  size_t nnames;
+  time_t leased;
+  int stale;
+  time_t updated;
+  pthread_mutex_t lock;
+}
+busy;
+
+/* Journal and the source files that wait for their grace period */
+
+struct
+{
+  FILE *fp;
+  struct rb_unlink *head;
+  struct rb_unlink *tail;
+  int kept;
+  pthread_mutex_t lock;
+}
+journal;
+
+struct
+{
+  unsigned long moved;
+  unsigned long skipped;
+  unsigned long failed;
+  unsigned long long bytes;
+}
+counts;
+
+static int get_config(const char *cfile)
+{
+  FILE *fp;
+  char temp[132];
+  char text[132];
+
+  if(!(fp = fopen(cfile, "r")))
+  {
+    fprintf(stderr, "Couldn't open config file: \"%s\"\n", cfile);
+    return -1;
+  }
+
+  nmounts = 1;
+
+  while(fgets(text, 131, fp))
+  {
+    if(strncmp("storage.metapath", text, 16) == 0)
+    {
+      sscanf(text, "storage.metapath %s", temp);
+      mounts[0].path = strdup(temp);
+    }
+    else if(strncmp("storage.datapath", text, 16) == 0)
+    {
+      if(nmounts == MAX_STORAGE)
+      {
+        fprintf(stderr, "Too many storage mount points, %d max\n", MAX_STORAGE);
+        fclose(fp);
+        return -1;
+      }
+
+      sscanf(text, "storage.datapath %s", temp);
+      mounts[nmounts].path = strdup(temp);
+      ++nmounts;
+    }
+    else if(strncmp("storage.openlist", text, 16) == 0)
+    {
+      if(sscanf(text, "storage.openlist %s", temp) != 1) continue;
+      free(openlist);
+      openlist = strdup(temp);
+    }
+    else if(strncmp("storage.cachettl", text, 16) == 0)
+    {
+      sscanf(text, "storage.cachettl %d", &cache_ttl);
+    }
+    else if(strncmp("storage.locindexttl", text, 19) == 0)
+    {
+      sscanf(text, "storage.locindexttl %d", &locindex_ttl);
+    }
+    else if(strncmp("storage.locindex", text, 16) == 0 &&
+      (text[16] == ' ' || text[16] == '\t'))
+    {
+      locindex = sscanf(text, "storage.locindex %s", temp) == 1;
+    }
+  }
+
+  fclose(fp);
+
+  if(!mounts[0].path)
+  {
+    fprintf(stderr, "No meta mount point defined\n");
+    return -1;
+  }
+
+  mounts[0].len = strlen(mounts[0].path);
+
+  if(nmounts < 3)
+  {
+    fprintf(stderr, "At least two data mount points are needed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Returns the data mount that holds real_path, 0 if there is none */
+
+static int mount_index(const char *real_path)
+{
+  int i;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    if(strncmp(real_path, mounts[i].path, mounts[i].len) == 0 &&
+       real_path[mounts[i].len] == '/') return i;
+  }
+
+  return 0;
+}
+
+/*
+  Works out how many bytes each mount above the average fill level
+  should shed and how many each mount below it may take.
+*/
+
+static int plan(void)
+{
+  int i, sources;
+  long long total, used, share, excess;
+  struct statvfs st;
+
+  total = 0;
+  used = 0;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    mounts[i].len = strlen(mounts[i].path);
+
+    if(statvfs(mounts[i].path, &st) == -1)
+    {
+      fprintf(stderr, "Cannot stat %s: %s\n", mounts[i].path, strerror(errno));
+      return -1;
+    }
+
+    mounts[i].total = (long long) st.f_blocks * st.f_frsize;
+    mounts[i].used = (long long) (st.f_blocks - st.f_bavail) * st.f_frsize;
+
+    total += mounts[i].total;
+    used += mounts[i].used;
+  }
+
+  if(total == 0) return 0;
+
+  sources = 0;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    share = (long long) ((double) used / total * mounts[i].total);
+    excess = mounts[i].used - share;
+
+    printf("%-32s %5.1f%% used, %+lld bytes from average\n", mounts[i].path,
+      mounts[i].total ? 100.0 * mounts[i].used / mounts[i].total : 0.0, excess);
+
+    /* mounts within the threshold of the average are left alone */
+    mounts[i].shed = excess * 100 > (long long) threshold * mounts[i].total ? excess : 0;
+    mounts[i].room = excess < 0 ? -excess : 0;
+
+    if(mounts[i].shed > 0) ++sources;
+  }
+
+  return sources;
+}
+
+static int ident_cmp(const void *a, const void *b)
+{
+  const struct rb_ident *x = a;
+  const struct rb_ident *y = b;
+
+  if(x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+  if(x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+  return 0;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Reads the open file lists of all srmlite nodes */
+
+static void lists_refresh(void)
+{
+  DIR *dp;
+  FILE *fp;
+  struct dirent *e;
+  struct stat st;
+  char **names, **grown;
+  char *line;
+  size_t i, count, size, len;
+  time_t now, oldest;
+  int stale;
+  char path[MAX_PATH];
+
+  names = NULL;
+  count = 0;
+  size = 0;
+  line = NULL;
+  len = 0;
+  now = time(NULL);
+  oldest = now;
+  stale = 0;
+
+  dp = opendir(openlist);
+  if(dp == NULL) stale = 1;
+
+  while(dp && (e = readdir(dp)))
+  {
+    /* dot files are lists that are still being written */
+    if(e->d_name[0] == '.') continue;
+
+    if(snprintf(path, MAX_PATH, "%s/%s", openlist, e->d_name) >= MAX_PATH) continue;
+
+    fp = fopen(path, "r");
+    if(fp == NULL)
+    {
+      stale = 1;
+      continue;
+    }
+
+    if(fstat(fileno(fp), &st) == -1 || now - st.st_mtime > LEASE_TIME)
+    {
+      if(!busy.stale) fprintf(stderr, "Open file list %s has no lease, not moving\n", path);
+      stale = 1;
+    }
+    else if(st.st_mtime < oldest)
+    {
+      oldest = st.st_mtime;
+    }
+
+    while(getdelim(&line, &len, '\0', fp) > 0)
+    {
+      if(count == size)
+      {
+        size = size ? 2 * size : 1024;
+        grown = realloc(names, size * sizeof(char *));
+        if(grown == NULL) break;
+        names = grown;
+      }
+
+      names[count] = strdup(line);
+      if(names[count] == NULL) break;
+      ++count;
+    }
+
+    /* an incomplete list cannot tell that a file is not open */
+    if(ferror(fp) || !feof(fp)) stale = 1;
+
+    fclose(fp);
+  }
+
+  if(dp) closedir(dp);
+  else if(!busy.stale) fprintf(stderr, "Cannot read %s: %s\n", openlist, strerror(errno));
+
+  free(line);
+
+  qsort(names, count, sizeof(char *), name_cmp);
+
+  for(i = 0; i < busy.nnames; ++i)
+  {
+    free(busy.names[i]);
+  }
+  free(busy.names);
+
+  busy.names = names;
+  busy.nnames = count;
+  busy.leased = oldest;
+  busy.stale = stale;
+}
+
+/* Collects the files open in every process visible in /proc */
+
+static void busy_refresh(void)
+{
+  DIR *proc, *fds;
+  struct dirent *p, *e;
+  struct stat st;
+  struct rb_ident *items, *grown;
+  size_t count, size;
+  char path[MAX_PATH];
+
+  proc = opendir("/proc");
+  if(proc == NULL) return;
+
+  items = NULL;
+  count = 0;
+  size = 0;
+
+  while((p = readdir(proc)))
+  {
+    if(p->d_name[0] < '0' || p->d_name[0] > '9') continue;
+
+    snprintf(path, MAX_PATH, "/proc/%.32s/fd", p->d_name);
+
+    fds = opendir(path);
+    if(fds == NULL) continue;
+
+    while((e = readdir(fds)))
+    {
+      if(e->d_name[0] == '.') continue;
+
+      snprintf(path, MAX_PATH, "/proc/%.32s/fd/%.32s", p->d_name, e->d_name);
+
+      if(stat(path, &st) == -1 || !S_ISREG(st.st_mode)) continue;
+
+      if(count == size)
+      {
+        size = size ? 2 * size : 1024;
+        grown = realloc(items, size * sizeof(struct rb_ident));
+        if(grown == NULL) break;
+        items = grown;
+      }
+
+      items[count].dev = st.st_dev;
+      items[count].ino = st.st_ino;
+      ++count;
+    }
+
+    closedir(fds);
+  }
+
+  closedir(proc);
+
+  qsort(items, count, sizeof(struct rb_ident), ident_cmp);
+
+  free(busy.items);
+  busy.items = items;
+  busy.count = count;
+
+  if(openlist) lists_refresh();
+
+  busy.updated = time(NULL);
+}
+
+/*
+  Returns 1 if the file st of meta_path is open on this host or on
+  any srmlite node, or if that cannot be told because a lease ran
+  out. fresh asks for a look at /proc and the lists that is at most
+  a second old.
+*/
+
+static int busy_check(const struct stat *st, const char *meta_path, int fresh)
+{
+  int res;
+  const char *name;
+  struct rb_ident key;
+
+  key.dev = st->st_dev;
+  key.ino = st->st_ino;
+
+  name = meta_path + mounts[0].len;
+
+  pthread_mutex_lock(&busy.lock);
+
+  if(time(NULL) - busy.updated >= (fresh ? 1 : OPEN_REFRESH)) busy_refresh();
+
+  res = busy.stale ||
+    (busy.count > 0 &&
+     bsearch(&key, busy.items, busy.count, sizeof(struct rb_ident), ident_cmp) != NULL) ||
+    (busy.nnames > 0 &&
+     bsearch(&name, busy.names, busy.nnames, sizeof(char *), name_cmp) != NULL);
+
+  pthread_mutex_unlock(&busy.lock);
+
+  return res;
+}
+
+/* Time of the oldest open file list, or now without lists */
+
+static time_t busy_leased(void)
+{
+  time_t res;
+
+  pthread_mutex_lock(&busy.lock);
+
+  if(time(NULL) - busy.updated >= 1) busy_refresh();
+
+  if(openlist == NULL) res = time(NULL);
+  else res = busy.stale ? 0 : busy.leased;
+
+  pthread_mutex_unlock(&busy.lock);
+
+  return res;
+}
+
+/* Waits until the bandwidth budget allows another size bytes */
+
+static void throttle(size_t size)
+{
+  long long nsec;
+  struct timespec now, wait;
+
+  if(bandwidth <= 0) return;
+
+  nsec = (long long) ((double) size * 1000000000.0 / bandwidth);
+
+  pthread_mutex_lock(&budget.lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if(budget.next.tv_sec < now.tv_sec ||
+     (budget.next.tv_sec == now.tv_sec && budget.next.tv_nsec < now.tv_nsec))
+  {
+    budget.next = now;
+  }
+
+  wait = budget.next;
+
+  budget.next.tv_nsec += nsec % 1000000000;
+  budget.next.tv_sec += nsec / 1000000000 + budget.next.tv_nsec / 1000000000;
+  budget.next.tv_nsec %= 1000000000;
+
+  pthread_mutex_unlock(&budget.lock);
+
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wait, NULL);
+}
+
+/* A copy record also holds the size and mtime the copy was made from */
+
+static void journal_write(const char *state, const char *meta_path,
+  const char *src_path, const char *dst_path, off_t size, const struct timespec *mtime)
+{
+  pthread_mutex_lock(&journal.lock);
+
+  fprintf(journal.fp, "%s\t%s\t%s\t%s", state, meta_path, src_path, dst_path);
+  if(mtime)
+  {
+    fprintf(journal.fp, "\t%lld %lld.%09ld", (long long) size,
+      (long long) mtime->tv_sec, mtime->tv_nsec);
+  }
+  fputc('\n', journal.fp);
+  fflush(journal.fp);
+  fdatasync(fileno(journal.fp));
+
+  pthread_mutex_unlock(&journal.lock);
+}
+
+/* Returns 1 if the meta symlink points at target */
+
+static int meta_points(const char *meta_path, const char *target)
+{
+  int res;
+  char link[MAX_PATH];
+
+  res = readlink(meta_path, link, MAX_PATH - 1);
+  if(res == -1) return 0;
+
+  link[res] = '\0';
+
+  return strcmp(link, target) == 0;
+}
+
+/* Points the meta symlink at target, keeping the owner of the old one */
+
+static int meta_swap(const char *meta_path, const char *target, const struct stat *owner)
+{
+  int res;
+  char meta_temp[MAX_PATH + 16];
+
+  snprintf(meta_temp, sizeof(meta_temp), "%s" TEMP_SUFFIX, meta_path);
+
+  if(symlink(target, meta_temp) == -1) return -1;
+
+  if(lchown(meta_temp, owner->st_uid, owner->st_gid) == -1 ||
+     rename(meta_temp, meta_path) == -1)
+  {
+    res = errno;
+    unlink(meta_temp);
+    errno = res;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Queues the old copy of a published move for removal */
+
+static void unlink_queue(const char *meta_path, const char *src_path,
+  const char *dst_path, off_t size, const struct timespec *mtime)
+{
+  struct rb_unlink *u;
+
+  u = malloc(sizeof(struct rb_unlink));
+  if(u == NULL) return;
+
+  u->swapped = time(NULL);
+  u->due = u->swapped + grace;
+  u->size = size;
+  u->mtime = *mtime;
+  u->next = NULL;
+  snprintf(u->meta_path, MAX_PATH, "%s", meta_path);
+  snprintf(u->src_path, MAX_PATH, "%s", src_path);
+  snprintf(u->dst_path, MAX_PATH, "%s", dst_path);
+
+  pthread_mutex_lock(&journal.lock);
+  if(journal.tail) journal.tail->next = u;
+  else journal.head = u;
+  journal.tail = u;
+  pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+  Finishes the moves of an interrupted run. A move whose meta symlink
+  already points at the new copy only needs the old copy removed,
+  which is queued like the removals of a new move, as nodes may have
+  opened the old copy until the swap. Any other move is rolled back
+  by removing the new copy.
+*/
+
+static int journal_recover(void)
+{
+  FILE *fp;
+  int i, n, size, count;
+  long long bytes, sec;
+  long nsec;
+  struct stat st;
+  char line[4 * MAX_PATH];
+  char temp_path[MAX_PATH + 16];
+  char *fields[5];
+  char *ptr;
+  struct
+  {
+    char meta_path[MAX_PATH];
+    char src_path[MAX_PATH];
+    char dst_path[MAX_PATH];
+    off_t size;
+    struct timespec mtime;
+    int known;
+    int done;
+  }
+  *moves = NULL, *grown;
+
+  fp = fopen(journal_file, "r");
+  if(fp == NULL) return errno == ENOENT ? 0 : -1;
+
+  count = 0;
+  size = 0;
+
+  while(fgets(line, sizeof(line), fp))
+  {
+    line[strcspn(line, "\n")] = '\0';
+
+    ptr = line;
+    fields[4] = NULL;
+    for(n = 0; n < 5 && ptr; ++n)
+    {
+      fields[n] = strsep(&ptr, "\t");
+    }
+    if(n < 4 || fields[3] == NULL) continue;
+
+    if(strcmp(fields[0], "copy") == 0)
+    {
+      if(count == size)
+      {
+        size = size ? 2 * size : 64;
+        grown = realloc(moves, size * sizeof(*moves));
+        if(grown == NULL) break;
+        moves = grown;
+      }
+      snprintf(moves[count].meta_path, MAX_PATH, "%s", fields[1]);
+      snprintf(moves[count].src_path, MAX_PATH, "%s", fields[2]);
+      snprintf(moves[count].dst_path, MAX_PATH, "%s", fields[3]);
+      /* journals of older runs have no size and mtime */
+      moves[count].known = fields[4] &&
+        sscanf(fields[4], "%lld %lld.%ld", &bytes, &sec, &nsec) == 3;
+      if(moves[count].known)
+      {
+        moves[count].size = bytes;
+        moves[count].mtime.tv_sec = sec;
+        moves[count].mtime.tv_nsec = nsec;
+      }
+      moves[count].done = 0;
+      ++count;
+      continue;
+    }
+
+    for(i = 0; i < count; ++i)
+    {
+      if(strcmp(moves[i].src_path, fields[2]) != 0) continue;
+      if(strcmp(fields[0], "done") == 0 || strcmp(fields[0], "abort") == 0) moves[i].done = 1;
+    }
+  }
+
+  fclose(fp);
+
+  for(i = 0; i < count; ++i)
+  {
+    if(moves[i].done) continue;
+
+    snprintf(temp_path, sizeof(temp_path), "%s" TEMP_SUFFIX, moves[i].dst_path);
+    unlink(temp_path);
+
+    snprintf(temp_path, sizeof(temp_path), "%s" TEMP_SUFFIX, moves[i].meta_path);
+    unlink(temp_path);
+
+    if(meta_points(moves[i].meta_path, moves[i].dst_path))
+    {
+      /* the new copy kept the mtime of the old one */
+      if(!moves[i].known && lstat(moves[i].dst_path, &st) == 0)
+      {
+        moves[i].size = st.st_size;
+        moves[i].mtime = st.st_mtim;
+        moves[i].known = 1;
+      }
+
+      if(!moves[i].known)
+      {
+        fprintf(stderr, "Cannot complete move of %s: %s\n", moves[i].meta_path, strerror(errno));
+        continue;
+      }
+
+      printf("Completing move of %s\n", moves[i].meta_path);
+      unlink_queue(moves[i].meta_path, moves[i].src_path, moves[i].dst_path,
+        moves[i].size, &moves[i].mtime);
+      continue;
+    }
+
+    printf("Rolling back move of %s\n", moves[i].meta_path);
+
+    if(unlink(moves[i].dst_path) == -1 && errno != ENOENT)
+    {
+      fprintf(stderr, "Cannot remove %s: %s\n", moves[i].dst_path, strerror(errno));
+    }
+  }
+
+  free(moves);
+
+  return 0;
+}
+
+/* Creates the parent directories of dst_path like xmp_makerealdir */
+
+static int make_dirs(const char *dst_path, int index)
+{
+  int res;
+  struct stat st;
+  char *ptr;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  snprintf(real_path, MAX_PATH, "%s", dst_path);
+
+  for(ptr = real_path + mounts[index].len + 1; (ptr = strchr(ptr, '/')); ++ptr)
+  {
+    *ptr = '\0';
+
+    res = access(real_path, F_OK);
+    if(res == -1)
+    {
+      snprintf(meta_path, MAX_PATH, "%s%s", mounts[0].path, real_path + mounts[index].len);
+
+      res = stat(meta_path, &st);
+      if(res == 0) res = mkdir(real_path, 0755);
+      if(res == -1 && errno == EEXIST) res = 0;
+      if(res == 0) res = chmod(real_path, st.st_mode|S_IWUSR);
+      if(res == 0) res = lchown(real_path, st.st_uid, st.st_gid);
+      if(res == -1) return -1;
+    }
+
+    *ptr = '/';
+  }
+
+  return 0;
+}
+
+static uint32_t adler32(uint32_t adler, const unsigned char *buf, size_t size)
+{
+  size_t n;
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+
+  while(size > 0)
+  {
+    n = size < ADLER_NMAX ? size : ADLER_NMAX;
+    size -= n;
+    while(n--)
+    {
+      a += *buf++;
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+  }
+
+  return (b << 16) | a;
+}
+
+static int file_adler32(int fd, uint32_t *adler, char *buf)
+{
+  ssize_t res;
+  off_t offset = 0;
+
+  *adler = 1;
+
+  while((res = pread(fd, buf, COPY_CHUNK, offset)) > 0)
+  {
+    throttle(res);
+    *adler = adler32(*adler, (unsigned char *) buf, res);
+    offset += res;
+  }
+
+  return res == -1 ? -1 : 0;
+}
+
+/*
+  Compares the Adler-32 of the copy with the value srmlite stored on
+  the source, or with the checksum of the source if there is none.
+  A stored value only counts while the source still has the size and
+  modification time it was computed for. The copy gets the same value
+  and, once its times are set, the same size and modification time.
+*/
+
+static int verify(int src_fd, int dst_fd, const struct stat *st, char *buf)
+{
+  ssize_t res;
+  long long size, sec;
+  long nsec;
+  unsigned int stored;
+  uint32_t src_adler, dst_adler;
+  char value[64];
+
+  if(file_adler32(dst_fd, &dst_adler, buf) == -1) return -1;
+
+  res = fgetxattr(src_fd, ADLER_XATTR, value, sizeof(value) - 1);
+  if(res > 0) value[res] = '\0';
+
+  if(res > 0 && sscanf(value, "%8x %lld %lld.%ld", &stored, &size, &sec, &nsec) == 4 &&
+     size == st->st_size && sec == st->st_mtim.tv_sec && nsec == st->st_mtim.tv_nsec)
+  {
+    src_adler = stored;
+    if(fsetxattr(dst_fd, ADLER_XATTR, value, res, 0) == -1 && errno != ENOTSUP) return -1;
+  }
+  else if(file_adler32(src_fd, &src_adler, buf) == -1)
+  {
+    return -1;
+  }
+
+  if(src_adler != dst_adler)
+  {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Copies with copy_file_range and falls back to sendfile across file systems */
+
+static int copy_data(int src_fd, int dst_fd, off_t size)
+{
+  ssize_t res;
+  size_t chunk;
+  off_t offset = 0;
+  int fallback = 0;
+
+  while(offset < size && !stopping)
+  {
+    chunk = size - offset < COPY_CHUNK ? size - offset : COPY_CHUNK;
+
+    throttle(chunk);
+
+    if(!fallback)
+    {
+      res = copy_file_range(src_fd, &offset, dst_fd, NULL, chunk, 0);
+      if(res == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+      {
+        fallback = 1;
+        continue;
+      }
+    }
+    else
+    {
+      res = sendfile(dst_fd, src_fd, &offset, chunk);
+    }
+
+    if(res == -1) return -1;
+    if(res == 0) break;
+  }
+
+  if(offset != size)
+  {
+    errno = stopping ? EINTR : EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+    a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+  Moves one file. Returns 1 if the file was moved, 0 if it was
+  skipped and -1 on error. The source is only removed later, once its
+  grace period has passed.
+*/
+
+static int move_file(struct rb_job *job, char *buf)
+{
+  int src_fd, dst_fd;
+  int res;
+  struct stat st, now, owner;
+  struct timespec times[2];
+  char temp_path[MAX_PATH + 16];
+
+  if(lstat(job->src_path, &st) == -1) return -1;
+
+  if(!S_ISREG(st.st_mode) || time(NULL) - st.st_mtime < min_age ||
+     busy_check(&st, job->meta_path, 0)) return 0;
+
+  if(dry_run)
+  {
+    printf("%s -> %s\n", job->src_path, job->dst_path);
+    return 1;
+  }
+
+  snprintf(temp_path, sizeof(temp_path), "%s" TEMP_SUFFIX, job->dst_path);
+
+  if(make_dirs(job->dst_path, job->dst) == -1) return -1;
+
+  src_fd = open(job->src_path, O_RDONLY);
+  if(src_fd == -1) return -1;
+
+  journal_write("copy", job->meta_path, job->src_path, job->dst_path, st.st_size, &st.st_mtim);
+
+  dst_fd = open(temp_path, O_RDWR|O_CREAT|O_EXCL, st.st_mode & 07777);
+  if(dst_fd == -1) goto fail_src;
+
+  if(copy_data(src_fd, dst_fd, st.st_size) == -1 ||
+     fsync(dst_fd) == -1 ||
+     verify(src_fd, dst_fd, &st, buf) == -1) goto fail_dst;
+
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+
+  if(fchown(dst_fd, st.st_uid, st.st_gid) == -1 ||
+     fchmod(dst_fd, st.st_mode & 07777) == -1 ||
+     futimens(dst_fd, times) == -1) goto fail_dst;
+
+  /* a writer that slipped past the checks cancels the move */
+  if(fstat(src_fd, &now) == -1 || !same_file(&st, &now) ||
+     busy_check(&st, job->meta_path, 1))
+  {
+    errno = EBUSY;
+    goto fail_dst;
+  }
+
+  if(rename(temp_path, job->dst_path) == -1) goto fail_dst;
+
+  if(!meta_points(job->meta_path, job->src_path) ||
+     lstat(job->meta_path, &owner) == -1 ||
+     meta_swap(job->meta_path, job->dst_path, &owner) == -1)
+  {
+    unlink(job->dst_path);
+    goto fail_dst;
+  }
+
+  journal_write("swap", job->meta_path, job->src_path, job->dst_path, 0, NULL);
+
+  close(dst_fd);
+  close(src_fd);
+
+  __sync_fetch_and_add(&counts.bytes, st.st_size);
+
+  unlink_queue(job->meta_path, job->src_path, job->dst_path, st.st_size, &st.st_mtim);
+
+  return 1;
+
+fail_dst:
+  res = errno;
+  close(dst_fd);
+  unlink(temp_path);
+  errno = res;
+
+fail_src:
+  res = errno;
+  close(src_fd);
+  journal_write("abort", job->meta_path, job->src_path, job->dst_path, 0, NULL);
+  errno = res;
+
+  return errno == EBUSY ? 0 : -1;
+}
+
+static int same_data(const struct stat *st, const struct rb_unlink *u)
+{
+  return st->st_size == u->size && st->st_mtim.tv_sec == u->mtime.tv_sec &&
+    st->st_mtim.tv_nsec == u->mtime.tv_nsec;
+}
+
+/*
+  The old copy changed after the swap, so a node wrote to it through
+  a handle from before the swap. Unless the new copy changed as well,
+  the meta symlink goes back to the old copy and the new copy waits
+  for its own grace period. Returns 0 once the move is rolled back.
+*/
+
+static int rollback(struct rb_unlink *u)
+{
+  struct stat st, owner;
+
+  if(lstat(u->dst_path, &st) == -1 || !same_data(&st, u))
+  {
+    fprintf(stderr, "Both copies of %s changed, keeping %s and %s\n",
+      u->meta_path, u->src_path, u->dst_path);
+    return -1;
+  }
+
+  if(!meta_points(u->meta_path, u->dst_path) ||
+     lstat(u->meta_path, &owner) == -1 ||
+     meta_swap(u->meta_path, u->src_path, &owner) == -1)
+  {
+    fprintf(stderr, "Cannot roll back move of %s: %s\n", u->meta_path, strerror(errno));
+    return -1;
+  }
+
+  printf("Rolling back move of %s, the old copy changed\n", u->meta_path);
+
+  journal_write("copy", u->meta_path, u->dst_path, u->src_path, u->size, &u->mtime);
+  journal_write("swap", u->meta_path, u->dst_path, u->src_path, 0, NULL);
+
+  unlink_queue(u->meta_path, u->dst_path, u->src_path, u->size, &u->mtime);
+
+  return 0;
+}
+
+/*
+  Decides about the old copy of a published move: 1 if it can be
+  removed, 0 while a node may still use it, 2 if the move was rolled
+  back and -1 if both copies have to stay.
+*/
+
+static int settle(struct rb_unlink *u)
+{
+  int ttl;
+  struct stat st;
+
+  if(lstat(u->src_path, &st) == -1) return errno == ENOENT ? 1 : -1;
+
+  if(!same_data(&st, u)) return rollback(u) == 0 ? 2 : -1;
+
+  /* the location index of srmlite keeps old paths for its own ttl */
+  ttl = cache_ttl;
+  if(locindex && locindex_ttl > ttl) ttl = locindex_ttl;
+
+  /* nodes may open the old copy until their path caches expire */
+  if(busy_leased() <= u->swapped + ttl ||
+     busy_check(&st, u->meta_path, 0)) return 0;
+
+  return 1;
+}
+
+/*
+  Removes the old copies whose grace period has passed and that no
+  node has open. On shutdown the rest is left to the journal recovery
+  of the next run, after waiting up to LEASE_TIME for open copies.
+*/
+
+static void reap(int all)
+{
+  int res;
+  struct rb_unlink *u;
+
+  while(!stopping)
+  {
+    pthread_mutex_lock(&journal.lock);
+
+    u = journal.head;
+    if(u && (all || u->due <= time(NULL)))
+    {
+      journal.head = u->next;
+      if(journal.head == NULL) journal.tail = NULL;
+    }
+    else
+    {
+      u = NULL;
+    }
+
+    pthread_mutex_unlock(&journal.lock);
+
+    if(u == NULL) return;
+
+    if(u->due > time(NULL)) sleep(u->due - time(NULL));
+
+    res = settle(u);
+
+    if(res == 0 && !(all && time(NULL) > u->swapped + grace + LEASE_TIME))
+    {
+      u->due = time(NULL) + (all ? 1 : OPEN_REFRESH);
+      u->next = NULL;
+
+      pthread_mutex_lock(&journal.lock);
+      if(journal.tail) journal.tail->next = u;
+      else journal.head = u;
+      journal.tail = u;
+      pthread_mutex_unlock(&journal.lock);
+
+      continue;
+    }
+
+    if(res == 1 && unlink(u->src_path) == -1 && errno != ENOENT)
+    {
+      fprintf(stderr, "Cannot remove %s: %s\n", u->src_path, strerror(errno));
+    }
+
+    if(res > 0)
+    {
+      journal_write("done", u->meta_path, u->src_path, u->dst_path, 0, NULL);
+    }
+    else
+    {
+      __sync_fetch_and_add(&journal.kept, 1);
+    }
+
+    free(u);
+  }
+}
+
+static void *worker(void *arg)
+{
+  int res;
+  char *buf;
+  struct rb_job *job;
+
+  (void) arg;
+
+  buf = malloc(COPY_CHUNK);
+  if(buf == NULL) return NULL;
+
+  while(1)
+  {
+    pthread_mutex_lock(&queue.lock);
+
+    while(queue.count == 0 && !queue.done) pthread_cond_wait(&queue.cond, &queue.lock);
+
+    if(queue.count == 0)
+    {
+      pthread_mutex_unlock(&queue.lock);
+      break;
+    }
+
+    job = queue.jobs[queue.head];
+    queue.head = (queue.head + 1) % QUEUE_SIZE;
+    --queue.count;
+
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    res = stopping ? 0 : move_file(job, buf);
+
+    if(res == 1)
+    {
+      __sync_fetch_and_add(&counts.moved, 1);
+    }
+    else if(res == 0)
+    {
+      __sync_fetch_and_add(&counts.skipped, 1);
+    }
+    else
+    {
+      __sync_fetch_and_add(&counts.failed, 1);
+      fprintf(stderr, "Cannot move %s: %s\n", job->src_path, strerror(errno));
+    }
+
+    free(job);
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+static void submit(struct rb_job *job)
+{
+  pthread_mutex_lock(&queue.lock);
+
+  while(queue.count == QUEUE_SIZE) pthread_cond_wait(&queue.cond, &queue.lock);
+
+  queue.jobs[(queue.head + queue.count) % QUEUE_SIZE] = job;
+  ++queue.count;
+
+  pthread_cond_broadcast(&queue.cond);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+/* The mount that still has the most room to take data */
+
+static int pick_target(void)
+{
+  int i, index = 0;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    if(mounts[i].room > 0 && (index == 0 || mounts[i].room > mounts[index].room)) index = i;
+  }
+
+  return index;
+}
+
+/*
+  Walks the meta tree and queues files that live on mounts that are
+  still above their share. Returns 1 once nothing is left to move.
+*/
+
+static int walk(const char *meta_dir)
+{
+  DIR *dp;
+  struct dirent *de;
+  struct stat st;
+  struct rb_job *job;
+  int res, src, dst, finished;
+  char *name;
+  char meta_path[MAX_PATH];
+  char real_path[MAX_PATH];
+
+  dp = opendir(meta_dir);
+  if(dp == NULL)
+  {
+    fprintf(stderr, "Cannot open %s: %s\n", meta_dir, strerror(errno));
+    return 0;
+  }
+
+  finished = 0;
+
+  while(!finished && !stopping && (de = readdir(dp)))
+  {
+    if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+    /* mirror copies are dropped and made again by srmlite */
+    if(strncmp(de->d_name, MIRROR_PREFIX, sizeof(MIRROR_PREFIX) - 1) == 0) continue;
+
+    if(snprintf(meta_path, MAX_PATH, "%s/%s", meta_dir, de->d_name) >= MAX_PATH) continue;
+
+    if(lstat(meta_path, &st) == -1) continue;
+
+    if(S_ISDIR(st.st_mode))
+    {
+      finished = walk(meta_path);
+      continue;
+    }
+
+    if(!S_ISLNK(st.st_mode)) continue;
+
+    res = readlink(meta_path, real_path, MAX_PATH - 1);
+    if(res == -1) continue;
+    real_path[res] = '\0';
+
+    /* the layout record of a striped file lists its stripes by path */
+    name = strrchr(real_path, '/');
+    if(name && strncmp(name + 1, STRIPE_PREFIX, sizeof(STRIPE_PREFIX) - 1) == 0) continue;
+
+    src = mount_index(real_path);
+    if(src == 0 || mounts[src].shed <= 0) continue;
+
+    dst = pick_target();
+    if(dst == 0)
+    {
+      finished = 1;
+      break;
+    }
+
+    if(lstat(real_path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) continue;
+
+    /* moving more than the surplus would only swap the roles of the mounts */
+    if(st.st_size > mounts[src].shed || st.st_size > mounts[dst].room) continue;
+
+    job = malloc(sizeof(struct rb_job));
+    if(job == NULL) break;
+
+    job->src = src;
+    job->dst = dst;
+    snprintf(job->meta_path, MAX_PATH, "%s", meta_path);
+    snprintf(job->src_path, MAX_PATH, "%s", real_path);
+    if(snprintf(job->dst_path, MAX_PATH, "%s%s", mounts[dst].path,
+         real_path + mounts[src].len) >= MAX_PATH)
+    {
+      free(job);
+      continue;
+    }
+
+    mounts[src].shed -= st.st_size;
+    mounts[dst].room -= st.st_size;
+
+    submit(job);
+
+    reap(0);
+  }
+
+  closedir(dp);
+
+  return finished;
+}
+
+static void sig_handler(int sig)
+{
+  (void) sig;
+  stopping = 1;
+}
+
+/* Starts a new journal that holds the removals left from the last run */
+
+static int journal_open(void)
+{
+  struct rb_unlink *u;
+
+  journal.fp = fopen(journal_file, "w");
+  if(journal.fp == NULL) return -1;
+
+  for(u = journal.head; u; u = u->next)
+  {
+    journal_write("copy", u->meta_path, u->src_path, u->dst_path, u->size, &u->mtime);
+    journal_write("swap", u->meta_path, u->src_path, u->dst_path, 0, NULL);
+  }
+
+  return 0;
+}
+
+static void usage(void)
+{
+  printf("Usage: rebalance -c config [-j threads] [-b bytes/s] [-t percent]\n"
+         "       [-a seconds] [-g seconds] [-l journal] [-n] [-s]\n"
+         "  -j  copy workers (default 4)\n"
+         "  -b  bandwidth budget for copy and verify, 0 for none (default 0)\n"
+         "  -t  tolerated deviation from the average fill level (default 5)\n"
+         "  -a  skip files modified within this many seconds (default 3600)\n"
+         "  -g  delay before an old copy is removed (default 30)\n"
+         "  -l  journal file (default rebalance.journal)\n"
+         "  -n  only print what would be moved\n"
+         "  -s  no other host serves the namespace, needed without storage.openlist\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int i, opt, sources;
+  char *config_file = NULL;
+  pthread_t threads[64];
+  struct sigaction sa;
+  struct timespec start, stop;
+  double elapsed;
+
+  while((opt = getopt(argc, argv, "c:j:b:t:a:g:l:ns")) != -1)
+  {
+    switch(opt)
+    {
+      case 'c': config_file = optarg; break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'b': bandwidth = atoll(optarg); break;
+      case 't': threshold = atoi(optarg); break;
+      case 'a': min_age = atoi(optarg); break;
+      case 'g': grace = atoi(optarg); break;
+      case 'l': journal_file = optarg; break;
+      case 'n': dry_run = 1; break;
+      case 's': single_host = 1; break;
+      default: usage(); return 1;
+    }
+  }
+
+  if(config_file == NULL)
+  {
+    usage();
+    return 1;
+  }
+
+  if(nthreads < 1) nthreads = 1;
+  if(nthreads > 64) nthreads = 64;
+
+  if(get_config(config_file) == -1) return 1;
+
+  if(openlist == NULL && !single_host && !dry_run)
+  {
+    fprintf(stderr, "Files open on other nodes are only seen with storage.openlist set, "
+      "use -s if no other host serves the namespace\n");
+    return 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.cond, NULL);
+  pthread_mutex_init(&budget.lock, NULL);
+  pthread_mutex_init(&busy.lock, NULL);
+  pthread_mutex_init(&journal.lock, NULL);
+
+  if(!dry_run && journal_recover() == -1)
+  {
+    fprintf(stderr, "Cannot read journal %s: %s\n", journal_file, strerror(errno));
+    return 1;
+  }
+
+  sources = plan();
+
+  if(sources <= 0 && journal.head == NULL)
+  {
+    if(!dry_run) unlink(journal_file);
+    return 0;
+  }
+
+  if(!dry_run && journal_open() == -1)
+  {
+    fprintf(stderr, "Cannot open journal %s: %s\n", journal_file, strerror(errno));
+    return 1;
+  }
+
+  pthread_mutex_lock(&busy.lock);
+  busy_refresh();
+  pthread_mutex_unlock(&busy.lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if(sources > 0)
+  {
+    for(i = 0; i < nthreads; ++i)
+    {
+      pthread_create(&threads[i], NULL, worker, NULL);
+    }
+
+    walk(mounts[0].path);
+
+    pthread_mutex_lock(&queue.lock);
+    queue.done = 1;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    for(i = 0; i < nthreads; ++i)
+    {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  if(!dry_run)
+  {
+    reap(1);
+    fclose(journal.fp);
+
+    /* everything has been completed, so the journal is no longer needed */
+    if(!stopping && journal.head == NULL && journal.kept == 0) unlink(journal_file);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+
+  elapsed = stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("moved %lu, skipped %lu, failed %lu, %llu bytes in %.1f s (%.1f MB/s)\n",
+    counts.moved, counts.skipped, counts.failed, counts.bytes, elapsed,
+    elapsed > 0 ? counts.bytes / elapsed / 1e6 : 0.0);
+
+  return counts.failed ? 2 : 0;
+}
@@ -0,0 +1,306 @@
+/*
+  gcc -O2 -Wall -shared -fPIC slowfs.c -o slowfs.so -ldl
+
+  LD_PRELOAD shim that delays file system calls under given
+  directories, so local tmpfs or ext4 directories behave like the NFS
+  mounts of a real installation. Path based calls are delayed when
+  the path starts with one of the prefixes, descriptor based calls
+  when the descriptor was opened below one of them.
+
+  SLOWFS_PATHS    colon separated directory prefixes
+  SLOWFS_META_US  delay of metadata calls in microseconds
+  SLOWFS_DATA_US  delay of read, write and sync calls in microseconds
+
+  A hung NFS server is simulated with a stalled directory. Every call
+  below it blocks for as long as the flag file exists and continues
+  once the flag file is removed.
+
+  SLOWFS_STALL_PATH  directory prefix to stall
+  SLOWFS_STALL_FILE  flag file that holds the stall
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+#define MAX_PREFIXES 128
+
+#define MAX_FDS 65536
+
+static char *prefixes[MAX_PREFIXES];
+static size_t lengths[MAX_PREFIXES];
+static int nprefixes = 0;
+
+static long meta_us = 0;
+static long data_us = 0;
+
+static char *stall_prefix = NULL;
+static size_t stall_length = 0;
+static char *stall_file = NULL;
+
+/* bit 0 marks a delayed descriptor, bit 1 a stalled one */
+static unsigned char slow_fds[MAX_FDS];
+
+/*----------------------------------------------------------------------------*/
+
+__attribute__((constructor))
+static void slow_init(void)
+{
+  char *value, *prefix, *save = NULL;
+
+  if((value = getenv("SLOWFS_META_US"))) meta_us = atol(value);
+  if((value = getenv("SLOWFS_DATA_US"))) data_us = atol(value);
+
+  if((value = getenv("SLOWFS_STALL_PATH")) && value[0] &&
+     (stall_file = getenv("SLOWFS_STALL_FILE")) && stall_file[0])
+  {
+    stall_prefix = value;
+    stall_length = strlen(value);
+  }
+
+  if(!(value = getenv("SLOWFS_PATHS"))) return;
+
+  value = strdup(value);
+  for(prefix = strtok_r(value, ":", &save); prefix && nprefixes < MAX_PREFIXES;
+      prefix = strtok_r(NULL, ":", &save))
+  {
+    prefixes[nprefixes] = prefix;
+    lengths[nprefixes] = strlen(prefix);
+    ++nprefixes;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void slow_sleep(long us)
+{
+  struct timespec ts;
+
+  if(us <= 0) return;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while(nanosleep(&ts, &ts) == -1);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int slow_below(const char *path, const char *prefix, size_t length)
+{
+  return strncmp(path, prefix, length) == 0 &&
+    (path[length] == '/' || path[length] == 0);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int slow_path(const char *path)
+{
+  int i;
+  int res = 0;
+
+  if(path == NULL) return 0;
+
+  for(i = 0; i < nprefixes; ++i)
+  {
+    if(slow_below(path, prefixes[i], lengths[i]))
+    {
+      res = 1;
+      break;
+    }
+  }
+
+  if(stall_prefix && slow_below(path, stall_prefix, stall_length)) res |= 2;
+
+  return res;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int slow_fd(int fd)
+{
+  return fd >= 0 && fd < MAX_FDS ? slow_fds[fd] : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* the flag is checked with a raw system call, which this shim leaves alone */
+static void slow_wait(int flags, long us)
+{
+  if(flags & 2)
+  {
+    while(syscall(SYS_faccessat, AT_FDCWD, stall_file, F_OK) == 0)
+    {
+      slow_sleep(100000);
+    }
+  }
+
+  if(flags & 1) slow_sleep(us);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int slow_opened(const char *path, int fd)
+{
+  if(fd >= 0 && fd < MAX_FDS) slow_fds[fd] = slow_path(path);
+  return fd;
+}
+
+/*----------------------------------------------------------------------------*/
+
+#define REAL(name) \
+  static __typeof__(name) *real; \
+  if(!real) real = (__typeof__(name) *) dlsym(RTLD_NEXT, #name)
+
+#define PATH_CALL(type, name, proto, args, path) \
+type name proto \
+{ \
+  REAL(name); \
+  slow_wait(slow_path(path), meta_us); \
+  return real args; \
+}
+
+#define PATH_CALL2(type, name, proto, args, from, to) \
+type name proto \
+{ \
+  REAL(name); \
+  slow_wait(slow_path(from) | slow_path(to), meta_us); \
+  return real args; \
+}
+
+#define FD_CALL(type, name, proto, args, fd, delay) \
+type name proto \
+{ \
+  REAL(name); \
+  slow_wait(slow_fd(fd), delay); \
+  return real args; \
+}
+
+/*----------------------------------------------------------------------------*/
+
+#define OPEN_CALL(name) \
+int name(const char *path, int flags, ...) \
+{ \
+  mode_t mode = 0; \
+  va_list ap; \
+  REAL(name); \
+  if(flags & (O_CREAT | O_TMPFILE)) \
+  { \
+    va_start(ap, flags); \
+    mode = va_arg(ap, mode_t); \
+    va_end(ap); \
+  } \
+  slow_wait(slow_path(path), meta_us); \
+  return slow_opened(path, real(path, flags, mode)); \
+}
+
+OPEN_CALL(open)
+OPEN_CALL(open64)
+
+int creat(const char *path, mode_t mode)
+{
+  REAL(creat);
+  slow_wait(slow_path(path), meta_us);
+  return slow_opened(path, real(path, mode));
+}
+
+int close(int fd)
+{
+  REAL(close);
+  if(fd >= 0 && fd < MAX_FDS) slow_fds[fd] = 0;
+  return real(fd);
+}
+
+int dup2(int oldfd, int newfd)
+{
+  int res;
+  REAL(dup2);
+  res = real(oldfd, newfd);
+  if(res >= 0 && res < MAX_FDS) slow_fds[res] = slow_fd(oldfd);
+  return res;
+}
+
+DIR *opendir(const char *path)
+{
+  REAL(opendir);
+  slow_wait(slow_path(path), meta_us);
+  return real(path);
+}
+
+/*----------------------------------------------------------------------------*/
+
+PATH_CALL(int, stat, (const char *path, struct stat *buf), (path, buf), path)
+PATH_CALL(int, stat64, (const char *path, struct stat64 *buf), (path, buf), path)
+PATH_CALL(int, lstat, (const char *path, struct stat *buf), (path, buf), path)
+PATH_CALL(int, lstat64, (const char *path, struct stat64 *buf), (path, buf), path)
+PATH_CALL(int, statvfs, (const char *path, struct statvfs *buf), (path, buf), path)
+PATH_CALL(int, statvfs64, (const char *path, struct statvfs64 *buf), (path, buf), path)
+PATH_CALL(int, access, (const char *path, int mode), (path, mode), path)
+PATH_CALL(ssize_t, readlink, (const char *path, char *buf, size_t size), (path, buf, size), path)
+PATH_CALL(int, mkdir, (const char *path, mode_t mode), (path, mode), path)
+PATH_CALL(int, rmdir, (const char *path), (path), path)
+PATH_CALL(int, unlink, (const char *path), (path), path)
+PATH_CALL(int, chmod, (const char *path, mode_t mode), (path, mode), path)
+PATH_CALL(int, chown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid), path)
+PATH_CALL(int, lchown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid), path)
+PATH_CALL(int, truncate, (const char *path, off_t size), (path, size), path)
+PATH_CALL(int, truncate64, (const char *path, off64_t size), (path, size), path)
+PATH_CALL(int, mknod, (const char *path, mode_t mode, dev_t dev), (path, mode, dev), path)
+PATH_CALL(int, utimensat, (int dirfd, const char *path, const struct timespec times[2], int flags),
+  (dirfd, path, times, flags), path)
+PATH_CALL(ssize_t, getxattr, (const char *path, const char *name, void *value, size_t size),
+  (path, name, value, size), path)
+PATH_CALL(ssize_t, lgetxattr, (const char *path, const char *name, void *value, size_t size),
+  (path, name, value, size), path)
+PATH_CALL(int, setxattr, (const char *path, const char *name, const void *value, size_t size, int flags),
+  (path, name, value, size, flags), path)
+PATH_CALL(int, lsetxattr, (const char *path, const char *name, const void *value, size_t size, int flags),
+  (path, name, value, size, flags), path)
+PATH_CALL(ssize_t, listxattr, (const char *path, char *list, size_t size), (path, list, size), path)
+PATH_CALL(ssize_t, llistxattr, (const char *path, char *list, size_t size), (path, list, size), path)
+PATH_CALL(int, removexattr, (const char *path, const char *name), (path, name), path)
+PATH_CALL(int, lremovexattr, (const char *path, const char *name), (path, name), path)
+
+PATH_CALL2(int, rename, (const char *from, const char *to), (from, to), from, to)
+PATH_CALL2(int, symlink, (const char *from, const char *to), (from, to), NULL, to)
+PATH_CALL2(int, link, (const char *from, const char *to), (from, to), from, to)
+
+/*----------------------------------------------------------------------------*/
+
+FD_CALL(ssize_t, read, (int fd, void *buf, size_t size), (fd, buf, size), fd, data_us)
+FD_CALL(ssize_t, write, (int fd, const void *buf, size_t size), (fd, buf, size), fd, data_us)
+FD_CALL(ssize_t, pread, (int fd, void *buf, size_t size, off_t offset),
+  (fd, buf, size, offset), fd, data_us)
+FD_CALL(ssize_t, pread64, (int fd, void *buf, size_t size, off64_t offset),
+  (fd, buf, size, offset), fd, data_us)
+FD_CALL(ssize_t, pwrite, (int fd, const void *buf, size_t size, off_t offset),
+  (fd, buf, size, offset), fd, data_us)
+FD_CALL(ssize_t, pwrite64, (int fd, const void *buf, size_t size, off64_t offset),
+  (fd, buf, size, offset), fd, data_us)
+FD_CALL(ssize_t, splice, (int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags),
+  (fd_in, off_in, fd_out, off_out, len, flags), slow_fd(fd_in) ? fd_in : fd_out, data_us)
+FD_CALL(int, fsync, (int fd), (fd), fd, data_us)
+FD_CALL(int, fdatasync, (int fd), (fd), fd, data_us)
+FD_CALL(int, fstat, (int fd, struct stat *buf), (fd, buf), fd, meta_us)
+FD_CALL(int, fstat64, (int fd, struct stat64 *buf), (fd, buf), fd, meta_us)
+FD_CALL(int, fchmod, (int fd, mode_t mode), (fd, mode), fd, meta_us)
+FD_CALL(int, ftruncate, (int fd, off_t size), (fd, size), fd, meta_us)
+FD_CALL(int, ftruncate64, (int fd, off64_t size), (fd, size), fd, meta_us)
+FD_CALL(int, fallocate, (int fd, int mode, off_t offset, off_t len), (fd, mode, offset, len), fd, meta_us)
+FD_CALL(int, fallocate64, (int fd, int mode, off64_t offset, off64_t len), (fd, mode, offset, len), fd, meta_us)
+FD_CALL(int, futimens, (int fd, const struct timespec times[2]), (fd, times), fd, meta_us)
+FD_CALL(int, fsetxattr, (int fd, const char *name, const void *value, size_t size, int flags),
+  (fd, name, value, size, flags), fd, meta_us)
+FD_CALL(ssize_t, fgetxattr, (int fd, const char *name, void *value, size_t size),
+  (fd, name, value, size), fd, meta_us)
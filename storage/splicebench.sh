@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# Compares the copy path (storage.splice 0) and the splice path
+# (storage.splice 1) with bench.sh at 1, 4 and 16 concurrent streams,
+# one file per loadgen thread. Checksums, readahead, write-behind and
+# the I/O limit are switched off because each of them needs the data
+# in memory and would take the copy path in both runs. Run it as root
+# so the stand-in mounts are tmpfs.
+#
+
+usage() {
+    echo "Usage: splicebench.sh [-j streams] [-s file_size] [-b block_size]" >&2
+    echo "                      [-- bench.sh options]" >&2
+    exit 1
+}
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+streams="1 4 16"
+size=64m
+block=1m
+
+while getopts "j:s:b:h" opt
+do
+    case $opt in
+        j) streams=$OPTARG ;;
+        s) size=$OPTARG ;;
+        b) block=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+extra=$(mktemp "${TMPDIR:-/tmp}/splicebench.XXXXXX") || exit 1
+trap 'rm -f "$extra"' EXIT
+
+printf "%-7s %7s %-8s %9s %11s %9s %9s %9s %9s %9s %7s\n" splice streams \
+    phase ops ops/s MB/s "p50 us" "p90 us" "p99 us" "max us" errors
+
+for splice in 0 1
+do
+    {
+        echo "storage.splice $splice"
+        echo "storage.checksum 0"
+        echo "storage.readahead 0"
+        echo "storage.writebehind 0"
+        echo "storage.iolimit 0"
+        echo "storage.iobackend threads"
+    } > "$extra"
+
+    for j in $streams
+    do
+        "$here/bench.sh" -x "$extra" "$@" -- -j "$j" -n 1 -s "$size" \
+            -b "$block" -p write,read |
+        awk -v splice="$splice" -v j="$j" '
+            $1 == "write" || $1 == "read" {
+                printf "%-7s %7s %s\n", splice, j, $0
+            }'
+    done
+done
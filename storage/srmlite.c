@@ -8,9 +8,11 @@
 #ifdef linux
 /* For pread()/pwrite()/utimensat() */
 #define _XOPEN_SOURCE 700
+/* For fallocate() */
+#define _GNU_SOURCE
 #endif
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -21,9 +23,16 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/fsuid.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #define MIN_FREE_BLOCKS 2048000
 
@@ -31,740 +40,9008 @@
 
 #define MAX_PATH 512
 
+#define CACHE_LOCKS 64
+
+#define CACHE_SIZE 8192
+
+#define CACHE_TTL 5
+
+#define CACHE_NEG_TTL 1
+
+#define DIRINDEX_SIZE 16384
+
+#define DIRINDEX_TTL 600
+
+#define MOUNT_MASK ((MAX_STORAGE + 7) / 8)
+#define MOUNT_TEST(mask, i) ((mask)[(i) / 8] & (1 << ((i) % 8)))
+#define MOUNT_SET(mask, i) ((mask)[(i) / 8] |= 1 << ((i) % 8))
+
+#define SPACE_REFRESH 10
+
+#define PROBE_TIMEOUT 5
+
+#define PREFETCH_BATCH 256
+
+#define PREFETCH_THREADS 8
+
+#define READAHEAD_WINDOW (4 << 20)
+#define READAHEAD_MEMORY (256 << 20)
+#define READAHEAD_THREADS 8
+#define READAHEAD_TRIGGER 2
+#define READAHEAD_SEGMENTS 2
+
+#define SEGMENT_EMPTY 0
+#define SEGMENT_PENDING 1
+#define SEGMENT_READY 2
+
+#define WRITEBEHIND_MEMORY (256 << 20)
+#define FLUSH_THREADS 8
+#define FLUSH_MOUNT 4
+
+#define MAX_MIRRORS 16
+#define MIRROR_THREADS 4
+#define MIRROR_PREFIX ".srmlite-mirror."
+
+#define COPY_BUFFER (1 << 20)
+
+#define IO_THREADS 0
+#define IO_URING 1
+#define URING_ENTRIES 256
+
+#define MAX_STRIPES 16
+#define STRIPE_SIZE (64 << 20)
+#define STRIPE_COUNT 4
+#define STRIPE_THREADS 8
+#define STRIPE_PREFIX ".srmlite-stripe."
+#define LAYOUT_PREFIX ".srmlite-layout."
+
+#define LOCAL_SIZE ((size_t) 16 << 30)
+#define LOCAL_HITS 3
+#define LOCAL_ENTRIES 16384
+#define LOCAL_THREADS 2
+
+#define LOCAL_NONE 0
+#define LOCAL_COPYING 1
+#define LOCAL_READY 2
+
+#define LOCINDEX_SLOTS 1048576
+#define LOCINDEX_NAME 496
+#define LOCINDEX_TTL 5
+#define LOCINDEX_PROBES 16
+#define LOCINDEX_HEADER 4096
+#define LOCINDEX_LOG (64 << 20)
+#define LOCINDEX_MAGIC 0x58444c53
+#define LOCINDEX_VERSION 2
+
+#define LOCINDEX_EMPTY 0
+#define LOCINDEX_USED 1
+#define LOCINDEX_DELETED 2
+
+#define LOCINDEX_PUT 1
+#define LOCINDEX_DEL 2
+
+#define ADLER_XATTR "user.adler32"
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+#define MOUNT_UP 0
+#define MOUNT_DOWN 1
+
+#define PLACE_WEIGHTED 0
+#define PLACE_INFLIGHT 1
+#define PLACE_ROUNDROBIN 2
+
+#define MAX_READERS 1024
+
+#define OFILE_BUCKETS 4096
+#define OFILE_PUBLISH 5
+
+#define NODE_BUCKETS 65536
+#define ENTRY_TIMEOUT 1.0
+#define ATTR_TIMEOUT 1.0
+
+#define HIST_BUCKETS 32
+
+#define STATS_DIR "/.srmlite"
+#define STATS_TEXT "/.srmlite/stats"
+#define STATS_RAW "/.srmlite/stats.raw"
+
+#define OP_GETATTR 0
+#define OP_ACCESS 1
+#define OP_READLINK 2
+#define OP_OPENDIR 3
+#define OP_READDIR 4
+#define OP_RELEASEDIR 5
+#define OP_MKNOD 6
+#define OP_SYMLINK 7
+#define OP_MKDIR 8
+#define OP_UNLINK 9
+#define OP_RMDIR 10
+#define OP_RENAME 11
+#define OP_CHMOD 12
+#define OP_CHOWN 13
+#define OP_STATFS 14
+#define OP_UTIMENS 15
+#define OP_OPEN 16
+#define OP_READ 17
+#define OP_WRITE 18
+#define OP_FLUSH 19
+#define OP_RELEASE 20
+#define OP_FSYNC 21
+#define OP_GETXATTR 22
+#define OP_LISTXATTR 23
+#define OP_FALLOCATE 24
+#define OP_FGETATTR 25
+#define OP_FTRUNCATE 26
+#define OP_TRUNCATE 27
+#define OP_LOOKUP 28
+#define OP_MAX 29
+
+static const char *op_names[OP_MAX] = {
+  "getattr", "access", "readlink", "opendir", "readdir", "releasedir",
+  "mknod", "symlink", "mkdir", "unlink", "rmdir", "rename", "chmod",
+  "chown", "statfs", "utimens", "open", "read", "write", "flush",
+  "release", "fsync", "getxattr", "listxattr", "fallocate", "fgetattr",
+  "ftruncate", "truncate", "lookup"
+};
+
+/*
+  The configuration is an immutable snapshot. Readers bracket their
+  use of it with xmp_config_enter/xmp_config_leave, which only touch
+  a per-thread epoch slot. A reload publishes a new snapshot and the
+  old one is freed once no reader from an earlier epoch is left.
+*/
+
+struct xmp_config
+{
+  char *mounts[MAX_STORAGE];
+  int nmounts;
+  int cachesize;
+  int cachettl;
+  int cachenegttl;
+  int dirindex;
+  int dirindexttl;
+  int refresh;
+  int probetimeout;
+  int placement;
+  int splice;
+  int prefetchthreads;
+  int checksum;
+  size_t readahead;
+  size_t readaheadmem;
+  int readaheadthreads;
+  size_t writebehind;
+  size_t writebehindmem;
+  int flushthreads;
+  int flushmount;
+  int iolimit;
+  char *mirrors[MAX_MIRRORS];
+  int nmirrors;
+  int mirrorthreads;
+  char *localcache;
+  size_t localcachesize;
+  int localcachehits;
+  int localcacheentries;
+  int localcachethreads;
+  size_t stripethreshold;
+  size_t stripesize;
+  int stripecount;
+  int stripethreads;
+  int iobackend;
+  int uringentries;
+  char *locindex;
+  int locindexsize;
+  int locindexsync;
+  int locindexttl;
+  char *openlist;
+  unsigned int generation;
+  unsigned long retired;
+  struct xmp_config *next;
+};
+
+struct xmp_reader
+{
+  volatile unsigned long epoch;
+  volatile int used;
+}
+__attribute__((aligned(64)));
+
+static struct xmp_config *volatile storage = NULL;
+static struct xmp_config *retired = NULL;
+
+static struct xmp_reader readers[MAX_READERS];
+static volatile unsigned long config_epoch = 1;
+static volatile long config_overflow = 0;
+static pthread_key_t reader_key;
+static __thread struct xmp_reader *reader = NULL;
+static __thread struct xmp_config *reader_config = NULL;
+static __thread int reader_depth = 0;
+static int reload_pipe[2] = {-1, -1};
+
+struct xmp_centry
+{
+  char path[MAX_PATH];
+  char real_path[MAX_PATH];
+  int type;
+  int index;
+  unsigned int seq;
+  unsigned int generation;
+  time_t expires;
+  struct stat st;
+  time_t attr_expires;
+};
+
+/*
+  Records which data mounts hold a directory. A mount whose bit is
+  clear in known has not been looked at yet, so a partial entry only
+  costs probes of the mounts it does not cover.
+*/
+
+struct xmp_dentry
+{
+  char path[MAX_PATH];
+  unsigned char known[MOUNT_MASK];
+  unsigned char present[MOUNT_MASK];
+  unsigned int generation;
+  time_t expires;
+};
+
+struct xmp_space
+{
+  struct statvfs st;
+  time_t updated;
+  time_t started;
+  int error;
+  int state;
+  int busy;
+  unsigned long probes;
+  unsigned long timeouts;
+  unsigned long transitions;
+};
+
+struct xmp_batch
+{
+  int pending;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct xmp_job
+{
+  void (*func)(void *);
+  void *arg;
+  struct xmp_job *next;
+};
+
+/*
+  One data transfer on the ring. The submitter fills in the request,
+  the completion thread stores the result and calls done(op).
+*/
+
+struct xmp_uop
+{
+  int fd;
+  int index;
+  uid_t uid;
+  int write;
+  char *buf;
+  size_t size;
+  off_t offset;
+  int res;
+  struct timespec start;
+  void (*done)(struct xmp_uop *);
+  void *arg;
+};
+
+struct xmp_pool
+{
+  struct xmp_job *head;
+  struct xmp_job *tail;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct xmp_pool prefetch;
+
+struct xmp_probe
+{
+  int index;
+  unsigned int generation;
+  char path[MAX_PATH];
+};
+
+struct
+{
+  struct xmp_space mounts[MAX_STORAGE];
+  char *paths[MAX_STORAGE];
+  int nmounts;
+  unsigned int generation;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+}
+space;
+
+struct
+{
+  unsigned long cursor;
+  unsigned long placed[MAX_STORAGE];
+  long writers[MAX_STORAGE];
+  long long reserved[MAX_STORAGE];
+  unsigned long relocated;
+  volatile sig_atomic_t dump;
+}
+placement;
+
+/*
+  A read-only handle keeps a window of READAHEAD_SEGMENTS buffers.
+  Once the reader has been sequential for READAHEAD_TRIGGER calls,
+  every read queues a fill of the next free segment just past the
+  window, so the pool keeps the NFS server busy ahead of the reader.
+*/
+
+struct xmp_stream;
+
+struct xmp_segment
+{
+  struct xmp_stream *stream;
+  char *buf;
+  off_t offset;
+  size_t size;
+  int state;
+  struct xmp_uop op;
+};
+
+struct xmp_stream
+{
+  int fd;
+  int index;
+  uid_t uid;
+  size_t window;
+  size_t reserved;
+  off_t next;
+  off_t eof;
+  int sequential;
+  int pending;
+  struct xmp_segment seg[READAHEAD_SEGMENTS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct
+{
+  struct xmp_pool pool;
+  size_t memory;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long throttled;
+  unsigned long bytes;
+}
+streams;
+
+/*
+  A writer handle gathers contiguous writes in one buffer at a time.
+  Full buffers are written by the flush pool; a handle has at most
+  one buffer in flight, so its writes reach the file in order, and
+  the first error is returned by the next write, flush or fsync.
+*/
+
+struct xmp_behind;
+
+struct xmp_ofile;
+
+struct xmp_flush
+{
+  struct xmp_behind *behind;
+  char *buf;
+  off_t offset;
+  size_t size;
+  struct xmp_flush *next;
+};
+
+struct xmp_behind
+{
+  int fd;
+  int index;
+  uid_t uid;
+  struct xmp_ofile *ofile;
+  size_t capacity;
+  struct xmp_flush *job;
+  size_t size;
+  size_t limit;
+  int inflight;
+  int error;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/*
+  A flush that finds its mount at storage.flushmount waits in a queue
+  of that mount instead of holding a pool thread, and the next flush
+  to finish on the mount runs it. Flushes to other mounts are never
+  stuck behind a busy one.
+*/
+
+struct
+{
+  struct xmp_pool pool;
+  size_t memory;
+  int busy[MAX_STORAGE];
+  struct xmp_flush *head[MAX_STORAGE];
+  struct xmp_flush *tail[MAX_STORAGE];
+  pthread_mutex_t lock;
+  unsigned long writes;
+  unsigned long bypassed;
+  unsigned long flushes;
+  unsigned long bytes;
+}
+writebehind;
+
+struct xmp_file
+{
+  int fd;
+  int index;
+  uid_t uid;
+  int writer;
+  char *data;
+  size_t size;
+  struct xmp_stream *stream;
+  struct xmp_behind *behind;
+  int access;
+  long long reserved;
+  int adler_valid;
+  uint32_t adler;
+  off_t adler_pos;
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  struct xmp_layout *layout;
+  struct xmp_ofile *ofile;
+  unsigned long wopens;
+  int pending;
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+};
+
+/*
+  Handles count their own I/O and add it to the per-mount totals
+  when they are released, so the hot path never touches shared
+  counters of other handles.
+*/
+
+struct
+{
+  unsigned long opened;
+  unsigned long released;
+  unsigned long reads[MAX_STORAGE];
+  unsigned long writes[MAX_STORAGE];
+  unsigned long long bytes_read[MAX_STORAGE];
+  unsigned long long bytes_written[MAX_STORAGE];
+}
+handles;
+
+/*
+  Every file with open handles on this node has one entry, keyed by
+  its path. Renames move the entry to the new name and unlinks take
+  it out of the table, so the counts always belong to the file and
+  not to whatever is created under the old name later. wopens counts
+  every open for writing, so a writer can tell at release whether
+  another writer came and went in the meantime. Opens register before
+  they resolve the path and wait while the file is moving to another
+  mount or switching to stripes, so neither leaves a handle on the
+  old copy.
+*/
+
+struct xmp_ofile
+{
+  char *path;
+  int handles;
+  int writers;
+  int linked;
+  int moving;
+  unsigned int slot;
+  unsigned long wopens;
+  struct xmp_ofile *next;
+};
+
+struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct xmp_ofile *buckets[OFILE_BUCKETS];
+}
+ofiles;
+
+/*
+  Inodes the kernel holds, keyed by number and by path. A node keeps
+  the full path it was looked up under, so requests that carry an
+  inode never rebuild it from the parents, together with the mount
+  and the attributes of its last lookup. The attributes are only
+  used while the path cache slot of the node keeps the sequence
+  number it had before the lookup, so every invalidation of the path
+  reaches the node too. A node lives until the kernel has forgotten
+  all its lookups; unlinked nodes lose their path and wait for that.
+*/
+
+struct xmp_node
+{
+  fuse_ino_t ino;
+  char *path;
+  unsigned long nlookup;
+  int index;
+  unsigned int slot;
+  unsigned int seq;
+  unsigned int generation;
+  time_t expires;
+  struct stat st;
+  struct xmp_node *next_ino;
+  struct xmp_node *next_path;
+};
+
+struct
+{
+  pthread_mutex_t lock;
+  fuse_ino_t last;
+  unsigned long count;
+  unsigned long hits;
+  unsigned long forgotten;
+  struct xmp_node *inos[NODE_BUCKETS];
+  struct xmp_node *paths[NODE_BUCKETS];
+}
+nodes;
+
+/*
+  Data I/O to a mount is admitted by xmp_io_begin. Once a mount has
+  storage.iolimit requests in flight, further requests wait in one
+  queue per uid, and every finished request hands its slot to the
+  next queue in turn, so a single user cannot take all the slots.
+  Reads the library serves from the fd are not counted in flight;
+  xmp_read_buf only reads through the scheduler once a mount is at
+  its limit.
+*/
+
+struct xmp_iowait
+{
+  int granted;
+  pthread_cond_t cond;
+  struct xmp_iowait *next;
+};
+
+struct xmp_ioflow
+{
+  uid_t uid;
+  struct xmp_iowait *head;
+  struct xmp_iowait *tail;
+  struct xmp_ioflow *next;
+};
+
+struct xmp_ioq
+{
+  int inflight;
+  int waiting;
+  struct xmp_ioflow *head;
+  struct xmp_ioflow *tail;
+  unsigned long requests;
+  unsigned long queued;
+  unsigned long long wait_usecs;
+  unsigned long max_usecs;
+  pthread_mutex_t lock;
+};
+
+struct
+{
+  struct xmp_ioq mounts[MAX_STORAGE];
+}
+iosched;
+
+/*
+  Files below a storage.mirror prefix get a second copy on another
+  data mount. The copy is an ordinary file whose name carries
+  MIRROR_PREFIX, with its own meta symlink next to the original, so
+  nscheck and rebalance handle it like any other file. readdir hides
+  these names.
+*/
+
+struct xmp_mirror
+{
+  char path[MAX_PATH];
+};
+
+struct
+{
+  struct xmp_pool pool;
+  unsigned long copies;
+  unsigned long failed;
+  unsigned long dropped;
+  unsigned long reads;
+  unsigned long bytes;
+}
+mirrors;
+
+/*
+  Read-only opens of data files are counted per path. A file opened
+  storage.localcachehits times is copied to the storage.localcache
+  directory in the background, and later opens read the local copy
+  as long as size and mtime of the real file still match. Entries
+  live in a direct-mapped table, the copy of slot n is slot.n.
+*/
+
+struct xmp_lentry
+{
+  char path[MAX_PATH];
+  unsigned int count;
+  int state;
+  time_t used;
+  off_t size;
+  struct timespec mtime;
+};
+
+struct xmp_lcopy
+{
+  char path[MAX_PATH];
+  unsigned int slot;
+};
+
+struct
+{
+  struct xmp_lentry *entries;
+  unsigned int size;
+  char *dir;
+  pthread_mutex_t locks[CACHE_LOCKS];
+  pthread_mutex_t evict;
+  struct xmp_pool pool;
+  size_t used;
+  unsigned long seq;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stale;
+  unsigned long copies;
+  unsigned long failed;
+  unsigned long evictions;
+  unsigned long bytes;
+}
+localcache;
+
+/*
+  Files of at least storage.stripethreshold bytes are rewritten in
+  the background into storage.stripecount stripe files on different
+  data mounts. Stripe i holds every stripecount-th chunk of stripesize
+  bytes and is named .srmlite-stripe.<i>.<name> on its mount. The meta
+  symlink leads to stripe 0, which carries owner, mode and times, and
+  the layout record .srmlite-layout.<name> next to it in the meta tree
+  lists the stripe size and the stripe files. The size of the file is
+  worked out from the sizes of the stripe files.
+*/
+
+struct xmp_layout
+{
+  size_t stripe;
+  int count;
+  int fds[MAX_STRIPES];
+  int index[MAX_STRIPES];
+  char paths[MAX_STRIPES][MAX_PATH];
+};
+
+struct xmp_piece
+{
+  struct xmp_file *file;
+  char *buf;
+  size_t size;
+  off_t offset;
+  int stripe;
+  int write;
+  ssize_t res;
+  struct xmp_batch *batch;
+  struct xmp_uop op;
+};
+
+struct xmp_stripejob
+{
+  char path[MAX_PATH];
+};
+
+/* An original waiting for the path caches of other nodes to expire */
+
+struct xmp_stripedrop
+{
+  char path[MAX_PATH];
+  char real_path[MAX_PATH];
+  off_t size;
+  struct timespec mtime;
+  time_t due;
+  struct xmp_stripedrop *next;
+};
+
+struct
+{
+  struct xmp_pool pool;
+  struct xmp_pool convert;
+  struct xmp_stripedrop *drops;
+  pthread_mutex_t lock;
+  int reaping;
+  unsigned long converted;
+  unsigned long failed;
+  unsigned long split;
+  unsigned long bytes;
+}
+stripes;
+
+/*
+  With storage.iobackend uring, data transfers are queued on a single
+  io_uring and one thread reaps the completions and answers the FUSE
+  requests they belong to, so the number of transfers in flight is no
+  longer bound by the number of threads. entries stays 0 when the
+  ring is not in use.
+*/
+
+struct
+{
+  int fd;
+  unsigned int entries;
+  unsigned int inflight;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned long submitted;
+  unsigned long completed;
+  unsigned long full;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+}
+uring;
+
+struct xmp_counter
+{
+  unsigned long calls;
+  unsigned long errors;
+  unsigned long usecs;
+  unsigned long hist[HIST_BUCKETS];
+};
+
+/*
+  Every thread updates its own block without atomics, the blocks
+  are only summed up when the stats file is opened. Blocks of exited
+  threads are handed over to new threads, so no counts are lost.
+*/
+
+struct xmp_stats
+{
+  struct xmp_counter ops[OP_MAX];
+  struct xmp_counter meta;
+  struct xmp_counter data[MAX_STORAGE];
+  volatile int used;
+  struct xmp_stats *next;
+};
+
+struct
+{
+  struct xmp_stats *head;
+  pthread_mutex_t lock;
+  pthread_key_t key;
+}
+stats;
+
+static __thread struct xmp_stats *thread_stats = NULL;
+
 struct
 {
-  char *mounts[MAX_STORAGE];
-  int nmounts;
+  struct xmp_centry *entries;
+  unsigned int size;
+  pthread_mutex_t locks[CACHE_LOCKS];
+}
+cache;
+
+struct
+{
+  struct xmp_dentry *entries;
+  unsigned int size;
+  pthread_mutex_t locks[CACHE_LOCKS];
+  unsigned long hits;
+  unsigned long probes;
+}
+dirindex;
+
+/*
+  With storage.locindex set, the locations of data files are kept in
+  a hash table mapped from that file, so a path cache miss costs a
+  memory read instead of an lstat and a readlink of the meta symlink.
+  The symlinks stay authoritative: paths missing from the table are
+  resolved from them and added, and an entry is checked against its
+  symlink again once it is storage.locindexttl seconds old, as other
+  hosts or rebalance may have moved the file. Every change goes to
+  the active one of <locindex>.wal.0 and .wal.1 before it touches the
+  table, and a start replays the records newer than the last
+  checkpoint. Entries filled in by lookups are not logged, the
+  symlinks have them anyway. Changes wait for one fdatasync shared
+  by all that are waiting, and a checkpoint switches to the other
+  log first, so neither holds up the changes that follow.
+*/
+
+struct xmp_lheader
+{
+  unsigned int magic;
+  unsigned int version;
+  unsigned int nslots;
+  unsigned int used;
+  unsigned long long seq;
+  unsigned int mounts[MAX_STORAGE];
+};
+
+/* name holds the path and, from name + length, the real path below the mount */
+
+struct xmp_lslot
+{
+  unsigned int hash;
+  unsigned char state;
+  unsigned char mount;
+  unsigned short length;
+  long long verified;
+  char name[LOCINDEX_NAME];
+};
+
+struct xmp_lrecord
+{
+  unsigned int check;
+  unsigned int op;
+  unsigned long long seq;
+  struct xmp_lslot slot;
+};
+
+struct
+{
+  int fd;
+  int wals[2];
+  int active;
+  int sync;
+  int syncing;
+  int due;
+  int checkpointing;
+  size_t mapped;
+  unsigned int nslots;
+  struct xmp_lheader *header;
+  struct xmp_lslot *slots;
+  unsigned long long seq;
+  unsigned long long synced;
+  off_t logged;
+  unsigned int changes[CACHE_LOCKS];
+  pthread_rwlock_t lock;
+  pthread_mutex_t log;
+  pthread_cond_t cond;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long expired;
+  unsigned long puts;
+  unsigned long drops;
+  unsigned long checkpoints;
+}
+locindex;
+
+static int fsuid = 0;
+static int fsgid = 0;
+static int direct_io = 0;
+static char *config_file = NULL;
+
+/* the request the current thread handles, pool threads have none */
+static __thread fuse_req_t request = NULL;
+
+static int xmp_setfsid(void)
+{
+  const struct fuse_ctx *ctx = fuse_req_ctx(request);
+  setfsuid(ctx->uid);
+  setfsgid(ctx->gid);
+  return 0;
+}
+
+static int xmp_resetfsid(void)
+{
+  setfsuid(fsuid);
+  setfsgid(fsgid);
+  return 0;
+}
+
+static void xmp_stats_release(void *arg)
+{
+  struct xmp_stats *s = arg;
+
+  __sync_synchronize();
+  s->used = 0;
+}
+
+static struct xmp_stats *xmp_stats_get(void)
+{
+  struct xmp_stats *s;
+
+  if(thread_stats) return thread_stats;
+
+  pthread_mutex_lock(&stats.lock);
+
+  for(s = stats.head; s; s = s->next)
+  {
+    if(!s->used) break;
+  }
+
+  if(s == NULL && (s = calloc(1, sizeof(struct xmp_stats))))
+  {
+    s->next = stats.head;
+    stats.head = s;
+  }
+
+  if(s) s->used = 1;
+
+  pthread_mutex_unlock(&stats.lock);
+
+  if(s) pthread_setspecific(stats.key, s);
+
+  thread_stats = s;
+
+  return s;
+}
+
+static void xmp_stats_add(struct xmp_counter *c, const struct timespec *start, int res)
+{
+  int bucket;
+  unsigned long usecs;
+  struct timespec stop;
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+
+  usecs = (stop.tv_sec - start->tv_sec) * 1000000 +
+    (stop.tv_nsec - start->tv_nsec) / 1000;
+
+  bucket = usecs ? 64 - __builtin_clzl(usecs) : 0;
+  if(bucket >= HIST_BUCKETS) bucket = HIST_BUCKETS - 1;
+
+  ++c->calls;
+  if(res < 0) ++c->errors;
+  c->usecs += usecs;
+  ++c->hist[bucket];
+}
+
+static void xmp_stats_op(int op, const struct timespec *start, int res)
+{
+  struct xmp_stats *s = xmp_stats_get();
+  if(s) xmp_stats_add(&s->ops[op], start, res);
+}
+
+static void xmp_stats_meta(const struct timespec *start, int res)
+{
+  struct xmp_stats *s = xmp_stats_get();
+  if(s) xmp_stats_add(&s->meta, start, res);
+}
+
+static void xmp_stats_data(int index, const struct timespec *start, int res)
+{
+  struct xmp_stats *s = xmp_stats_get();
+  if(s && index > 0 && index < MAX_STORAGE) xmp_stats_add(&s->data[index], start, res);
+}
+
+static void xmp_reader_release(void *arg)
+{
+  struct xmp_reader *r = arg;
+
+  __sync_synchronize();
+  r->epoch = 0;
+  r->used = 0;
+}
+
+static void xmp_reader_register(void)
+{
+  int i;
+
+  for(i = 0; i < MAX_READERS; ++i)
+  {
+    if(readers[i].used == 0 && __sync_bool_compare_and_swap(&readers[i].used, 0, 1))
+    {
+      reader = &readers[i];
+      pthread_setspecific(reader_key, reader);
+      return;
+    }
+  }
+}
+
+static struct xmp_config *xmp_config_enter(void)
+{
+  if(reader_depth++ == 0)
+  {
+    if(reader == NULL) xmp_reader_register();
+
+    if(reader)
+    {
+      reader->epoch = config_epoch;
+      __sync_synchronize();
+    }
+    else
+    {
+      __sync_fetch_and_add(&config_overflow, 1);
+    }
+
+    reader_config = storage;
+  }
+
+  return reader_config;
+}
+
+static void xmp_config_leave(void)
+{
+  if(--reader_depth == 0)
+  {
+    if(reader)
+    {
+      __sync_synchronize();
+      reader->epoch = 0;
+    }
+    else
+    {
+      __sync_fetch_and_sub(&config_overflow, 1);
+    }
+  }
+}
+
+static void xmp_config_free(struct xmp_config *cfg)
+{
+  int i;
+
+  for(i = 0; i < cfg->nmounts; ++i)
+  {
+    free(cfg->mounts[i]);
+  }
+
+  for(i = 0; i < cfg->nmirrors; ++i)
+  {
+    free(cfg->mirrors[i]);
+  }
+
+  free(cfg->localcache);
+  free(cfg->locindex);
+  free(cfg->openlist);
+  free(cfg);
+}
+
+/* Frees retired snapshots that no reader can still be using */
+
+static void xmp_config_reclaim(void)
+{
+  int i;
+  unsigned long epoch;
+  struct xmp_config *cfg;
+  struct xmp_config **prev;
+
+  __sync_synchronize();
+
+  prev = &retired;
+  while((cfg = *prev))
+  {
+    for(i = 0; i < MAX_READERS; ++i)
+    {
+      epoch = readers[i].epoch;
+      if(epoch != 0 && epoch <= cfg->retired) break;
+    }
+
+    if(i < MAX_READERS || config_overflow > 0)
+    {
+      prev = &cfg->next;
+      continue;
+    }
+
+    *prev = cfg->next;
+    xmp_config_free(cfg);
+  }
+}
+
+static void xmp_config_publish(struct xmp_config *cfg)
+{
+  struct xmp_config *old = storage;
+
+  cfg->generation = old ? old->generation + 1 : 0;
+
+  storage = cfg;
+  __sync_synchronize();
+
+  if(old == NULL) return;
+
+  old->retired = __sync_fetch_and_add(&config_epoch, 1);
+  old->next = retired;
+  retired = old;
+
+  xmp_config_reclaim();
+}
+
+static void *xmp_pool_worker(void *arg)
+{
+  struct xmp_job *job;
+  struct xmp_pool *pool = arg;
+
+  while(1)
+  {
+    pthread_mutex_lock(&pool->lock);
+
+    while(pool->head == NULL)
+    {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+
+    job = pool->head;
+    pool->head = job->next;
+    if(pool->head == NULL) pool->tail = NULL;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    job->func(job->arg);
+
+    free(job);
+  }
+
+  return NULL;
+}
+
+static void xmp_pool_init(struct xmp_pool *pool, int nthreads)
+{
+  int i;
+  pthread_t thread;
+
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->nthreads = 0;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    if(pthread_create(&thread, NULL, xmp_pool_worker, pool) != 0)
+    {
+      syslog(LOG_WARNING, "Cannot start worker thread\n");
+      break;
+    }
+    pthread_detach(thread);
+    ++pool->nthreads;
+  }
+}
+
+/*
+  Queues func(arg) on the pool, or runs it in the calling thread
+  if the pool has no workers or the job cannot be allocated.
+*/
+
+static void xmp_pool_submit(struct xmp_pool *pool, void (*func)(void *), void *arg)
+{
+  struct xmp_job *job;
+
+  job = pool->nthreads ? malloc(sizeof(struct xmp_job)) : NULL;
+  if(job == NULL)
+  {
+    func(arg);
+    return;
+  }
+
+  job->func = func;
+  job->arg = arg;
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+
+  if(pool->tail) pool->tail->next = job;
+  else pool->head = job;
+  pool->tail = job;
+
+  pthread_cond_signal(&pool->cond);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static int xmp_metapath(const char *path, char *meta_path)
+{
+  int res;
+  struct xmp_config *cfg = xmp_config_enter();
+
+  res = snprintf(meta_path, MAX_PATH, "%s/%s", cfg->mounts[0], path) < MAX_PATH ? 0 : -1;
+
+  xmp_config_leave();
+
+  if(res == -1) errno = ENAMETOOLONG;
+
+  return res;
+}
+
+static int xmp_mountindex(const char *real_path)
+{
+  int i, index;
+  size_t size;
+  struct xmp_config *cfg = xmp_config_enter();
+
+  index = -1;
+
+  for(i = 1; i < cfg->nmounts; ++i)
+  {
+    size = strlen(cfg->mounts[i]);
+    if(strncmp(real_path, cfg->mounts[i], size) == 0 && real_path[size] == '/')
+    {
+      index = i;
+      break;
+    }
+  }
+
+  xmp_config_leave();
+
+  return index;
+}
+
+static int xmp_mountdown(int index)
+{
+  return index > 0 && index < space.nmounts &&
+    space.mounts[index].state == MOUNT_DOWN;
+}
+
+static void xmp_io_init(void)
+{
+  int i;
+
+  for(i = 0; i < MAX_STORAGE; ++i)
+  {
+    pthread_mutex_init(&iosched.mounts[i].lock, NULL);
+  }
+}
+
+static uid_t xmp_io_uid(void)
+{
+  return request ? fuse_req_ctx(request)->uid : 0;
+}
+
+/* Expects the queue lock to be held and at least one waiting flow */
+
+static void xmp_io_grant(struct xmp_ioq *q)
+{
+  struct xmp_ioflow *flow = q->head;
+  struct xmp_iowait *w = flow->head;
+
+  flow->head = w->next;
+  if(flow->head == NULL) flow->tail = NULL;
+
+  q->head = flow->next;
+  if(q->head == NULL) q->tail = NULL;
+
+  /* a flow with more waiters goes to the back of the round */
+  if(flow->head)
+  {
+    flow->next = NULL;
+    if(q->tail) q->tail->next = flow;
+    else q->head = flow;
+    q->tail = flow;
+  }
+  else
+  {
+    free(flow);
+  }
+
+  --q->waiting;
+  ++q->inflight;
+
+  w->granted = 1;
+  pthread_cond_signal(&w->cond);
+}
+
+static void xmp_io_begin(int index, uid_t uid)
+{
+  int limit;
+  unsigned long usecs;
+  struct xmp_ioq *q;
+  struct xmp_ioflow *flow;
+  struct xmp_iowait w;
+  struct timespec start;
+  struct timespec now;
+
+  if(index <= 0 || index >= MAX_STORAGE) return;
+
+  limit = xmp_config_enter()->iolimit;
+  xmp_config_leave();
+
+  q = &iosched.mounts[index];
+
+  pthread_mutex_lock(&q->lock);
+
+  ++q->requests;
+
+  if(limit <= 0 || (q->inflight < limit && q->head == NULL))
+  {
+    ++q->inflight;
+    pthread_mutex_unlock(&q->lock);
+    return;
+  }
+
+  for(flow = q->head; flow && flow->uid != uid; flow = flow->next);
+
+  if(flow == NULL)
+  {
+    flow = malloc(sizeof(struct xmp_ioflow));
+    if(flow == NULL)
+    {
+      ++q->inflight;
+      pthread_mutex_unlock(&q->lock);
+      return;
+    }
+
+    flow->uid = uid;
+    flow->head = NULL;
+    flow->tail = NULL;
+    flow->next = NULL;
+
+    if(q->tail) q->tail->next = flow;
+    else q->head = flow;
+    q->tail = flow;
+  }
+
+  w.granted = 0;
+  w.next = NULL;
+  pthread_cond_init(&w.cond, NULL);
+
+  if(flow->tail) flow->tail->next = &w;
+  else flow->head = &w;
+  flow->tail = &w;
+
+  ++q->waiting;
+  ++q->queued;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while(!w.granted) pthread_cond_wait(&w.cond, &q->lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  usecs = (now.tv_sec - start.tv_sec) * 1000000 +
+    (now.tv_nsec - start.tv_nsec) / 1000;
+
+  q->wait_usecs += usecs;
+  if(usecs > q->max_usecs) q->max_usecs = usecs;
+
+  pthread_mutex_unlock(&q->lock);
+
+  pthread_cond_destroy(&w.cond);
+}
+
+static void xmp_io_end(int index)
+{
+  int limit;
+  struct xmp_ioq *q;
+
+  if(index <= 0 || index >= MAX_STORAGE) return;
+
+  limit = xmp_config_enter()->iolimit;
+  xmp_config_leave();
+
+  q = &iosched.mounts[index];
+
+  pthread_mutex_lock(&q->lock);
+
+  --q->inflight;
+
+  /* a lowered or removed limit may release more than one waiter */
+  while(q->head && (limit <= 0 || q->inflight < limit)) xmp_io_grant(q);
+
+  pthread_mutex_unlock(&q->lock);
+}
+
+static int xmp_io_load(int index)
+{
+  if(index <= 0 || index >= MAX_STORAGE) return 0;
+  return iosched.mounts[index].inflight + iosched.mounts[index].waiting;
+}
+
+static void xmp_batch_done(struct xmp_batch *batch)
+{
+  pthread_mutex_lock(&batch->lock);
+  if(--batch->pending == 0) pthread_cond_signal(&batch->cond);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+static void *xmp_uring_reap(void *arg)
+{
+  unsigned int n;
+  unsigned int head;
+  unsigned int tail;
+  struct xmp_uop *op;
+  struct io_uring_cqe *cqe;
+
+  (void) arg;
+
+  while(1)
+  {
+    if(syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+       errno != EINTR)
+    {
+      syslog(LOG_ERR, "Cannot wait for completions: %s\n", strerror(errno));
+      sleep(1);
+      continue;
+    }
+
+    head = *uring.cq_head;
+    tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for(n = 0; head != tail; ++head, ++n)
+    {
+      cqe = &uring.cqes[head & *uring.cq_mask];
+      op = (struct xmp_uop *) (uintptr_t) cqe->user_data;
+      op->res = cqe->res;
+      xmp_stats_data(op->index, &op->start, op->res);
+      xmp_io_end(op->index);
+      op->done(op);
+    }
+
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+    if(n == 0) continue;
+
+    pthread_mutex_lock(&uring.lock);
+    uring.inflight -= n;
+    uring.completed += n;
+    pthread_cond_broadcast(&uring.cond);
+    pthread_mutex_unlock(&uring.lock);
+  }
+
+  return NULL;
+}
+
+/*
+  Sets up the ring with raw system calls. IORING_FEAT_RW_CUR_POS came
+  with IORING_OP_READ and IORING_OP_WRITE, so older kernels are left
+  on the threads backend.
+*/
+
+static int xmp_uring_init(unsigned int entries)
+{
+  int fd;
+  size_t sq_size, cq_size, sqes_size;
+  char *sq, *cq;
+  void *sqes;
+  pthread_t thread;
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(struct io_uring_params));
+
+  fd = syscall(__NR_io_uring_setup, entries, &p);
+  if(fd == -1) return -1;
+
+  if(!(p.features & IORING_FEAT_RW_CUR_POS))
+  {
+    close(fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    fd, IORING_OFF_SQ_RING);
+  cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    fd, IORING_OFF_CQ_RING);
+  sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    fd, IORING_OFF_SQES);
+
+  if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+  {
+    if(sq != MAP_FAILED) munmap(sq, sq_size);
+    if(cq != MAP_FAILED) munmap(cq, cq_size);
+    if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    close(fd);
+    return -1;
+  }
+
+  uring.fd = fd;
+  uring.sq_head = (unsigned int *) (sq + p.sq_off.head);
+  uring.sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+  uring.sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned int *) (sq + p.sq_off.array);
+  uring.cq_head = (unsigned int *) (cq + p.cq_off.head);
+  uring.cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  uring.cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  uring.sqes = sqes;
+
+  pthread_mutex_init(&uring.lock, NULL);
+  pthread_cond_init(&uring.cond, NULL);
+
+  if(pthread_create(&thread, NULL, xmp_uring_reap, NULL) != 0)
+  {
+    munmap(sq, sq_size);
+    munmap(cq, cq_size);
+    munmap(sqes, sqes_size);
+    close(fd);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pthread_detach(thread);
+
+  /* the completion queue is twice as long, so it cannot overflow */
+  uring.entries = p.sq_entries;
+
+  return 0;
+}
+
+/*
+  Queues a transfer and returns once it is on the ring. The mount's
+  scheduler slot is taken here and given back by the completion
+  thread, so a slot is never held longer than the transfer itself.
+  Without the ring the transfer runs in the calling thread.
+*/
+
+static void xmp_uring_submit(struct xmp_uop *op)
+{
+  int res;
+  unsigned int tail;
+  unsigned int slot;
+  struct io_uring_sqe *sqe;
+
+  xmp_io_begin(op->index, op->uid);
+
+  clock_gettime(CLOCK_MONOTONIC, &op->start);
+
+  if(uring.entries == 0)
+  {
+    if(op->write) res = pwrite(op->fd, op->buf, op->size, op->offset);
+    else res = pread(op->fd, op->buf, op->size, op->offset);
+    op->res = res == -1 ? -errno : res;
+    xmp_stats_data(op->index, &op->start, op->res);
+    xmp_io_end(op->index);
+    op->done(op);
+    return;
+  }
+
+  pthread_mutex_lock(&uring.lock);
+
+  if(uring.inflight >= uring.entries) ++uring.full;
+
+  while(uring.inflight >= uring.entries)
+  {
+    pthread_cond_wait(&uring.cond, &uring.lock);
+  }
+
+  tail = *uring.sq_tail;
+  slot = tail & *uring.sq_mask;
+
+  sqe = &uring.sqes[slot];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = op->fd;
+  sqe->addr = (uintptr_t) op->buf;
+  sqe->len = op->size;
+  sqe->off = op->offset;
+  sqe->user_data = (uintptr_t) op;
+
+  uring.sq_array[slot] = slot;
+
+  __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  do
+  {
+    res = syscall(__NR_io_uring_enter, uring.fd, 1, 0, 0, NULL, 0);
+  }
+  while(res == -1 && (errno == EINTR || errno == EAGAIN));
+
+  if(res == -1)
+  {
+    /* the kernel did not take the entry, so it is withdrawn */
+    res = -errno;
+    __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    res = 0;
+    ++uring.inflight;
+    ++uring.submitted;
+  }
+
+  pthread_mutex_unlock(&uring.lock);
+
+  if(res == 0) return;
+
+  op->res = res;
+  xmp_stats_data(op->index, &op->start, op->res);
+  xmp_io_end(op->index);
+  op->done(op);
+}
+
+static void xmp_uring_wake(struct xmp_uop *op)
+{
+  xmp_batch_done(op->arg);
+}
+
+/*
+  Runs one transfer and waits for it. Returns the byte count
+  or -errno like the FUSE callbacks. Reads and writes of handles
+  are answered from the completion thread instead (xmp_aio_done),
+  this is for the paths that need the result in the calling thread.
+*/
+
+static int xmp_uring_io(int fd, int index, uid_t uid, char *buf,
+  size_t size, off_t offset, int write)
+{
+  struct xmp_uop op;
+  struct xmp_batch batch;
+
+  batch.pending = 1;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.cond, NULL);
+
+  op.fd = fd;
+  op.index = index;
+  op.uid = uid;
+  op.write = write;
+  op.buf = buf;
+  op.size = size;
+  op.offset = offset;
+  op.done = xmp_uring_wake;
+  op.arg = &batch;
+
+  xmp_uring_submit(&op);
+
+  pthread_mutex_lock(&batch.lock);
+  while(batch.pending > 0) pthread_cond_wait(&batch.cond, &batch.lock);
+  pthread_mutex_unlock(&batch.lock);
+
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.cond);
+
+  return op.res;
+}
+
+static void xmp_cache_init(void)
+{
+  int i;
+
+  for(i = 0; i < CACHE_LOCKS; ++i)
+  {
+    pthread_mutex_init(&cache.locks[i], NULL);
+  }
+
+  if(storage->cachesize <= 0) return;
+
+  cache.entries = calloc(storage->cachesize, sizeof(struct xmp_centry));
+  if(cache.entries == NULL)
+  {
+    syslog(LOG_WARNING, "Cannot allocate path cache, caching disabled\n");
+    return;
+  }
+
+  cache.size = storage->cachesize;
+}
+
+static unsigned int xmp_hash(const char *path)
+{
+  unsigned int hash = 2166136261U;
+
+  while(*path)
+  {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static unsigned int xmp_cache_slot(const char *path)
+{
+  return cache.size ? xmp_hash(path) % cache.size : 0;
+}
+
+/*
+  Returns -1 for a cached ENOENT, 0 for a file, 1 for a directory
+  and -2 on a miss. On a miss, *seq receives the slot sequence number
+  that has to be passed to xmp_cache_put.
+*/
+
+static int xmp_cache_get(const char *path, char *real_path, int *index,
+  unsigned int *seq)
+{
+  int res;
+  unsigned int slot;
+  unsigned int generation;
+  struct xmp_centry *e;
+
+  *seq = 0;
+
+  if(cache.size == 0) return -2;
+
+  generation = xmp_config_enter()->generation;
+  xmp_config_leave();
+
+  slot = xmp_cache_slot(path);
+  e = &cache.entries[slot];
+
+  res = -2;
+
+  pthread_mutex_lock(&cache.locks[slot % CACHE_LOCKS]);
+
+  if(e->expires > time(NULL) && e->generation == generation &&
+     strcmp(e->path, path) == 0)
+  {
+    res = e->type;
+    if(res >= 0) strcpy(real_path, e->real_path);
+    if(index) *index = e->index;
+  }
+
+  *seq = e->seq;
+
+  pthread_mutex_unlock(&cache.locks[slot % CACHE_LOCKS]);
+
+  return res;
+}
+
+static void xmp_cache_put(const char *path, const char *real_path, int type,
+  int index, unsigned int seq)
+{
+  unsigned int slot;
+  struct xmp_centry *e;
+  struct xmp_config *cfg;
+
+  if(cache.size == 0 || strlen(path) >= MAX_PATH) return;
+
+  cfg = xmp_config_enter();
+
+  /*
+    Files created through another node or directly on the mounts
+    stay hidden while a negative entry lives, so keep them short.
+  */
+  if(type == -1 && cfg->cachenegttl <= 0)
+  {
+    xmp_config_leave();
+    return;
+  }
+
+  slot = xmp_cache_slot(path);
+  e = &cache.entries[slot];
+
+  pthread_mutex_lock(&cache.locks[slot % CACHE_LOCKS]);
+
+  /* skip the update if the slot was invalidated during the lookup */
+  if(e->seq == seq)
+  {
+    strcpy(e->path, path);
+    if(real_path) strcpy(e->real_path, real_path);
+    else e->real_path[0] = '\0';
+    e->type = type;
+    e->index = index;
+    e->generation = cfg->generation;
+    e->expires = time(NULL) + (type == -1 ? cfg->cachenegttl : cfg->cachettl);
+  }
+
+  pthread_mutex_unlock(&cache.locks[slot % CACHE_LOCKS]);
+
+  xmp_config_leave();
+}
+
+/*
+  Regular file attributes are cached next to the resolved path
+  and are only valid while the path entry itself is valid.
+*/
+
+static int xmp_cache_getattr(const char *path, struct stat *stbuf,
+  int *mount, unsigned int *seq)
+{
+  int res;
+  int index;
+  time_t now;
+  unsigned int slot;
+  unsigned int generation;
+  struct xmp_centry *e;
+
+  *seq = 0;
+
+  if(cache.size == 0) return -1;
+
+  generation = xmp_config_enter()->generation;
+  xmp_config_leave();
+
+  slot = xmp_cache_slot(path);
+  e = &cache.entries[slot];
+
+  res = -1;
+  now = time(NULL);
+
+  pthread_mutex_lock(&cache.locks[slot % CACHE_LOCKS]);
+
+  if(e->expires > now && e->attr_expires > now &&
+     e->generation == generation && strcmp(e->path, path) == 0)
+  {
+    memcpy(stbuf, &e->st, sizeof(struct stat));
+    index = e->index;
+    res = 0;
+  }
+
+  *seq = e->seq;
+
+  pthread_mutex_unlock(&cache.locks[slot % CACHE_LOCKS]);
+
+  /* fall back to the lookup, which fails fast on a mount marked down */
+  if(res == 0 && xmp_mountdown(index)) res = -1;
+
+  if(res == 0 && mount) *mount = index;
+
+  return res;
+}
+
+static void xmp_cache_setattr(const char *path, const struct stat *stbuf,
+  unsigned int seq)
+{
+  time_t now;
+  unsigned int slot;
+  int ttl;
+  struct xmp_centry *e;
+
+  if(cache.size == 0 || !S_ISREG(stbuf->st_mode)) return;
+
+  ttl = xmp_config_enter()->cachettl;
+  xmp_config_leave();
+
+  slot = xmp_cache_slot(path);
+  e = &cache.entries[slot];
+
+  now = time(NULL);
+
+  pthread_mutex_lock(&cache.locks[slot % CACHE_LOCKS]);
+
+  if(e->seq == seq && e->expires > now && strcmp(e->path, path) == 0)
+  {
+    memcpy(&e->st, stbuf, sizeof(struct stat));
+    e->attr_expires = now + ttl;
+  }
+
+  pthread_mutex_unlock(&cache.locks[slot % CACHE_LOCKS]);
+}
+
+/*
+  Drops cached attributes of the entry in the given slot, used on
+  paths where only the file handle is known.
+*/
+
+static void xmp_cache_touch(unsigned int slot)
+{
+  struct xmp_centry *e;
+
+  if(cache.size == 0) return;
+
+  e = &cache.entries[slot];
+
+  pthread_mutex_lock(&cache.locks[slot % CACHE_LOCKS]);
+
+  ++e->seq;
+  e->attr_expires = 0;
+
+  pthread_mutex_unlock(&cache.locks[slot % CACHE_LOCKS]);
+}
+
+static unsigned int xmp_cache_seq(unsigned int slot)
+{
+  unsigned int seq;
+
+  if(cache.size == 0) return 0;
+
+  pthread_mutex_lock(&cache.locks[slot % CACHE_LOCKS]);
+  seq = cache.entries[slot].seq;
+  pthread_mutex_unlock(&cache.locks[slot % CACHE_LOCKS]);
+
+  return seq;
+}
+
+static void xmp_ofile_init(void)
+{
+  pthread_mutex_init(&ofiles.lock, NULL);
+  pthread_cond_init(&ofiles.cond, NULL);
+}
+
+static struct xmp_ofile **xmp_ofile_find(const char *path)
+{
+  struct xmp_ofile **link;
+
+  link = &ofiles.buckets[xmp_hash(path) % OFILE_BUCKETS];
+
+  while(*link && strcmp((*link)->path, path) != 0) link = &(*link)->next;
+
+  return link;
+}
+
+/*
+  Registers a new handle of path. For a writer, *wopens receives the
+  open count to pass to xmp_ofile_sole, or 0 if another writer
+  already has the file open.
+*/
+
+static struct xmp_ofile *xmp_ofile_add(const char *path, int writer,
+  unsigned long *wopens)
+{
+  struct xmp_ofile *o;
+  struct xmp_ofile **link;
+
+  pthread_mutex_lock(&ofiles.lock);
+
+  /* a held entry may be gone once the hold ends, so it is looked up again */
+  while((o = *xmp_ofile_find(path)) && o->moving)
+  {
+    pthread_cond_wait(&ofiles.cond, &ofiles.lock);
+  }
+
+  if(o == NULL)
+  {
+    o = calloc(1, sizeof(struct xmp_ofile));
+    if(o) o->path = strdup(path);
+    if(o && o->path == NULL)
+    {
+      free(o);
+      o = NULL;
+    }
+    if(o)
+    {
+      o->linked = 1;
+      o->slot = xmp_cache_slot(path);
+      link = xmp_ofile_find(path);
+      *link = o;
+    }
+  }
+
+  if(o)
+  {
+    ++o->handles;
+    if(writer)
+    {
+      ++o->writers;
+      ++o->wopens;
+      *wopens = o->writers > 1 ? 0 : o->wopens;
+    }
+  }
+
+  pthread_mutex_unlock(&ofiles.lock);
+
+  return o;
+}
+
+static void xmp_ofile_unlink_locked(struct xmp_ofile *o)
+{
+  struct xmp_ofile **link;
+
+  if(!o->linked) return;
+
+  link = &ofiles.buckets[xmp_hash(o->path) % OFILE_BUCKETS];
+  while(*link != o) link = &(*link)->next;
+  *link = o->next;
+
+  o->next = NULL;
+  o->linked = 0;
+}
+
+static void xmp_ofile_remove(struct xmp_ofile *o, int writer)
+{
+  if(o == NULL) return;
+
+  pthread_mutex_lock(&ofiles.lock);
+
+  if(writer) --o->writers;
+
+  if(--o->handles == 0)
+  {
+    xmp_ofile_unlink_locked(o);
+    free(o->path);
+    free(o);
+  }
+
+  pthread_mutex_unlock(&ofiles.lock);
+}
+
+/* true if no other writer had the file open while this one did */
+static int xmp_ofile_sole(struct xmp_ofile *o, unsigned long wopens)
+{
+  int res;
+
+  if(o == NULL || wopens == 0) return 0;
+
+  pthread_mutex_lock(&ofiles.lock);
+  res = o->writers == 1 && o->wopens == wopens;
+  pthread_mutex_unlock(&ofiles.lock);
+
+  return res;
+}
+
+/* Drops cached attributes under the current name of the file */
+
+static void xmp_ofile_touch(struct xmp_ofile *o)
+{
+  if(o) xmp_cache_touch(o->slot);
+}
+
+/* Copies the current name of the file, fails once it was unlinked */
+
+static int xmp_ofile_path(struct xmp_ofile *o, char *path)
+{
+  int res = -1;
+
+  if(o == NULL) return -1;
+
+  pthread_mutex_lock(&ofiles.lock);
+
+  if(o->linked && strlen(o->path) < MAX_PATH)
+  {
+    strcpy(path, o->path);
+    res = 0;
+  }
+
+  pthread_mutex_unlock(&ofiles.lock);
+
+  return res;
+}
+
+/* Holds new opens of the file, if the caller has the only handle */
+
+static int xmp_ofile_move(struct xmp_ofile *o)
+{
+  int res = 0;
+
+  if(o == NULL) return 0;
+
+  pthread_mutex_lock(&ofiles.lock);
+
+  if(o->linked && o->handles == 1 && !o->moving)
+  {
+    o->moving = 1;
+    res = 1;
+  }
+
+  pthread_mutex_unlock(&ofiles.lock);
+
+  return res;
+}
+
+static void xmp_ofile_moved(struct xmp_ofile *o)
+{
+  pthread_mutex_lock(&ofiles.lock);
+  o->moving = 0;
+  pthread_cond_broadcast(&ofiles.cond);
+  pthread_mutex_unlock(&ofiles.lock);
+}
+
+/*
+  Holds new opens of a file that has no handles on this node. Returns
+  NULL if the file is open.
+*/
+
+static struct xmp_ofile *xmp_ofile_hold(const char *path)
+{
+  struct xmp_ofile *o;
+  struct xmp_ofile **link;
+
+  pthread_mutex_lock(&ofiles.lock);
+
+  link = xmp_ofile_find(path);
+  o = NULL;
+
+  if(*link == NULL)
+  {
+    o = calloc(1, sizeof(struct xmp_ofile));
+    if(o) o->path = strdup(path);
+    if(o && o->path == NULL)
+    {
+      free(o);
+      o = NULL;
+    }
+    if(o)
+    {
+      o->linked = 1;
+      o->moving = 1;
+      o->slot = xmp_cache_slot(path);
+      *link = o;
+    }
+  }
+
+  pthread_mutex_unlock(&ofiles.lock);
+
+  return o;
+}
+
+static void xmp_ofile_unhold(struct xmp_ofile *o)
+{
+  pthread_mutex_lock(&ofiles.lock);
+
+  xmp_ofile_unlink_locked(o);
+  free(o->path);
+  free(o);
+
+  pthread_cond_broadcast(&ofiles.cond);
+
+  pthread_mutex_unlock(&ofiles.lock);
+}
+
+static void xmp_ofile_unlink(const char *path)
+{
+  struct xmp_ofile *o;
+
+  pthread_mutex_lock(&ofiles.lock);
+  o = *xmp_ofile_find(path);
+  if(o) xmp_ofile_unlink_locked(o);
+  pthread_mutex_unlock(&ofiles.lock);
+}
+
+static void xmp_ofile_rename(const char *from, const char *to)
+{
+  char *copy;
+  struct xmp_ofile *o;
+  struct xmp_ofile **link;
+
+  copy = strdup(to);
+
+  pthread_mutex_lock(&ofiles.lock);
+
+  /* handles of a replaced target keep writing to the unlinked file */
+  o = *xmp_ofile_find(to);
+  if(o) xmp_ofile_unlink_locked(o);
+
+  o = *xmp_ofile_find(from);
+  if(o && copy)
+  {
+    xmp_ofile_unlink_locked(o);
+    free(o->path);
+    o->path = copy;
+    o->slot = xmp_cache_slot(copy);
+    copy = NULL;
+    link = &ofiles.buckets[xmp_hash(o->path) % OFILE_BUCKETS];
+    o->next = *link;
+    o->linked = 1;
+    *link = o;
+  }
+  else if(o)
+  {
+    xmp_ofile_unlink_locked(o);
+  }
+
+  pthread_mutex_unlock(&ofiles.lock);
+
+  free(copy);
+}
+
+/*
+  With storage.openlist set, every node writes the names of the files
+  it has open to a file named after its host in that directory, NUL
+  separated and rewritten every OFILE_PUBLISH seconds. rebalance reads
+  the lists of all nodes and takes the age of each list as the lease
+  of its node, so it can tell when no node holds the old copy of a
+  moved file any more.
+*/
+
+static void xmp_ofile_publish(const char *dir)
+{
+  int fd, i, failed;
+  ssize_t res;
+  size_t len, used, size;
+  char *list, *grown;
+  struct xmp_ofile *o;
+  char host[256];
+  char list_path[MAX_PATH];
+  char temp_path[MAX_PATH];
+
+  if(gethostname(host, sizeof(host)) == -1) return;
+  host[sizeof(host) - 1] = '\0';
+
+  if(snprintf(list_path, MAX_PATH, "%s/%s", dir, host) >= MAX_PATH ||
+     snprintf(temp_path, MAX_PATH, "%s/.%s.tmp", dir, host) >= MAX_PATH) return;
+
+  list = NULL;
+  used = 0;
+  size = 0;
+  failed = 0;
+
+  pthread_mutex_lock(&ofiles.lock);
+
+  for(i = 0; i < OFILE_BUCKETS && !failed; ++i)
+  {
+    for(o = ofiles.buckets[i]; o && !failed; o = o->next)
+    {
+      len = strlen(o->path) + 1;
+      if(used + len > size)
+      {
+        size = size ? 2 * size : 65536;
+        if(size < used + len) size = used + len;
+        grown = realloc(list, size);
+        /* a short list would hide open files, so the lease runs out instead */
+        failed = grown == NULL;
+        if(failed) break;
+        list = grown;
+      }
+      memcpy(list + used, o->path, len);
+      used += len;
+    }
+  }
+
+  pthread_mutex_unlock(&ofiles.lock);
+
+  if(failed)
+  {
+    free(list);
+    return;
+  }
+
+  fd = open(temp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd == -1)
+  {
+    syslog(LOG_ERR, "Cannot write open file list %s: %s\n", temp_path, strerror(errno));
+    free(list);
+    return;
+  }
+
+  res = used > 0 ? write(fd, list, used) : 0;
+
+  if(close(fd) == -1 || res != (ssize_t) used || rename(temp_path, list_path) == -1)
+  {
+    syslog(LOG_ERR, "Cannot write open file list %s: %s\n", list_path, strerror(errno));
+    unlink(temp_path);
+  }
+
+  free(list);
+}
+
+static void *xmp_ofile_publisher(void *arg)
+{
+  char dir[MAX_PATH];
+  struct xmp_config *cfg;
+
+  (void) arg;
+
+  while(1)
+  {
+    cfg = xmp_config_enter();
+    dir[0] = '\0';
+    if(cfg->openlist && strlen(cfg->openlist) < MAX_PATH) strcpy(dir, cfg->openlist);
+    xmp_config_leave();
+
+    if(dir[0]) xmp_ofile_publish(dir);
+
+    sleep(OFILE_PUBLISH);
+  }
+
+  return NULL;
+}
+
+static unsigned int xmp_locindex_check(const struct xmp_lrecord *r)
+{
+  unsigned int hash = 2166136261U;
+  const unsigned char *p = (const unsigned char *) &r->op;
+  const unsigned char *end = (const unsigned char *) (r + 1);
+
+  while(p < end)
+  {
+    hash ^= *p++;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+/*
+  Returns the slot holding path or -1. With free set, it also returns
+  the first slot on the probe sequence that a new entry could take.
+*/
+
+static long xmp_locindex_find(const char *path, unsigned int hash, long *free)
+{
+  int i;
+  long n;
+  struct xmp_lslot *s;
+
+  if(free) *free = -1;
+
+  for(i = 0; i < LOCINDEX_PROBES; ++i)
+  {
+    n = (hash + i) % locindex.nslots;
+    s = &locindex.slots[n];
+
+    if(s->state != LOCINDEX_USED)
+    {
+      if(free && *free < 0) *free = n;
+      if(s->state == LOCINDEX_EMPTY) break;
+      continue;
+    }
+
+    if(s->hash == hash && strcmp(s->name, path) == 0) return n;
+  }
+
+  return -1;
+}
+
+/*
+  Applies a change to the table. A new entry that finds no free slot
+  replaces the first one it probed, its path is then resolved from
+  the symlink again.
+*/
+
+static void xmp_locindex_apply(unsigned int op, const struct xmp_lslot *slot)
+{
+  long n, free;
+
+  n = xmp_locindex_find(slot->name, slot->hash, &free);
+
+  if(op == LOCINDEX_PUT)
+  {
+    if(n < 0)
+    {
+      n = free >= 0 ? free : (long) (slot->hash % locindex.nslots);
+      if(locindex.slots[n].state != LOCINDEX_USED) ++locindex.header->used;
+    }
+    memcpy(&locindex.slots[n], slot, sizeof(struct xmp_lslot));
+  }
+  else if(n >= 0)
+  {
+    locindex.slots[n].state = LOCINDEX_DELETED;
+    if(locindex.header->used > 0) --locindex.header->used;
+  }
+}
+
+/* Stops using the index and makes the next start begin with an empty one */
+
+static void xmp_locindex_disable(const char *what)
+{
+  syslog(LOG_ERR, "Cannot %s location index: %s, index disabled\n",
+    what, strerror(errno));
+
+  pthread_rwlock_wrlock(&locindex.lock);
+  locindex.header->magic = 0;
+  msync(locindex.header, LOCINDEX_HEADER, MS_SYNC);
+  locindex.nslots = 0;
+  pthread_rwlock_unlock(&locindex.lock);
+}
+
+/*
+  The log that is full is synced and the next changes go to the other
+  one. The table is then flushed without holding locindex.log, before
+  the header records the last change of the full log, and that log is
+  only emptied after that, so a crash at any point leaves every change
+  either in the table or in a log. Changes that reach the table while
+  it is flushed are in the other log and replay the same way.
+*/
+
+static void xmp_locindex_checkpoint(void)
+{
+  int res, full;
+  unsigned long long seq;
+
+  pthread_mutex_lock(&locindex.log);
+
+  if(!locindex.due || locindex.checkpointing || locindex.nslots == 0)
+  {
+    pthread_mutex_unlock(&locindex.log);
+    return;
+  }
+
+  full = locindex.active;
+  seq = locindex.seq;
+
+  res = fdatasync(locindex.wals[full]);
+  if(res == 0)
+  {
+    locindex.due = 0;
+    locindex.checkpointing = 1;
+    locindex.active = !full;
+    locindex.logged = 0;
+    if(locindex.synced < seq) locindex.synced = seq;
+    pthread_cond_broadcast(&locindex.cond);
+  }
+
+  pthread_mutex_unlock(&locindex.log);
+
+  if(res == 0) res = msync(locindex.header, locindex.mapped, MS_SYNC);
+
+  pthread_mutex_lock(&locindex.log);
+
+  if(res == 0)
+  {
+    locindex.header->seq = seq;
+    res = msync(locindex.header, LOCINDEX_HEADER, MS_SYNC);
+  }
+
+  if(res == 0) res = ftruncate(locindex.wals[full], 0);
+
+  locindex.checkpointing = 0;
+  if(res == 0) ++locindex.checkpoints;
+
+  pthread_mutex_unlock(&locindex.log);
+
+  if(res == -1) xmp_locindex_disable("checkpoint");
+}
+
+/*
+  Writes a change to the log and then applies it, returns its sequence
+  number for xmp_locindex_commit or 0 if it was not logged. The caller
+  holds locindex.log, which keeps the order of the log and the table
+  the same; the table itself is only locked while the change is
+  applied.
+*/
+
+static unsigned long long xmp_locindex_log(unsigned int op, const struct xmp_lslot *slot)
+{
+  struct xmp_lrecord r;
+
+  memset(&r, 0, sizeof(struct xmp_lrecord));
+
+  r.op = op;
+  r.seq = locindex.seq + 1;
+  memcpy(&r.slot, slot, sizeof(struct xmp_lslot));
+  r.check = xmp_locindex_check(&r);
+
+  if(write(locindex.wals[locindex.active], &r, sizeof(struct xmp_lrecord)) !=
+     sizeof(struct xmp_lrecord))
+  {
+    if(errno == 0) errno = EIO;
+    xmp_locindex_disable("log to");
+    return 0;
+  }
+
+  locindex.seq = r.seq;
+  locindex.logged += sizeof(struct xmp_lrecord);
+
+  pthread_rwlock_wrlock(&locindex.lock);
+  ++locindex.changes[slot->hash % CACHE_LOCKS];
+  if(locindex.nslots > 0) xmp_locindex_apply(op, slot);
+  pthread_rwlock_unlock(&locindex.lock);
+
+  if(locindex.logged >= LOCINDEX_LOG) locindex.due = 1;
+
+  return r.seq;
+}
+
+/*
+  Waits until the change seq is on disk, called once locindex.log has
+  been released. The first waiter syncs the log for every change
+  written so far and the others wait for it, so concurrent changes
+  share one fdatasync.
+*/
+
+static void xmp_locindex_commit(unsigned long long seq)
+{
+  int fd, res;
+  unsigned long long target;
+
+  if(seq == 0) return;
+
+  res = 0;
+
+  pthread_mutex_lock(&locindex.log);
+
+  while(locindex.sync && locindex.synced < seq && locindex.nslots > 0 && res == 0)
+  {
+    if(locindex.syncing)
+    {
+      pthread_cond_wait(&locindex.cond, &locindex.log);
+      continue;
+    }
+
+    locindex.syncing = 1;
+    fd = locindex.wals[locindex.active];
+    target = locindex.seq;
+
+    pthread_mutex_unlock(&locindex.log);
+
+    res = fdatasync(fd);
+
+    pthread_mutex_lock(&locindex.log);
+
+    locindex.syncing = 0;
+    if(res == 0 && locindex.synced < target) locindex.synced = target;
+    pthread_cond_broadcast(&locindex.cond);
+  }
+
+  pthread_mutex_unlock(&locindex.log);
+
+  if(res == -1) xmp_locindex_disable("log to");
+
+  xmp_locindex_checkpoint();
+}
+
+/* Applies the records of a log that are newer than the table */
+
+static unsigned long xmp_locindex_replay(int wal)
+{
+  unsigned long replayed;
+  struct xmp_lrecord r;
+
+  /* a torn record at the end is where the last run stopped */
+  replayed = 0;
+  while(pread(wal, &r, sizeof(struct xmp_lrecord), replayed * sizeof(struct xmp_lrecord)) ==
+    sizeof(struct xmp_lrecord) && r.check == xmp_locindex_check(&r))
+  {
+    if(r.seq > locindex.seq)
+    {
+      xmp_locindex_apply(r.op, &r.slot);
+      locindex.seq = r.seq;
+    }
+    ++replayed;
+  }
+
+  return replayed;
+}
+
+static void xmp_locindex_init(void)
+{
+  int i, res;
+  int fd, first;
+  int wals[2];
+  void *map;
+  size_t size;
+  struct stat st;
+  struct xmp_lrecord r[2];
+  struct xmp_lheader h;
+  unsigned int hash;
+  unsigned long replayed;
+  char name[MAX_PATH];
+
+  pthread_rwlock_init(&locindex.lock, NULL);
+  pthread_mutex_init(&locindex.log, NULL);
+  pthread_cond_init(&locindex.cond, NULL);
+
+  if(storage->locindex == NULL || storage->locindexsize <= 0) return;
+
+  size = LOCINDEX_HEADER + (size_t) storage->locindexsize * sizeof(struct xmp_lslot);
+
+  fd = open(storage->locindex, O_RDWR | O_CREAT, 0600);
+
+  for(i = 0; i < 2; ++i)
+  {
+    snprintf(name, MAX_PATH, "%s.wal.%d", storage->locindex, i);
+    wals[i] = fd == -1 ? -1 : open(name, O_RDWR | O_CREAT | O_APPEND, 0600);
+  }
+
+  if(fd == -1 || wals[0] == -1 || wals[1] == -1 || fstat(fd, &st) == -1)
+  {
+    syslog(LOG_WARNING, "Cannot open location index %s: %s, index disabled\n",
+      storage->locindex, strerror(errno));
+    if(fd != -1) close(fd);
+    if(wals[0] != -1) close(wals[0]);
+    if(wals[1] != -1) close(wals[1]);
+    return;
+  }
+
+  memset(&h, 0, sizeof(struct xmp_lheader));
+
+  if(st.st_size == (off_t) size &&
+     pread(fd, &h, sizeof(struct xmp_lheader), 0) != sizeof(struct xmp_lheader))
+  {
+    h.magic = 0;
+  }
+
+  /* entries of a mount that now has another path would point nowhere */
+  for(i = 0; i < MAX_STORAGE; ++i)
+  {
+    hash = i < storage->nmounts ? xmp_hash(storage->mounts[i]) : 0;
+    if(h.mounts[i] && hash && h.mounts[i] != hash) h.magic = 0;
+  }
+
+  if(h.magic != LOCINDEX_MAGIC || h.version != LOCINDEX_VERSION ||
+     h.nslots != (unsigned int) storage->locindexsize)
+  {
+    syslog(LOG_INFO, "Starting with an empty location index %s\n", storage->locindex);
+
+    memset(&h, 0, sizeof(struct xmp_lheader));
+    h.magic = LOCINDEX_MAGIC;
+    h.version = LOCINDEX_VERSION;
+    h.nslots = storage->locindexsize;
+
+    if(ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1 ||
+       pwrite(fd, &h, sizeof(struct xmp_lheader), 0) != sizeof(struct xmp_lheader) ||
+       ftruncate(wals[0], 0) == -1 || ftruncate(wals[1], 0) == -1)
+    {
+      syslog(LOG_WARNING, "Cannot create location index %s: %s, index disabled\n",
+        storage->locindex, strerror(errno));
+      close(fd);
+      close(wals[0]);
+      close(wals[1]);
+      return;
+    }
+  }
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    syslog(LOG_WARNING, "Cannot map location index %s: %s, index disabled\n",
+      storage->locindex, strerror(errno));
+    close(fd);
+    close(wals[0]);
+    close(wals[1]);
+    return;
+  }
+
+  locindex.fd = fd;
+  locindex.wals[0] = wals[0];
+  locindex.wals[1] = wals[1];
+  locindex.sync = storage->locindexsync;
+  locindex.mapped = size;
+  locindex.header = map;
+  locindex.slots = (struct xmp_lslot *) ((char *) map + LOCINDEX_HEADER);
+  locindex.seq = locindex.header->seq;
+
+  for(i = 0; i < storage->nmounts; ++i)
+  {
+    if(locindex.header->mounts[i] == 0) locindex.header->mounts[i] = xmp_hash(storage->mounts[i]);
+  }
+
+  locindex.nslots = storage->locindexsize;
+
+  /* the log that was filled first is replayed first */
+  for(i = 0; i < 2; ++i)
+  {
+    if(pread(wals[i], &r[i], sizeof(struct xmp_lrecord), 0) != sizeof(struct xmp_lrecord) ||
+       r[i].check != xmp_locindex_check(&r[i])) r[i].seq = 0;
+  }
+
+  first = r[1].seq > 0 && (r[0].seq == 0 || r[1].seq < r[0].seq);
+
+  replayed = xmp_locindex_replay(wals[first]);
+  replayed += xmp_locindex_replay(wals[!first]);
+
+  if(replayed > 0)
+  {
+    syslog(LOG_INFO, "Replayed %lu location index records\n", replayed);
+  }
+
+  locindex.synced = locindex.seq;
+
+  res = msync(locindex.header, locindex.mapped, MS_SYNC);
+  if(res == 0)
+  {
+    locindex.header->seq = locindex.seq;
+    res = msync(locindex.header, LOCINDEX_HEADER, MS_SYNC);
+  }
+  if(res == 0 && (ftruncate(wals[0], 0) == -1 || ftruncate(wals[1], 0) == -1)) res = -1;
+
+  if(res == -1) xmp_locindex_disable("checkpoint");
+}
+
+/*
+  Looks up the real path of a data file. *seq is the change count
+  to hand to xmp_locindex_put once a miss has been resolved from the
+  symlink, so a result that raced with a change is not stored.
+*/
+
+static int xmp_locindex_get(const char *path, char *real_path, int *index,
+  unsigned int *seq)
+{
+  int res;
+  long n;
+  time_t now;
+  unsigned int hash;
+  struct xmp_lslot *s;
+  struct xmp_config *cfg;
+
+  *seq = 0;
+
+  if(locindex.nslots == 0) return -1;
+
+  res = -1;
+
+  hash = xmp_hash(path);
+
+  now = time(NULL);
+
+  cfg = xmp_config_enter();
+
+  pthread_rwlock_rdlock(&locindex.lock);
+
+  *seq = locindex.changes[hash % CACHE_LOCKS];
+
+  if(locindex.nslots > 0 && (n = xmp_locindex_find(path, hash, NULL)) >= 0)
+  {
+    s = &locindex.slots[n];
+    if(cfg->locindexttl > 0 && s->verified + cfg->locindexttl <= now)
+    {
+      __sync_fetch_and_add(&locindex.expired, 1);
+    }
+    else if(s->mount > 0 && s->mount < cfg->nmounts &&
+       locindex.header->mounts[s->mount] == xmp_hash(cfg->mounts[s->mount]) &&
+       strlen(cfg->mounts[s->mount]) + strlen(s->name + s->length) < MAX_PATH)
+    {
+      sprintf(real_path, "%s%s", cfg->mounts[s->mount], s->name + s->length);
+      *index = s->mount;
+      res = 0;
+    }
+  }
+
+  pthread_rwlock_unlock(&locindex.lock);
+
+  xmp_config_leave();
+
+  __sync_fetch_and_add(res == 0 ? &locindex.hits : &locindex.misses, 1);
+
+  return res;
+}
+
+/*
+  Records the location of a data file. Callers that have just written
+  the symlink pass seq as NULL, lookups pass the count they got from
+  xmp_locindex_get. Paths that do not fit a slot are not indexed. A
+  lookup only fills the table in place, a lost fill or renewal costs
+  one more check of the symlink.
+*/
+
+static void xmp_locindex_put(const char *path, const char *real_path,
+  unsigned int *seq)
+{
+  int index;
+  size_t length, prefix, suffix;
+  unsigned long long done;
+  struct xmp_lslot slot;
+  struct xmp_config *cfg;
+
+  if(locindex.nslots == 0) return;
+
+  cfg = xmp_config_enter();
+
+  index = xmp_mountindex(real_path);
+
+  length = strlen(path) + 1;
+  prefix = index > 0 ? strlen(cfg->mounts[index]) : 0;
+  suffix = strlen(real_path + prefix) + 1;
+
+  if(index <= 0 || length + suffix > LOCINDEX_NAME ||
+     xmp_hash(cfg->mounts[index]) != locindex.header->mounts[index])
+  {
+    xmp_config_leave();
+    return;
+  }
+
+  memset(&slot, 0, sizeof(struct xmp_lslot));
+
+  slot.hash = xmp_hash(path);
+  slot.state = LOCINDEX_USED;
+  slot.mount = index;
+  slot.length = length;
+  slot.verified = time(NULL);
+  memcpy(slot.name, path, length);
+  memcpy(slot.name + length, real_path + prefix, suffix);
+
+  xmp_config_leave();
+
+  done = 0;
+
+  pthread_mutex_lock(&locindex.log);
+
+  if(locindex.nslots > 0 && seq && *seq == locindex.changes[slot.hash % CACHE_LOCKS])
+  {
+    pthread_rwlock_wrlock(&locindex.lock);
+    xmp_locindex_apply(LOCINDEX_PUT, &slot);
+    pthread_rwlock_unlock(&locindex.lock);
+  }
+  else if(locindex.nslots > 0 && seq == NULL)
+  {
+    done = xmp_locindex_log(LOCINDEX_PUT, &slot);
+    ++locindex.puts;
+  }
+
+  pthread_mutex_unlock(&locindex.log);
+
+  xmp_locindex_commit(done);
+}
+
+static void xmp_locindex_drop(const char *path)
+{
+  long n;
+  unsigned int hash;
+  unsigned long long done;
+  struct xmp_lslot slot;
+
+  if(locindex.nslots == 0) return;
+
+  hash = xmp_hash(path);
+
+  done = 0;
+
+  pthread_mutex_lock(&locindex.log);
+
+  n = locindex.nslots > 0 ? xmp_locindex_find(path, hash, NULL) : -1;
+
+  if(n >= 0)
+  {
+    memcpy(&slot, &locindex.slots[n], sizeof(struct xmp_lslot));
+    done = xmp_locindex_log(LOCINDEX_DEL, &slot);
+    ++locindex.drops;
+  }
+  else
+  {
+    /* a lookup of the old location may still be under way */
+    pthread_rwlock_wrlock(&locindex.lock);
+    ++locindex.changes[hash % CACHE_LOCKS];
+    pthread_rwlock_unlock(&locindex.lock);
+  }
+
+  pthread_mutex_unlock(&locindex.log);
+
+  xmp_locindex_commit(done);
+}
+
+static void xmp_cache_invalidate(const char *path)
+{
+  unsigned int slot;
+  struct xmp_centry *e;
+
+  xmp_locindex_drop(path);
+
+  if(cache.size == 0) return;
+
+  slot = xmp_cache_slot(path);
+  e = &cache.entries[slot];
+
+  pthread_mutex_lock(&cache.locks[slot % CACHE_LOCKS]);
+
+  ++e->seq;
+  e->expires = 0;
+  e->attr_expires = 0;
+
+  pthread_mutex_unlock(&cache.locks[slot % CACHE_LOCKS]);
+}
+
+static void xmp_dirindex_init(void)
+{
+  int i;
+
+  for(i = 0; i < CACHE_LOCKS; ++i)
+  {
+    pthread_mutex_init(&dirindex.locks[i], NULL);
+  }
+
+  if(storage->dirindex <= 0) return;
+
+  dirindex.entries = calloc(storage->dirindex, sizeof(struct xmp_dentry));
+  if(dirindex.entries == NULL)
+  {
+    syslog(LOG_WARNING, "Cannot allocate directory index, index disabled\n");
+    return;
+  }
+
+  dirindex.size = storage->dirindex;
+}
+
+static void xmp_dirindex_get(const char *path, unsigned char *known,
+  unsigned char *present)
+{
+  unsigned int slot;
+  unsigned int generation;
+  struct xmp_dentry *e;
+
+  memset(known, 0, MOUNT_MASK);
+  memset(present, 0, MOUNT_MASK);
+
+  if(dirindex.size == 0) return;
+
+  generation = xmp_config_enter()->generation;
+  xmp_config_leave();
+
+  slot = xmp_hash(path) % dirindex.size;
+  e = &dirindex.entries[slot];
+
+  pthread_mutex_lock(&dirindex.locks[slot % CACHE_LOCKS]);
+
+  if(e->expires > time(NULL) && e->generation == generation &&
+     strcmp(e->path, path) == 0)
+  {
+    memcpy(known, e->known, MOUNT_MASK);
+    memcpy(present, e->present, MOUNT_MASK);
+  }
+
+  pthread_mutex_unlock(&dirindex.locks[slot % CACHE_LOCKS]);
+}
+
+/*
+  Mounts set in known take their bit from present, the others keep
+  what the entry had. An entry lives for storage.dirindexttl seconds
+  from its creation, which bounds how long directories made or
+  removed by other clients can be missed.
+*/
+
+static void xmp_dirindex_merge(const char *path, const unsigned char *known,
+  const unsigned char *present)
+{
+  int i;
+  time_t now;
+  unsigned int slot;
+  struct xmp_dentry *e;
+  struct xmp_config *cfg;
+
+  if(dirindex.size == 0 || strlen(path) >= MAX_PATH) return;
+
+  cfg = xmp_config_enter();
+
+  slot = xmp_hash(path) % dirindex.size;
+  e = &dirindex.entries[slot];
+
+  now = time(NULL);
+
+  pthread_mutex_lock(&dirindex.locks[slot % CACHE_LOCKS]);
+
+  if(e->expires <= now || e->generation != cfg->generation ||
+     strcmp(e->path, path) != 0)
+  {
+    strcpy(e->path, path);
+    memset(e->known, 0, MOUNT_MASK);
+    memset(e->present, 0, MOUNT_MASK);
+    e->generation = cfg->generation;
+    e->expires = now + cfg->dirindexttl;
+  }
+
+  for(i = 0; i < MOUNT_MASK; ++i)
+  {
+    e->present[i] = (e->present[i] & ~known[i]) | (present[i] & known[i]);
+    e->known[i] |= known[i];
+  }
+
+  pthread_mutex_unlock(&dirindex.locks[slot % CACHE_LOCKS]);
+
+  xmp_config_leave();
+}
+
+static void xmp_dirindex_mark(const char *path, int index, int present)
+{
+  unsigned char known[MOUNT_MASK];
+  unsigned char bits[MOUNT_MASK];
+
+  if(index <= 0 || index >= MAX_STORAGE) return;
+
+  memset(known, 0, MOUNT_MASK);
+  memset(bits, 0, MOUNT_MASK);
+
+  MOUNT_SET(known, index);
+  if(present) MOUNT_SET(bits, index);
+
+  xmp_dirindex_merge(path, known, bits);
+}
+
+static int xmp_dirindex_has(const char *path, int index)
+{
+  unsigned char known[MOUNT_MASK];
+  unsigned char present[MOUNT_MASK];
+
+  if(index <= 0 || index >= MAX_STORAGE) return 0;
+
+  xmp_dirindex_get(path, known, present);
+
+  return MOUNT_TEST(present, index) != 0;
+}
+
+static void xmp_dirindex_drop(const char *path)
+{
+  unsigned int slot;
+  struct xmp_dentry *e;
+
+  if(dirindex.size == 0) return;
+
+  slot = xmp_hash(path) % dirindex.size;
+  e = &dirindex.entries[slot];
+
+  pthread_mutex_lock(&dirindex.locks[slot % CACHE_LOCKS]);
+
+  if(strcmp(e->path, path) == 0) e->expires = 0;
+
+  pthread_mutex_unlock(&dirindex.locks[slot % CACHE_LOCKS]);
+}
+
+/*
+  Drops the entries of all directories above path. Used when a create
+  fails with ENOENT, since xmp_makerealdir may have trusted an entry
+  for a directory that another client or nscheck has removed.
+*/
+
+static void xmp_dirindex_forget(const char *path)
+{
+  char *ptr;
+  char dir_path[MAX_PATH];
+
+  strncpy(dir_path, path, MAX_PATH - 1);
+  dir_path[MAX_PATH - 1] = '\0';
+
+  while((ptr = strrchr(dir_path, '/')) && ptr > dir_path)
+  {
+    *ptr = '\0';
+    xmp_dirindex_drop(dir_path);
+  }
+}
+
+/*
+  Fills mounts with the data mounts that hold the directory, highest
+  index first. Mounts the index knows about are trusted either way
+  for storage.dirindexttl, only unknown ones are probed. A stale
+  present bit only costs an ENOENT, after which the caller drops the
+  entry. Mounts that are down are skipped. Returns the count.
+*/
+
+static int xmp_dirmounts(struct xmp_config *cfg, const char *path, int *mounts)
+{
+  int i, n, res, probes;
+  char dir_path[MAX_PATH];
+  unsigned char known[MOUNT_MASK];
+  unsigned char present[MOUNT_MASK];
+  unsigned char seen[MOUNT_MASK];
+  unsigned char found[MOUNT_MASK];
+
+  xmp_dirindex_get(path, known, present);
+
+  memset(seen, 0, MOUNT_MASK);
+  memset(found, 0, MOUNT_MASK);
+
+  n = 0;
+  probes = 0;
+
+  for(i = cfg->nmounts - 1; i > 0; --i)
+  {
+    if(xmp_mountdown(i)) continue;
+
+    if(MOUNT_TEST(known, i) && !MOUNT_TEST(present, i)) continue;
+
+    if(!MOUNT_TEST(known, i))
+    {
+      snprintf(dir_path, MAX_PATH, "%s/%s", cfg->mounts[i], path);
+      res = access(dir_path, F_OK);
+      ++probes;
+
+      /* only definite answers go into the index */
+      if(res == 0 || errno == ENOENT) MOUNT_SET(seen, i);
+      if(res == -1) continue;
+
+      MOUNT_SET(found, i);
+    }
+
+    mounts[n++] = i;
+  }
+
+  if(probes > 0)
+  {
+    xmp_dirindex_merge(path, seen, found);
+    __sync_fetch_and_add(&dirindex.probes, probes);
+  }
+  else
+  {
+    __sync_fetch_and_add(&dirindex.hits, 1);
+  }
+
+  return n;
+}
+
+/*
+  Returns 1 for a directory, 0 for a file, -1 if the path cannot be
+  resolved and -2 if the file lives on a data mount that is down.
+*/
+
+static int xmp_realpath(const char *path, char *real_path, char *meta_path,
+  int *mount)
+{
+  int res;
+  int index;
+  unsigned int seq;
+  unsigned int changes;
+  struct stat stbuf;
+  struct timespec start;
+
+  real_path[0] = '\0';
+  meta_path[0] = '\0';
+
+  if(mount) *mount = 0;
+
+  if(xmp_metapath(path, meta_path) == -1) return -1;
+
+  res = xmp_cache_get(path, real_path, &index, &seq);
+
+  if(res == -1)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if(res >= 0)
+  {
+    if(mount && res == 0) *mount = index;
+    return res == 0 && xmp_mountdown(index) ? -2 : res;
+  }
+
+  if(xmp_locindex_get(path, real_path, &index, &changes) == 0)
+  {
+    if(mount) *mount = index;
+    xmp_cache_put(path, real_path, 0, index, seq);
+    return xmp_mountdown(index) ? -2 : 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = lstat(meta_path, &stbuf);
+
+  xmp_stats_meta(&start, res);
+
+  if(res == -1)
+  {
+    if(errno == ENOENT) xmp_cache_put(path, NULL, -1, -1, seq);
+    return -1;
+  }
+
+  if(S_ISDIR(stbuf.st_mode)) {
+    strncpy(real_path, meta_path, MAX_PATH);
+    xmp_cache_put(path, real_path, 1, 0, seq);
+    return 1;
+  }
+  else if(!S_ISLNK(stbuf.st_mode))
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = readlink(meta_path, real_path, MAX_PATH - 1);
+
+  xmp_stats_meta(&start, res);
+
+  if(res == -1)
+    return -1;
+
+  real_path[res] = '\0';
+
+  index = xmp_mountindex(real_path);
+
+  if(mount) *mount = index;
+
+  xmp_cache_put(path, real_path, 0, index, seq);
+
+  xmp_locindex_put(path, real_path, &changes);
+
+  return xmp_mountdown(index) ? -2 : 0;
+}
+
+static int xmp_makerealdir(const char *path, int index, const char *real_prfx,
+  const char *meta_prfx, char *real_path, char *meta_path)
+{
+  int res;
+  size_t size;
+  struct stat st;
+  char *copy_ptr;
+  char *real_ptr;
+  char *meta_ptr;
+  char *curr_dir;
+  char *next_dir;
+  char copy_path[MAX_PATH + 1];
+
+  real_path[0] = '\0';
+  meta_path[0] = '\0';
+  copy_path[MAX_PATH] = '\0';
+
+  res = 0;
+
+  real_ptr = real_path + sprintf(real_path, "%s", real_prfx);
+  meta_ptr = meta_path + sprintf(meta_path, "%s", meta_prfx);
+
+  size = real_ptr - real_path;
+
+  /* a parent known to exist means all directories above it exist too */
+  strncpy(copy_path, path, MAX_PATH);
+  curr_dir = strrchr(copy_path, '/');
+  if(path[0] == '/' && curr_dir > copy_path &&
+     size + strlen(path) < MAX_PATH &&
+     meta_ptr - meta_path + strlen(path) < MAX_PATH)
+  {
+    *curr_dir = '\0';
+    if(xmp_dirindex_has(copy_path, index))
+    {
+      __sync_fetch_and_add(&dirindex.hits, 1);
+      strcpy(real_ptr, path);
+      strcpy(meta_ptr, path);
+      return 0;
+    }
+  }
+
+  strncpy(copy_path, path, MAX_PATH);
+  curr_dir = strtok_r(copy_path, "/", &copy_ptr);
+  while((next_dir = strtok_r(NULL, "/", &copy_ptr)))
+  {
+    if((real_ptr - real_path + next_dir - curr_dir + 2 > MAX_PATH) ||
+       (meta_ptr - meta_path + next_dir - curr_dir + 2 > MAX_PATH))
+    {
+      res = -1;
+      break;
+    }
+
+    real_ptr += sprintf(real_ptr, "/%s", curr_dir);
+    meta_ptr += sprintf(meta_ptr, "/%s", curr_dir);
+
+    curr_dir = next_dir;
+
+    if(xmp_dirindex_has(real_path + size, index)) continue;
+
+    res = access(real_path, F_OK);
+    __sync_fetch_and_add(&dirindex.probes, 1);
+    if(res == 0)
+    {
+      xmp_dirindex_mark(real_path + size, index, 1);
+      continue;
+    }
+
+    res = stat(meta_path, &st);
+    if(res == -1) break;
+
+    xmp_resetfsid();
+
+    res = mkdir(real_path, 0755);
+    if(res == -1) break;
+
+    res = chmod(real_path, st.st_mode|S_IWUSR);
+    if(res == -1) break;
+
+    res = lchown(real_path, st.st_uid, st.st_gid);
+    if(res == -1) break;
+
+    xmp_dirindex_mark(real_path + size, index, 1);
+  }
+
+  if((res == -1) ||
+     (real_ptr - real_path + strlen(curr_dir) > MAX_PATH) ||
+     (meta_ptr - meta_path + strlen(curr_dir) > MAX_PATH))
+  {
+    return -1;
+  }
+
+  real_ptr += sprintf(real_ptr, "/%s", curr_dir);
+  meta_ptr += sprintf(meta_ptr, "/%s", curr_dir);
+
+  return 0;
+}
+
+/* The following xmp_space_* functions expect space.lock to be held */
+
+static void xmp_space_state(int index, int state)
+{
+  struct xmp_space *e = &space.mounts[index];
+
+  if(e->state == state) return;
+
+  e->state = state;
+  ++e->transitions;
+
+  syslog(LOG_WARNING, "Data mount %s is %s\n", space.paths[index],
+    state == MOUNT_UP ? "up" : "down");
+}
+
+static void *xmp_space_probe(void *arg)
+{
+  int error;
+  struct statvfs st;
+  struct xmp_space *e;
+  struct xmp_probe *p = arg;
+
+  error = 0;
+
+  if(statvfs(p->path, &st) == -1) error = errno;
+
+  pthread_mutex_lock(&space.lock);
+
+  if(p->generation == space.generation)
+  {
+    e = &space.mounts[p->index];
+    e->busy = 0;
+    e->updated = time(NULL);
+    e->error = error;
+    if(error == 0) e->st = st;
+    xmp_space_state(p->index, error ? MOUNT_DOWN : MOUNT_UP);
+    pthread_cond_broadcast(&space.cond);
+  }
+
+  pthread_mutex_unlock(&space.lock);
+
+  free(p);
+
+  return NULL;
+}
+
+/*
+  Probes run in their own detached threads, so a hung NFS server
+  can only block its probe and never the monitor or FUSE workers.
+*/
+
+static void xmp_space_launch(int index)
+{
+  pthread_t thread;
+  struct xmp_probe *p;
+  struct xmp_space *e = &space.mounts[index];
+
+  p = malloc(sizeof(struct xmp_probe));
+  if(p == NULL) return;
+
+  p->index = index;
+  p->generation = space.generation;
+  snprintf(p->path, MAX_PATH, "%s", space.paths[index]);
+
+  e->busy = 1;
+  e->started = time(NULL);
+  ++e->probes;
+
+  if(pthread_create(&thread, NULL, xmp_space_probe, p) != 0)
+  {
+    e->busy = 0;
+    free(p);
+    return;
+  }
+
+  pthread_detach(thread);
+}
+
+static void xmp_space_reset(struct xmp_config *cfg)
+{
+  int i;
+
+  for(i = 1; i < space.nmounts; ++i)
+  {
+    free(space.paths[i]);
+    space.paths[i] = NULL;
+  }
+
+  space.generation = cfg->generation;
+  space.nmounts = cfg->nmounts;
+
+  for(i = 1; i < space.nmounts; ++i)
+  {
+    space.paths[i] = strdup(cfg->mounts[i]);
+    memset(&space.mounts[i], 0, sizeof(struct xmp_space));
+    space.mounts[i].error = EAGAIN;
+    space.mounts[i].state = MOUNT_UP;
+  }
+
+  for(i = 1; i < space.nmounts; ++i)
+  {
+    if(space.paths[i]) xmp_space_launch(i);
+  }
+}
+
+static void xmp_space_check(void)
+{
+  int i;
+  time_t now;
+  struct xmp_space *e;
+  struct xmp_config *cfg = xmp_config_enter();
+
+  now = time(NULL);
+
+  pthread_mutex_lock(&space.lock);
+
+  if(space.generation != cfg->generation) xmp_space_reset(cfg);
+
+  for(i = 1; i < space.nmounts; ++i)
+  {
+    e = &space.mounts[i];
+
+    if(e->busy)
+    {
+      if(now - e->started >= cfg->probetimeout && e->error != ETIMEDOUT)
+      {
+        ++e->timeouts;
+        e->error = ETIMEDOUT;
+        xmp_space_state(i, MOUNT_DOWN);
+      }
+    }
+    else if(now - e->updated >= cfg->refresh || e->state == MOUNT_DOWN)
+    {
+      if(space.paths[i]) xmp_space_launch(i);
+    }
+  }
+
+  pthread_mutex_unlock(&space.lock);
+
+  xmp_config_leave();
+}
+
+/*
+  Copies the free space table. After a configuration reload the table
+  is rebuilt and the caller waits at most the probe timeout
+  for the first probes to complete.
+*/
+
+static int xmp_space_get(struct xmp_space *table)
+{
+  int i, busy, nmounts;
+  struct timespec deadline;
+  struct xmp_config *cfg = xmp_config_enter();
+
+  pthread_mutex_lock(&space.lock);
+
+  if(space.generation != cfg->generation || space.nmounts == 0)
+  {
+    xmp_space_reset(cfg);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += cfg->probetimeout;
+
+    do
+    {
+      busy = 0;
+      for(i = 1; i < space.nmounts; ++i)
+      {
+        busy += space.mounts[i].busy;
+      }
+    }
+    while(busy && pthread_cond_timedwait(&space.cond, &space.lock, &deadline) == 0);
+  }
+
+  nmounts = space.nmounts;
+  memcpy(table, space.mounts, nmounts * sizeof(struct xmp_space));
+
+  pthread_mutex_unlock(&space.lock);
+
+  xmp_config_leave();
+
+  return nmounts;
+}
+
+static void xmp_space_dump(void)
+{
+  int i;
+  struct xmp_space *e;
+
+  pthread_mutex_lock(&space.lock);
+
+  for(i = 1; i < space.nmounts; ++i)
+  {
+    e = &space.mounts[i];
+    syslog(LOG_INFO, "Data mount %s: %s, probes %lu, timeouts %lu, "
+      "transitions %lu, placed %lu, writers %ld\n", space.paths[i],
+      e->state == MOUNT_UP ? "up" : "down", e->probes, e->timeouts,
+      e->transitions, placement.placed[i], placement.writers[i]);
+  }
+
+  pthread_mutex_unlock(&space.lock);
+}
+
+static void *xmp_space_monitor(void *arg)
+{
+  (void) arg;
+
+  while(1)
+  {
+    sleep(1);
+
+    if(placement.dump)
+    {
+      placement.dump = 0;
+      xmp_space_dump();
+    }
+
+    xmp_space_check();
+  }
+
+  return NULL;
+}
+
+static unsigned long long xmp_random(void)
+{
+  return ((unsigned long long) random() << 31) | random();
+}
+
+/*
+  Picks a data mount for a new file among the mounts listed in
+  spaces according to the configured placement policy.
+*/
+
+static int xmp_place(int *spaces, int n, struct xmp_space *table)
+{
+  int i, index;
+  long writers, least;
+  unsigned long long sum, pick;
+
+  switch(xmp_config_enter()->placement)
+  {
+    case PLACE_INFLIGHT:
+      index = __sync_fetch_and_add(&placement.cursor, 1) % n;
+      least = placement.writers[spaces[index]];
+      for(i = 1; i < n && least > 0; ++i)
+      {
+        writers = placement.writers[spaces[(index + i) % n]];
+        if(writers < least)
+        {
+          least = writers;
+          index = (index + i) % n;
+        }
+      }
+      break;
+
+    case PLACE_ROUNDROBIN:
+      index = __sync_fetch_and_add(&placement.cursor, 1) % n;
+      break;
+
+    default:
+      sum = 0;
+      for(i = 0; i < n; ++i)
+      {
+        sum += table[spaces[i]].st.f_bavail - MIN_FREE_BLOCKS;
+      }
+      pick = xmp_random() % sum;
+      for(index = 0; index < n - 1; ++index)
+      {
+        if(pick < table[spaces[index]].st.f_bavail - MIN_FREE_BLOCKS) break;
+        pick -= table[spaces[index]].st.f_bavail - MIN_FREE_BLOCKS;
+      }
+  }
+
+  xmp_config_leave();
+
+  return spaces[index];
+}
+
+/*
+  Free bytes of a data mount above MIN_FREE_BLOCKS that are not
+  promised to open files by fallocate reservations.
+*/
+
+static long long xmp_space_free(struct xmp_space *e, int index)
+{
+  long long avail;
+
+  if(e->error || e->state == MOUNT_DOWN || e->st.f_bavail <= MIN_FREE_BLOCKS) return 0;
+
+  avail = (long long) (e->st.f_bavail - MIN_FREE_BLOCKS) * e->st.f_frsize;
+  avail -= placement.reserved[index];
+
+  return avail > 0 ? avail : 0;
+}
+
+/*
+  Creates the directories for a new file on a data mount that can
+  hold size bytes, taking outstanding reservations into account.
+*/
+
+static int xmp_makepath(const char *path, char *real_path, char *meta_path,
+  off_t size, const unsigned char *exclude)
+{
+  int i, index, nmounts, res;
+  long long avail;
+  int spaces[MAX_STORAGE];
+  struct xmp_space table[MAX_STORAGE];
+  struct xmp_config *cfg = xmp_config_enter();
+
+  index = 0;
+
+  nmounts = xmp_space_get(table);
+
+  if(nmounts > cfg->nmounts) nmounts = cfg->nmounts;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    avail = xmp_space_free(&table[i], i);
+
+    /* the weighted policy shares out what is left after reservations */
+    if(table[i].st.f_frsize > 0)
+    {
+      table[i].st.f_bavail = MIN_FREE_BLOCKS + avail / table[i].st.f_frsize;
+    }
+
+    if((exclude == NULL || !MOUNT_TEST(exclude, i)) &&
+       avail > 0 && avail >= size && table[i].st.f_bavail > MIN_FREE_BLOCKS)
+    {
+      spaces[index] = i;
+      ++index;
+    }
+  }
+
+  if(index == 0)
+  {
+    xmp_config_leave();
+    return -1;
+  }
+
+  index = xmp_place(spaces, index, table);
+
+  __sync_fetch_and_add(&placement.placed[index], 1);
+
+  res = xmp_makerealdir(path, index, cfg->mounts[index], cfg->mounts[0],
+    real_path, meta_path);
+
+  xmp_config_leave();
+
+  return res;
+}
+
+/*
+  The reservation ledger counts bytes that open files announced with
+  fallocate but have not written yet, so parallel writers cannot be
+  promised the same free space on one mount.
+*/
+
+static int xmp_reserve(struct xmp_file *f, long long size)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&space.lock);
+
+  if(f->index < space.nmounts &&
+     xmp_space_free(&space.mounts[f->index], f->index) >= size)
+  {
+    __sync_fetch_and_add(&placement.reserved[f->index], size);
+    __sync_fetch_and_add(&f->reserved, size);
+    res = 1;
+  }
+
+  pthread_mutex_unlock(&space.lock);
+
+  return res;
+}
+
+/* Returns up to size bytes of the handle's reservation to the ledger */
+
+static void xmp_unreserve(struct xmp_file *f, long long size)
+{
+  long long left, take;
+
+  do
+  {
+    left = f->reserved;
+    if(left <= 0) return;
+    take = size < left ? size : left;
+  }
+  while(!__sync_bool_compare_and_swap(&f->reserved, left, left - take));
+
+  __sync_fetch_and_sub(&placement.reserved[f->index], take);
+}
+
+/*
+  Once the data mount has allocated a reserved range, the bytes move
+  from the ledger to the cached free space, where they stay until the
+  next probe sees the allocation.
+*/
+
+static void xmp_claim(struct xmp_file *f, long long size)
+{
+  unsigned long blocks;
+  struct xmp_space *e;
+
+  pthread_mutex_lock(&space.lock);
+
+  e = &space.mounts[f->index];
+
+  if(f->index < space.nmounts && e->st.f_frsize > 0)
+  {
+    blocks = (size + e->st.f_frsize - 1) / e->st.f_frsize;
+    e->st.f_bavail = e->st.f_bavail > blocks ? e->st.f_bavail - blocks : 0;
+  }
+
+  xmp_unreserve(f, size);
+
+  pthread_mutex_unlock(&space.lock);
+}
+
+/* Names of mirror copies, stripes and layout records are not listed */
+
+static int xmp_hidden_name(const char *name)
+{
+  return strncmp(name, MIRROR_PREFIX, sizeof(MIRROR_PREFIX) - 1) == 0 ||
+    strncmp(name, STRIPE_PREFIX, sizeof(STRIPE_PREFIX) - 1) == 0 ||
+    strncmp(name, LAYOUT_PREFIX, sizeof(LAYOUT_PREFIX) - 1) == 0;
+}
+
+/* Stripe 0 is what the meta symlink of a striped file leads to */
+
+static int xmp_striped(const char *real_path)
+{
+  const char *name = strrchr(real_path, '/');
+
+  return name != NULL &&
+    strncmp(name + 1, STRIPE_PREFIX "0.", sizeof(STRIPE_PREFIX) + 1) == 0;
+}
+
+/* Puts prefix in front of the last component of path */
+
+static int xmp_sibling_path(const char *path, const char *prefix, char *sibling_path)
+{
+  const char *name = strrchr(path, '/');
+
+  if(name == NULL || xmp_hidden_name(++name)) return -1;
+
+  if(strlen(name) + strlen(prefix) > NAME_MAX) return -1;
+
+  if(snprintf(sibling_path, MAX_PATH, "%.*s%s%s", (int) (name - path), path,
+     prefix, name) >= MAX_PATH) return -1;
+
+  return 0;
+}
+
+static int xmp_mirrored(const char *path)
+{
+  int i, res;
+  size_t size;
+  struct xmp_config *cfg = xmp_config_enter();
+
+  res = 0;
+
+  for(i = 0; i < cfg->nmirrors && !res; ++i)
+  {
+    size = strlen(cfg->mirrors[i]);
+    res = strncmp(path, cfg->mirrors[i], size) == 0 &&
+      (path[size] == '/' || path[size] == '\0' || cfg->mirrors[i][size - 1] == '/');
+  }
+
+  xmp_config_leave();
+
+  return res;
+}
+
+static int xmp_mirror_path(const char *path, char *mirror_path)
+{
+  return xmp_sibling_path(path, MIRROR_PREFIX, mirror_path);
+}
+
+/*
+  Removes the copy of path. The meta symlink goes first, so no new
+  open can pick the copy while its data file is being removed.
+*/
+
+static void xmp_mirror_drop(const char *path)
+{
+  int res;
+  char mirror_path[MAX_PATH];
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_mirror_path(path, mirror_path) == -1) return;
+
+  res = xmp_realpath(mirror_path, real_path, meta_path, NULL);
+
+  if(res == -1 || res == 1) return;
+
+  xmp_resetfsid();
+
+  if(unlink(meta_path) == 0) __sync_fetch_and_add(&mirrors.dropped, 1);
+
+  xmp_cache_invalidate(mirror_path);
+
+  if(real_path[0] != '\0') unlink(real_path);
+}
+
+/*
+  Sends a read-only open to the copy when the mount of the original
+  is down or has more requests in flight and queued than the mount
+  of the copy. Equally loaded mounts are picked at random.
+*/
+
+static int xmp_mirror_pick(const char *path, char *real_path, int *index, int res)
+{
+  int mirror;
+  int load;
+  char mirror_path[MAX_PATH];
+  char mirror_real[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_mirror_path(path, mirror_path) == -1) return res;
+
+  if(xmp_realpath(mirror_path, mirror_real, meta_path, &mirror) != 0 ||
+     mirror <= 0) return res;
+
+  if(res == 0)
+  {
+    load = xmp_io_load(mirror) - xmp_io_load(*index);
+    if(load > 0 || (load == 0 && (xmp_random() & 1))) return res;
+  }
+
+  strcpy(real_path, mirror_real);
+  *index = mirror;
+
+  __sync_fetch_and_add(&mirrors.reads, 1);
+
+  return 0;
+}
+
+/* Copies size bytes through the I/O scheduler, returns the bytes copied */
+
+static off_t xmp_copy_data(int src, int dst, int from, int to, uid_t uid,
+  off_t size)
+{
+  char *buf;
+  ssize_t res;
+  off_t offset;
+
+  buf = malloc(COPY_BUFFER);
+  if(buf == NULL) return 0;
+
+  for(offset = 0, res = 0; offset < size; offset += res)
+  {
+    xmp_io_begin(from, uid);
+    res = pread(src, buf, COPY_BUFFER, offset);
+    xmp_io_end(from);
+
+    if(res <= 0) break;
+
+    xmp_io_begin(to, uid);
+    res = pwrite(dst, buf, res, offset);
+    xmp_io_end(to);
+
+    if(res <= 0) break;
+  }
+
+  free(buf);
+
+  return offset;
+}
+
+/*
+  Copies a closed file to another mount and publishes the copy with
+  its meta symlink. The copy is dropped if the original changed
+  while it was read, the next release queues a new one. An unlink or
+  rename of the original removes its meta symlink before it drops
+  the copy, so the copy checks the original after it is published
+  and takes itself back if the original is gone.
+*/
+
+static void xmp_mirror_copy(void *arg)
+{
+  int res;
+  int src, dst;
+  int index, mirror;
+  ssize_t size;
+  char value[16];
+  struct stat st;
+  struct stat end;
+  struct timespec ts[2];
+  struct xmp_mirror *m = arg;
+  char mirror_path[MAX_PATH];
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+  char mirror_real[MAX_PATH];
+  char mirror_meta[MAX_PATH];
+  unsigned char exclude[MOUNT_MASK];
+
+  res = -1;
+  src = -1;
+  dst = -1;
+  mirror_real[0] = '\0';
+
+  if(xmp_mirror_path(m->path, mirror_path) == -1) goto out;
+
+  if(xmp_realpath(m->path, real_path, meta_path, &index) != 0 || index <= 0 ||
+     xmp_striped(real_path)) goto out;
+
+  memset(exclude, 0, MOUNT_MASK);
+  MOUNT_SET(exclude, index);
+
+  xmp_mirror_drop(m->path);
+
+  src = open(real_path, O_RDONLY);
+  if(src == -1 || fstat(src, &st) == -1 || !S_ISREG(st.st_mode)) goto out;
+
+  if(xmp_makepath(mirror_path, mirror_real, mirror_meta, st.st_size, exclude) == -1)
+  {
+    mirror_real[0] = '\0';
+    goto out;
+  }
+
+  mirror = xmp_mountindex(mirror_real);
+
+  dst = open(mirror_real, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if(dst == -1) goto out;
+
+  size = xmp_copy_data(src, dst, index, mirror, st.st_uid, st.st_size);
+
+  __sync_fetch_and_add(&mirrors.bytes, size);
+
+  if(size != st.st_size) goto out;
+
+  size = fgetxattr(src, ADLER_XATTR, value, sizeof(value));
+  if(size > 0) fsetxattr(dst, ADLER_XATTR, value, size, 0);
+
+  ts[0] = st.st_atim;
+  ts[1] = st.st_mtim;
+
+  if(fchown(dst, st.st_uid, st.st_gid) == -1 ||
+     fchmod(dst, st.st_mode & 07777) == -1 ||
+     futimens(dst, ts) == -1 || fsync(dst) == -1) goto out;
+
+  if(fstat(src, &end) == -1 || end.st_size != st.st_size ||
+     end.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+     end.st_mtim.tv_nsec != st.st_mtim.tv_nsec ||
+     end.st_ctim.tv_sec != st.st_ctim.tv_sec ||
+     end.st_ctim.tv_nsec != st.st_ctim.tv_nsec) goto out;
+
+  res = symlink(mirror_real, mirror_meta);
+
+  if(res == 0 && (stat(meta_path, &end) == -1 ||
+     end.st_dev != st.st_dev || end.st_ino != st.st_ino))
+  {
+    unlink(mirror_meta);
+    res = -1;
+  }
+
+  xmp_cache_invalidate(mirror_path);
+
+out:
+  if(src != -1) close(src);
+  if(dst != -1) close(dst);
+
+  if(res == -1 && mirror_real[0] != '\0') unlink(mirror_real);
+
+  if(res == 0) __sync_fetch_and_add(&mirrors.copies, 1);
+  else if(mirror_real[0] != '\0') __sync_fetch_and_add(&mirrors.failed, 1);
+
+  free(m);
+}
+
+static void xmp_mirror_queue(const char *path)
+{
+  struct xmp_mirror *m;
+
+  if(!xmp_mirrored(path) || strlen(path) >= MAX_PATH) return;
+
+  m = malloc(sizeof(struct xmp_mirror));
+  if(m == NULL) return;
+
+  strcpy(m->path, path);
+
+  xmp_pool_submit(&mirrors.pool, xmp_mirror_copy, m);
+}
+
+static void xmp_local_init(void)
+{
+  int i;
+  DIR *dp;
+  struct dirent *entry;
+  char name[MAX_PATH];
+
+  for(i = 0; i < CACHE_LOCKS; ++i)
+  {
+    pthread_mutex_init(&localcache.locks[i], NULL);
+  }
+
+  pthread_mutex_init(&localcache.evict, NULL);
+
+  if(storage->localcache == NULL || storage->localcacheentries <= 0) return;
+
+  if(mkdir(storage->localcache, 0700) == -1 && errno != EEXIST)
+  {
+    syslog(LOG_WARNING, "Cannot create local cache %s: %s, caching disabled\n",
+      storage->localcache, strerror(errno));
+    return;
+  }
+
+  /* copies left by an earlier run are not in the table */
+  dp = opendir(storage->localcache);
+  if(dp != NULL)
+  {
+    while((entry = readdir(dp)))
+    {
+      if(strncmp(entry->d_name, "slot.", 5) != 0) continue;
+      snprintf(name, MAX_PATH, "%s/%s", storage->localcache, entry->d_name);
+      unlink(name);
+    }
+    closedir(dp);
+  }
+
+  localcache.entries = calloc(storage->localcacheentries, sizeof(struct xmp_lentry));
+  if(localcache.entries == NULL)
+  {
+    syslog(LOG_WARNING, "Cannot allocate local cache table, caching disabled\n");
+    return;
+  }
+
+  localcache.dir = strdup(storage->localcache);
+  localcache.size = storage->localcacheentries;
+}
+
+/* Removes the copy of an entry, the caller holds the slot lock */
+
+static void xmp_local_clear(unsigned int slot)
+{
+  char name[MAX_PATH];
+  struct xmp_lentry *e = &localcache.entries[slot];
+
+  if(e->state == LOCAL_READY)
+  {
+    snprintf(name, MAX_PATH, "%s/slot.%u", localcache.dir, slot);
+    unlink(name);
+    __sync_fetch_and_sub(&localcache.used, e->size);
+  }
+
+  e->state = LOCAL_NONE;
+}
+
+/*
+  Evicts copies until size more bytes fit below the capacity. The
+  copy with the fewest opens goes first, the least recently used one
+  among equals. Counts are halved on every call, so files that were
+  hot long ago age out.
+*/
+
+static int xmp_local_evict(off_t size, size_t capacity)
+{
+  unsigned int i;
+  unsigned int victim;
+  unsigned int count;
+  time_t used;
+  int aged;
+  struct xmp_lentry *e;
+
+  pthread_mutex_lock(&localcache.evict);
+
+  for(aged = 0; localcache.used + size > capacity; aged = 1)
+  {
+    victim = localcache.size;
+    count = 0;
+    used = 0;
+
+    for(i = 0; i < localcache.size; ++i)
+    {
+      e = &localcache.entries[i];
+      pthread_mutex_lock(&localcache.locks[i % CACHE_LOCKS]);
+      if(!aged) e->count /= 2;
+      if(e->state == LOCAL_READY &&
+         (victim == localcache.size || e->count < count ||
+          (e->count == count && e->used < used)))
+      {
+        victim = i;
+        count = e->count;
+        used = e->used;
+      }
+      pthread_mutex_unlock(&localcache.locks[i % CACHE_LOCKS]);
+    }
+
+    if(victim == localcache.size) break;
+
+    pthread_mutex_lock(&localcache.locks[victim % CACHE_LOCKS]);
+    if(localcache.entries[victim].state == LOCAL_READY)
+    {
+      xmp_local_clear(victim);
+      __sync_fetch_and_add(&localcache.evictions, 1);
+    }
+    pthread_mutex_unlock(&localcache.locks[victim % CACHE_LOCKS]);
+  }
+
+  pthread_mutex_unlock(&localcache.evict);
+
+  return localcache.used + size <= capacity;
+}
+
+static void xmp_local_copy(void *arg)
+{
+  int res;
+  int src, dst;
+  int index;
+  off_t size;
+  size_t capacity;
+  struct stat st;
+  struct stat end;
+  struct xmp_lentry *e;
+  struct xmp_lcopy *c = arg;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+  char name[MAX_PATH];
+  char temp[MAX_PATH];
+
+  res = -1;
+  src = -1;
+  dst = -1;
+  size = 0;
+  temp[0] = '\0';
+
+  capacity = xmp_config_enter()->localcachesize;
+  xmp_config_leave();
+
+  xmp_resetfsid();
+
+  if(xmp_realpath(c->path, real_path, meta_path, &index) != 0 || index <= 0) goto out;
+
+  src = open(real_path, O_RDONLY);
+  if(src == -1 || fstat(src, &st) == -1 || !S_ISREG(st.st_mode)) goto out;
+
+  if(!xmp_local_evict(st.st_size, capacity)) goto out;
+
+  size = st.st_size;
+  __sync_fetch_and_add(&localcache.used, size);
+
+  snprintf(temp, MAX_PATH, "%s/slot.%u.%lu", localcache.dir, c->slot,
+    __sync_fetch_and_add(&localcache.seq, 1));
+
+  dst = open(temp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if(dst == -1) goto out;
+
+  if(xmp_copy_data(src, dst, index, 0, st.st_uid, size) != size) goto out;
+
+  __sync_fetch_and_add(&localcache.bytes, size);
+
+  if(fstat(src, &end) == -1 || end.st_size != st.st_size ||
+     end.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+     end.st_mtim.tv_nsec != st.st_mtim.tv_nsec) goto out;
+
+  snprintf(name, MAX_PATH, "%s/slot.%u", localcache.dir, c->slot);
+
+  /* the entry may have been dropped or reused while the copy ran */
+  e = &localcache.entries[c->slot];
+  pthread_mutex_lock(&localcache.locks[c->slot % CACHE_LOCKS]);
+  if(e->state == LOCAL_COPYING && strcmp(e->path, c->path) == 0 &&
+     rename(temp, name) == 0)
+  {
+    e->state = LOCAL_READY;
+    e->size = size;
+    e->mtime = st.st_mtim;
+    res = 0;
+  }
+  pthread_mutex_unlock(&localcache.locks[c->slot % CACHE_LOCKS]);
+
+out:
+  if(src != -1) close(src);
+  if(dst != -1) close(dst);
+
+  if(res == 0)
+  {
+    __sync_fetch_and_add(&localcache.copies, 1);
+  }
+  else
+  {
+    if(temp[0] != '\0') unlink(temp);
+    __sync_fetch_and_sub(&localcache.used, size);
+    __sync_fetch_and_add(&localcache.failed, 1);
+
+    pthread_mutex_lock(&localcache.locks[c->slot % CACHE_LOCKS]);
+    e = &localcache.entries[c->slot];
+    if(e->state == LOCAL_COPYING && strcmp(e->path, c->path) == 0)
+    {
+      e->state = LOCAL_NONE;
+      e->count = 0;
+    }
+    pthread_mutex_unlock(&localcache.locks[c->slot % CACHE_LOCKS]);
+  }
+
+  free(c);
+}
+
+/*
+  Counts a read-only open of path, fd is the real file. Returns a
+  descriptor of the local copy if it is still valid, -1 otherwise.
+*/
+
+static int xmp_local_open(const char *path, int fd)
+{
+  int res;
+  int hits;
+  unsigned int slot;
+  struct stat st;
+  struct xmp_lentry *e;
+  struct xmp_lcopy *c;
+  char name[MAX_PATH];
+
+  if(localcache.size == 0 || strlen(path) >= MAX_PATH) return -1;
+
+  hits = xmp_config_enter()->localcachehits;
+  xmp_config_leave();
+
+  res = -1;
+  c = NULL;
+  slot = xmp_hash(path) % localcache.size;
+  e = &localcache.entries[slot];
+
+  pthread_mutex_lock(&localcache.locks[slot % CACHE_LOCKS]);
+
+  if(strcmp(e->path, path) != 0)
+  {
+    /* a running copy keeps its slot */
+    if(e->state == LOCAL_COPYING)
+    {
+      pthread_mutex_unlock(&localcache.locks[slot % CACHE_LOCKS]);
+      __sync_fetch_and_add(&localcache.misses, 1);
+      return -1;
+    }
+
+    xmp_local_clear(slot);
+    strcpy(e->path, path);
+    e->count = 0;
+  }
+
+  ++e->count;
+  e->used = time(NULL);
+
+  if(e->state == LOCAL_READY)
+  {
+    if(fstat(fd, &st) == 0 && st.st_size == e->size &&
+       st.st_mtim.tv_sec == e->mtime.tv_sec &&
+       st.st_mtim.tv_nsec == e->mtime.tv_nsec)
+    {
+      snprintf(name, MAX_PATH, "%s/slot.%u", localcache.dir, slot);
+      xmp_resetfsid();
+      res = open(name, O_RDONLY);
+    }
+    else
+    {
+      __sync_fetch_and_add(&localcache.stale, 1);
+    }
+
+    if(res == -1) xmp_local_clear(slot);
+  }
+
+  if(res == -1 && e->state == LOCAL_NONE && e->count >= hits)
+  {
+    c = malloc(sizeof(struct xmp_lcopy));
+    if(c != NULL)
+    {
+      strcpy(c->path, path);
+      c->slot = slot;
+      e->state = LOCAL_COPYING;
+    }
+  }
+
+  pthread_mutex_unlock(&localcache.locks[slot % CACHE_LOCKS]);
+
+  /* without workers the copy runs here and takes the slot lock */
+  if(c != NULL) xmp_pool_submit(&localcache.pool, xmp_local_copy, c);
+
+  if(res == -1) __sync_fetch_and_add(&localcache.misses, 1);
+  else __sync_fetch_and_add(&localcache.hits, 1);
+
+  return res;
+}
+
+static void xmp_local_drop(const char *path)
+{
+  unsigned int slot;
+  struct xmp_lentry *e;
+
+  if(localcache.size == 0) return;
+
+  slot = xmp_hash(path) % localcache.size;
+  e = &localcache.entries[slot];
+
+  pthread_mutex_lock(&localcache.locks[slot % CACHE_LOCKS]);
+  if(strcmp(e->path, path) == 0)
+  {
+    xmp_local_clear(slot);
+    e->path[0] = '\0';
+    e->count = 0;
+  }
+  pthread_mutex_unlock(&localcache.locks[slot % CACHE_LOCKS]);
+}
+
+static int xmp_stripe_path(const char *path, int i, char *stripe_path)
+{
+  char prefix[32];
+
+  snprintf(prefix, sizeof(prefix), "%s%d.", STRIPE_PREFIX, i);
+
+  return xmp_sibling_path(path, prefix, stripe_path);
+}
+
+static int xmp_layout_read(const char *path, struct xmp_layout *l)
+{
+  int i, res;
+  FILE *fp;
+  char *end;
+  struct timespec start;
+  char layout_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_sibling_path(path, LAYOUT_PREFIX, layout_path) == -1 ||
+     xmp_metapath(layout_path, meta_path) == -1) return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  fp = fopen(meta_path, "r");
+
+  xmp_stats_meta(&start, fp ? 0 : -1);
+
+  if(fp == NULL) return -1;
+
+  res = fscanf(fp, "%zu %d\n", &l->stripe, &l->count) == 2 &&
+    l->stripe > 0 && l->count > 0 && l->count <= MAX_STRIPES ? 0 : -1;
+
+  for(i = 0; res == 0 && i < l->count; ++i)
+  {
+    if(fgets(l->paths[i], MAX_PATH, fp) == NULL)
+    {
+      res = -1;
+      break;
+    }
+
+    end = strchr(l->paths[i], '\n');
+    if(end) *end = '\0';
+
+    l->fds[i] = -1;
+    l->index[i] = xmp_mountindex(l->paths[i]);
+    if(l->index[i] <= 0) res = -1;
+  }
+
+  fclose(fp);
+
+  if(res == -1)
+  {
+    syslog(LOG_ERR, "Bad layout record %s\n", meta_path);
+    errno = EIO;
+  }
+
+  return res;
+}
+
+/* The record is replaced with a rename, so readers see the old or the new one */
+
+static int xmp_layout_write(const char *path, const struct xmp_layout *l)
+{
+  int i, res;
+  FILE *fp;
+  char layout_path[MAX_PATH];
+  char temp_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+  char meta_temp[MAX_PATH];
+
+  if(xmp_sibling_path(path, LAYOUT_PREFIX, layout_path) == -1 ||
+     xmp_sibling_path(path, STRIPE_PREFIX "layout.", temp_path) == -1)
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if(xmp_metapath(layout_path, meta_path) == -1 ||
+     xmp_metapath(temp_path, meta_temp) == -1) return -1;
+
+  fp = fopen(meta_temp, "w");
+  if(fp == NULL) return -1;
+
+  fprintf(fp, "%zu %d\n", l->stripe, l->count);
+
+  for(i = 0; i < l->count; ++i)
+  {
+    fprintf(fp, "%s\n", l->paths[i]);
+  }
+
+  res = fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+
+  if(fclose(fp) != 0) res = -1;
+
+  if(res == 0) res = rename(meta_temp, meta_path);
+
+  if(res == -1) unlink(meta_temp);
+
+  return res;
+}
+
+/* Removes the stripe files and the layout record of path */
+
+static void xmp_layout_unlink(const char *path)
+{
+  int i;
+  struct xmp_layout l;
+  char layout_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_layout_read(path, &l) == 0)
+  {
+    for(i = 0; i < l.count; ++i)
+    {
+      unlink(l.paths[i]);
+    }
+  }
+
+  if(xmp_sibling_path(path, LAYOUT_PREFIX, layout_path) == -1 ||
+     xmp_metapath(layout_path, meta_path) == -1) return;
+
+  unlink(meta_path);
+}
+
+/* Length of stripe i in a file of size bytes */
+
+static off_t xmp_stripe_length(const struct xmp_layout *l, int i, off_t size)
+{
+  off_t chunks = size / l->stripe;
+  off_t rest = size % l->stripe;
+  off_t length;
+
+  length = (chunks / l->count + (i < chunks % l->count)) * l->stripe;
+
+  if(rest > 0 && i == chunks % l->count) length += rest;
+
+  return length;
+}
+
+/* End of the file data held by stripe i when it is length bytes long */
+
+static off_t xmp_stripe_end(const struct xmp_layout *l, int i, off_t length)
+{
+  off_t chunk;
+
+  if(length <= 0) return 0;
+
+  chunk = (length - 1) / l->stripe;
+
+  return (chunk * l->count + i) * l->stripe + (length - 1) % l->stripe + 1;
+}
+
+/* Turns the stat of stripe 0 into the stat of the whole file */
+
+static int xmp_layout_stat(const char *path, const struct xmp_layout *h,
+  struct stat *stbuf)
+{
+  int i, res;
+  off_t end;
+  blkcnt_t blocks;
+  struct stat st;
+  struct xmp_layout l;
+
+  if(h == NULL && xmp_layout_read(path, &l) == -1) return -1;
+
+  if(h == NULL) h = &l;
+
+  stbuf->st_size = xmp_stripe_end(h, 0, stbuf->st_size);
+  blocks = stbuf->st_blocks;
+
+  for(i = 1; i < h->count; ++i)
+  {
+    res = h->fds[i] != -1 ? fstat(h->fds[i], &st) : lstat(h->paths[i], &st);
+    if(res == -1) return -1;
+
+    end = xmp_stripe_end(h, i, st.st_size);
+    if(end > stbuf->st_size) stbuf->st_size = end;
+    blocks += st.st_blocks;
+  }
+
+  stbuf->st_blocks = blocks;
+
+  return 0;
+}
+
+static int xmp_lstat(const char *path, const char *real_path, struct stat *stbuf)
+{
+  if(lstat(real_path, stbuf) == -1) return -1;
+
+  return xmp_striped(real_path) ? xmp_layout_stat(path, NULL, stbuf) : 0;
+}
+
+static int xmp_layout_truncate(const struct xmp_layout *l, off_t size)
+{
+  int i, res;
+  off_t length;
+
+  for(i = 0, res = 0; i < l->count && res == 0; ++i)
+  {
+    length = xmp_stripe_length(l, i, size);
+    res = l->fds[i] != -1 ? ftruncate(l->fds[i], length) : truncate(l->paths[i], length);
+  }
+
+  return res;
+}
+
+/*
+  Opens the other stripes of a file whose stripe 0 is open as fd.
+  The open of stripe 0 has checked the permissions, and appends are
+  turned into writes at the offset the kernel passes.
+*/
+
+static struct xmp_layout *xmp_layout_open(const char *path, int fd, int flags)
+{
+  int i;
+  struct xmp_layout *l;
+
+  l = malloc(sizeof(struct xmp_layout));
+  if(l == NULL) return NULL;
+
+  if(xmp_layout_read(path, l) == -1)
+  {
+    free(l);
+    return NULL;
+  }
+
+  l->fds[0] = fd;
+
+  flags &= ~(O_CREAT | O_EXCL | O_APPEND);
+
+  xmp_resetfsid();
+
+  for(i = 1; i < l->count; ++i)
+  {
+    l->fds[i] = open(l->paths[i], flags);
+    if(l->fds[i] == -1)
+    {
+      while(--i > 0) close(l->fds[i]);
+      free(l);
+      return NULL;
+    }
+  }
+
+  return l;
+}
+
+static void xmp_layout_close(struct xmp_layout *l)
+{
+  int i;
+
+  for(i = 1; i < l->count; ++i)
+  {
+    close(l->fds[i]);
+  }
+
+  free(l);
+}
+
+static void xmp_stripe_done(struct xmp_uop *op)
+{
+  struct xmp_piece *p = op->arg;
+
+  p->res = op->res;
+
+  xmp_batch_done(p->batch);
+}
+
+/*
+  With the ring all pieces of a request are queued from the calling
+  thread and the stripe pool stays idle.
+*/
+
+static void xmp_stripe_submit(struct xmp_piece *p)
+{
+  struct xmp_layout *l = p->file->layout;
+
+  if(xmp_mountdown(l->index[p->stripe]))
+  {
+    p->res = -EIO;
+    xmp_batch_done(p->batch);
+    return;
+  }
+
+  p->op.fd = l->fds[p->stripe];
+  p->op.index = l->index[p->stripe];
+  p->op.uid = p->file->uid;
+  p->op.write = p->write;
+  p->op.buf = p->buf;
+  p->op.size = p->size;
+  p->op.offset = p->offset;
+  p->op.done = xmp_stripe_done;
+  p->op.arg = p;
+
+  xmp_uring_submit(&p->op);
+}
+
+static void xmp_stripe_piece(void *arg)
+{
+  int index;
+  struct timespec start;
+  struct xmp_piece *p = arg;
+  struct xmp_layout *l = p->file->layout;
+
+  index = l->index[p->stripe];
+
+  if(xmp_mountdown(index))
+  {
+    p->res = -EIO;
+  }
+  else
+  {
+    xmp_io_begin(index, p->file->uid);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(p->write) p->res = pwrite(l->fds[p->stripe], p->buf, p->size, p->offset);
+    else p->res = pread(l->fds[p->stripe], p->buf, p->size, p->offset);
+
+    xmp_stats_data(index, &start, p->res);
+
+    xmp_io_end(index);
+
+    if(p->res == -1) p->res = -errno;
+  }
+
+  if(p->batch) xmp_batch_done(p->batch);
+}
+
+/*
+  Splits a request into one piece per chunk. Pieces on other stripes
+  run in parallel on the stripe pool or the ring. Reads fill the holes of short
+  stripes with zeros up to the size of the file.
+*/
+
+static int xmp_stripe_io(struct xmp_file *f, char *buf, size_t size,
+  off_t offset, int write)
+{
+  int i, n;
+  int ring;
+  int error;
+  off_t pos;
+  off_t chunk;
+  size_t done;
+  size_t total;
+  struct stat st;
+  struct xmp_piece *p;
+  struct xmp_batch batch;
+  struct xmp_layout *l = f->layout;
+
+  if(size == 0) return 0;
+
+  n = (offset % l->stripe + size + l->stripe - 1) / l->stripe;
+
+  ring = uring.entries > 0;
+
+  p = malloc(n * sizeof(struct xmp_piece));
+  if(p == NULL) return -ENOMEM;
+
+  for(i = 0, done = 0; i < n; done += p[i].size, ++i)
+  {
+    pos = offset + done;
+    chunk = pos / l->stripe;
+    p[i].file = f;
+    p[i].buf = buf + done;
+    p[i].size = l->stripe - pos % l->stripe;
+    if(p[i].size > size - done) p[i].size = size - done;
+    p[i].offset = (chunk / l->count) * l->stripe + pos % l->stripe;
+    p[i].stripe = chunk % l->count;
+    p[i].write = write;
+    p[i].res = 0;
+    p[i].batch = n > 1 || ring ? &batch : NULL;
+  }
+
+  if(n > 1) __sync_fetch_and_add(&stripes.split, 1);
+
+  if(n > 1 || ring)
+  {
+    batch.pending = n;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+  }
+
+  if(ring)
+  {
+    for(i = 0; i < n; ++i) xmp_stripe_submit(&p[i]);
+  }
+  else
+  {
+    for(i = 1; i < n; ++i)
+    {
+      xmp_pool_submit(&stripes.pool, xmp_stripe_piece, &p[i]);
+    }
+
+    xmp_stripe_piece(&p[0]);
+  }
+
+  if(n > 1 || ring)
+  {
+    pthread_mutex_lock(&batch.lock);
+    while(batch.pending > 0)
+    {
+      pthread_cond_wait(&batch.cond, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.cond);
+  }
+
+  error = 0;
+  total = 0;
+
+  for(i = 0, done = 0; i < n; done += p[i].size, ++i)
+  {
+    if(p[i].res < 0)
+    {
+      error = p[i].res;
+      break;
+    }
+
+    if(write)
+    {
+      total = done + p[i].res;
+      if(p[i].res < p[i].size) break;
+    }
+    else
+    {
+      if(p[i].res < p[i].size) memset(p[i].buf + p[i].res, 0, p[i].size - p[i].res);
+      if(p[i].res > 0) total = done + p[i].res;
+    }
+  }
+
+  /* a hole at the end of the request may still be inside the file */
+  if(!write && error == 0 && total < size && fstat(l->fds[0], &st) == 0 &&
+     xmp_layout_stat(NULL, l, &st) == 0 && st.st_size > offset + (off_t) total)
+  {
+    total = st.st_size - offset < size ? st.st_size - offset : size;
+  }
+
+  free(p);
+
+  if(total == 0 && error < 0) return error;
+
+  __sync_fetch_and_add(&stripes.bytes, total);
+
+  return total;
+}
+
+/*
+  Rewrites a file into stripes. The layout record is written before
+  the meta symlink is switched to stripe 0, and the original is only
+  removed afterwards, so a crash leaves either the plain file or the
+  striped one. The stripes are dropped if the file changed while it
+  was copied or has handles on this node at the switch, the next
+  release queues it again. Other nodes may still open the original
+  from their path caches, so it is handed to xmp_stripe_reaper and
+  kept until those have expired.
+*/
+
+static void xmp_stripe_convert(void *arg)
+{
+  int i, n;
+  int res;
+  int src;
+  int index;
+  int delay;
+  off_t pos;
+  off_t chunk;
+  size_t part;
+  ssize_t size;
+  char *buf;
+  char value[16];
+  struct stat st;
+  struct stat end;
+  struct timespec ts[2];
+  struct xmp_layout l;
+  struct xmp_ofile *o;
+  struct xmp_config *cfg;
+  struct xmp_stripedrop *d;
+  struct xmp_stripejob *j = arg;
+  unsigned char used[MOUNT_MASK];
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+  char stripe_path[MAX_PATH];
+  char stripe_meta[MAX_PATH];
+  char temp_path[MAX_PATH];
+
+  res = -1;
+  src = -1;
+  buf = NULL;
+  d = NULL;
+  o = NULL;
+  l.count = 0;
+
+  cfg = xmp_config_enter();
+  l.stripe = cfg->stripesize;
+  n = cfg->stripecount < MAX_STRIPES ? cfg->stripecount : MAX_STRIPES;
+  delay = cfg->cachettl;
+  if(cfg->locindex && cfg->locindexttl > delay) delay = cfg->locindexttl;
+  xmp_config_leave();
+
+  xmp_resetfsid();
+
+  if(l.stripe == 0 || n < 2) goto out;
+
+  if(xmp_realpath(j->path, real_path, meta_path, &index) != 0 || index <= 0 ||
+     xmp_striped(real_path)) goto out;
+
+  src = open(real_path, O_RDONLY);
+  if(src == -1 || fstat(src, &st) == -1 || !S_ISREG(st.st_mode)) goto out;
+
+  memset(used, 0, MOUNT_MASK);
+
+  for(i = 0; i < n; ++i)
+  {
+    if(xmp_stripe_path(j->path, i, stripe_path) == -1 ||
+       xmp_makepath(stripe_path, l.paths[i], stripe_meta,
+         st.st_size / n + l.stripe, used) == -1) break;
+
+    l.index[i] = xmp_mountindex(l.paths[i]);
+    l.fds[i] = open(l.paths[i], O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if(l.index[i] <= 0 || l.fds[i] == -1) break;
+
+    MOUNT_SET(used, l.index[i]);
+    ++l.count;
+  }
+
+  if(l.count < n) goto out;
+
+  buf = malloc(COPY_BUFFER);
+  d = malloc(sizeof(struct xmp_stripedrop));
+  if(buf == NULL || d == NULL) goto out;
+
+  for(pos = 0; pos < st.st_size; pos += size)
+  {
+    chunk = pos / l.stripe;
+    part = l.stripe - pos % l.stripe;
+    if(part > COPY_BUFFER) part = COPY_BUFFER;
+
+    xmp_io_begin(index, st.st_uid);
+    size = pread(src, buf, part, pos);
+    xmp_io_end(index);
+
+    if(size <= 0) break;
+
+    i = chunk % l.count;
+
+    xmp_io_begin(l.index[i], st.st_uid);
+    size = pwrite(l.fds[i], buf, size, (chunk / l.count) * l.stripe + pos % l.stripe);
+    xmp_io_end(l.index[i]);
+
+    if(size <= 0) break;
+  }
+
+  if(pos < st.st_size) goto out;
+
+  size = fgetxattr(src, ADLER_XATTR, value, sizeof(value));
+  if(size > 0) fsetxattr(l.fds[0], ADLER_XATTR, value, size, 0);
+
+  ts[0] = st.st_atim;
+  ts[1] = st.st_mtim;
+
+  for(i = 0; i < l.count; ++i)
+  {
+    if(fchown(l.fds[i], st.st_uid, st.st_gid) == -1 ||
+       fchmod(l.fds[i], st.st_mode & 07777) == -1 ||
+       futimens(l.fds[i], ts) == -1 || fsync(l.fds[i]) == -1) goto out;
+  }
+
+  o = xmp_ofile_hold(j->path);
+  if(o == NULL) goto out;
+
+  if(fstat(src, &end) == -1 || end.st_size != st.st_size ||
+     end.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+     end.st_mtim.tv_nsec != st.st_mtim.tv_nsec ||
+     end.st_ctim.tv_sec != st.st_ctim.tv_sec ||
+     end.st_ctim.tv_nsec != st.st_ctim.tv_nsec) goto out;
+
+  if(xmp_layout_write(j->path, &l) == -1) goto out;
+
+  if(xmp_sibling_path(j->path, STRIPE_PREFIX "new.", stripe_path) == -1 ||
+     xmp_metapath(stripe_path, temp_path) == -1) goto out;
+
+  res = symlink(l.paths[0], temp_path);
+  if(res == 0)
+  {
+    lchown(temp_path, st.st_uid, st.st_gid);
+    res = rename(temp_path, meta_path);
+    if(res == -1) unlink(temp_path);
+  }
+
+  xmp_cache_invalidate(j->path);
+
+  xmp_ofile_unhold(o);
+  o = NULL;
+
+  if(res == 0)
+  {
+    strcpy(d->path, j->path);
+    strcpy(d->real_path, real_path);
+    d->size = st.st_size;
+    d->mtime = st.st_mtim;
+    d->due = time(NULL) + delay + 1;
+
+    pthread_mutex_lock(&stripes.lock);
+    d->next = stripes.drops;
+    stripes.drops = d;
+    pthread_mutex_unlock(&stripes.lock);
+
+    d = NULL;
+  }
+
+out:
+  if(o) xmp_ofile_unhold(o);
+
+  if(src != -1) close(src);
+
+  for(i = 0; i < l.count; ++i)
+  {
+    close(l.fds[i]);
+    if(res == -1) unlink(l.paths[i]);
+  }
+
+  /* the record is only left if the switch failed after it was written */
+  if(res == -1 && l.count > 0 &&
+     xmp_sibling_path(j->path, LAYOUT_PREFIX, stripe_path) == 0 &&
+     xmp_metapath(stripe_path, temp_path) == 0)
+  {
+    unlink(temp_path);
+  }
+
+  free(buf);
+  free(d);
+
+  if(res == 0) __sync_fetch_and_add(&stripes.converted, 1);
+  else if(l.count > 0) __sync_fetch_and_add(&stripes.failed, 1);
+
+  free(j);
+}
+
+/* Removes the originals of striped files once they are due */
+
+static void *xmp_stripe_reaper(void *arg)
+{
+  time_t now;
+  struct stat st;
+  struct xmp_stripedrop *d;
+  struct xmp_stripedrop *due;
+  struct xmp_stripedrop **link;
+
+  (void) arg;
+
+  xmp_resetfsid();
+
+  while(1)
+  {
+    sleep(1);
+
+    now = time(NULL);
+    due = NULL;
+
+    pthread_mutex_lock(&stripes.lock);
+
+    link = &stripes.drops;
+    while((d = *link) != NULL)
+    {
+      if(d->due > now)
+      {
+        link = &d->next;
+        continue;
+      }
+
+      *link = d->next;
+      d->next = due;
+      due = d;
+    }
+
+    pthread_mutex_unlock(&stripes.lock);
+
+    while((d = due) != NULL)
+    {
+      due = d->next;
+
+      /* a write through a stale path would be lost with the original */
+      if(stat(d->real_path, &st) == 0 && (st.st_size != d->size ||
+         st.st_mtim.tv_sec != d->mtime.tv_sec ||
+         st.st_mtim.tv_nsec != d->mtime.tv_nsec))
+      {
+        syslog(LOG_ERR, "Keeping %s, it changed after %s was striped\n", d->real_path, d->path);
+      }
+      else
+      {
+        unlink(d->real_path);
+      }
+
+      free(d);
+    }
+  }
+
+  return NULL;
+}
+
+/* Queues a released file for striping once it has reached the threshold */
+
+static void xmp_stripe_queue(const char *path, int fd)
+{
+  size_t threshold;
+  struct stat st;
+  struct xmp_stripejob *j;
+
+  threshold = xmp_config_enter()->stripethreshold;
+  xmp_config_leave();
+
+  if(threshold == 0 || !stripes.reaping || strlen(path) >= MAX_PATH ||
+     xmp_mirrored(path)) return;
+
+  if(fstat(fd, &st) == -1 || st.st_size < (off_t) threshold) return;
+
+  j = malloc(sizeof(struct xmp_stripejob));
+  if(j == NULL) return;
+
+  strcpy(j->path, path);
+
+  xmp_pool_submit(&stripes.convert, xmp_stripe_convert, j);
+}
+
+/*
+  Moves the stripes of from next to their new name on the same mounts
+  and writes the layout record of to. real_to receives the new path
+  of stripe 0 for the meta symlink.
+*/
+
+static int xmp_layout_rename(const char *from, const char *to, char *real_to)
+{
+  int i, res;
+  struct xmp_layout l;
+  struct xmp_layout next;
+  struct xmp_config *cfg;
+  char stripe_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_layout_read(from, &l) == -1) return -EIO;
+
+  next = l;
+  res = 0;
+
+  cfg = xmp_config_enter();
+
+  for(i = 0; i < l.count; ++i)
+  {
+    if(xmp_stripe_path(to, i, stripe_path) == -1)
+    {
+      res = -ENAMETOOLONG;
+      break;
+    }
+
+    xmp_makerealdir(stripe_path, l.index[i], cfg->mounts[l.index[i]], cfg->mounts[0],
+      next.paths[i], meta_path);
+
+    res = rename(l.paths[i], next.paths[i]);
+
+    /* the directory index may be stale, retry once with probing */
+    if(res == -1 && errno == ENOENT)
+    {
+      xmp_dirindex_forget(stripe_path);
+
+      xmp_makerealdir(stripe_path, l.index[i], cfg->mounts[l.index[i]], cfg->mounts[0],
+        next.paths[i], meta_path);
+
+      xmp_setfsid();
+
+      res = rename(l.paths[i], next.paths[i]);
+    }
+
+    if(res == -1)
+    {
+      res = -errno;
+      break;
+    }
+  }
+
+  xmp_config_leave();
+
+  if(res == 0 && xmp_layout_write(to, &next) == -1) res = -errno;
+
+  if(res < 0)
+  {
+    while(--i >= 0) rename(next.paths[i], l.paths[i]);
+    return res;
+  }
+
+  strcpy(real_to, next.paths[0]);
+
+  if(xmp_sibling_path(from, LAYOUT_PREFIX, stripe_path) == 0 &&
+     xmp_metapath(stripe_path, meta_path) == 0)
+  {
+    unlink(meta_path);
+  }
+
+  return 0;
+}
+
+static void xmp_stats_merge(struct xmp_counter *dst, const struct xmp_counter *src)
+{
+  int i;
+
+  dst->calls += src->calls;
+  dst->errors += src->errors;
+  dst->usecs += src->usecs;
+
+  for(i = 0; i < HIST_BUCKETS; ++i)
+  {
+    dst->hist[i] += src->hist[i];
+  }
+}
+
+/* Returns the upper bound in microseconds of the given percentile */
+
+static unsigned long xmp_stats_percentile(const struct xmp_counter *c, int percent)
+{
+  int i;
+  unsigned long sum = 0;
+
+  if(c->calls == 0) return 0;
+
+  for(i = 0; i < HIST_BUCKETS - 1; ++i)
+  {
+    sum += c->hist[i];
+    if(sum * 100 >= c->calls * percent) break;
+  }
+
+  return 1UL << i;
+}
+
+static void xmp_stats_text(FILE *fp, const char *name, const struct xmp_counter *c)
+{
+  fprintf(fp, "%-24s %10lu %8lu %10lu %10lu %10lu %10lu\n", name,
+    c->calls, c->errors, c->calls ? c->usecs / c->calls : 0,
+    xmp_stats_percentile(c, 50), xmp_stats_percentile(c, 90),
+    xmp_stats_percentile(c, 99));
+}
+
+static void xmp_stats_raw(FILE *fp, const char *name, const struct xmp_counter *c)
+{
+  int i;
+
+  fprintf(fp, "%s.calls %lu\n", name, c->calls);
+  fprintf(fp, "%s.errors %lu\n", name, c->errors);
+  fprintf(fp, "%s.usecs %lu\n", name, c->usecs);
+  fprintf(fp, "%s.hist", name);
+  for(i = 0; i < HIST_BUCKETS; ++i)
+  {
+    fprintf(fp, " %lu", c->hist[i]);
+  }
+  fprintf(fp, "\n");
+}
+
+/*
+  Builds the contents of the stats files. The text variant is meant
+  for people, the raw variant has one "key value" pair per line and
+  histogram bucket i counts calls that took less than 2^i us.
+*/
+
+static int xmp_stats_report(int raw, char **data, size_t *size)
+{
+  int i, nmounts;
+  unsigned long calls;
+  FILE *fp;
+  char name[64];
+  struct xmp_stats *s;
+  struct xmp_stats *total;
+  struct xmp_space table[MAX_STORAGE];
+  struct xmp_config *cfg;
+  struct xmp_ioq *q;
+
+  total = calloc(1, sizeof(struct xmp_stats));
+  if(total == NULL) return -ENOMEM;
+
+  pthread_mutex_lock(&stats.lock);
+
+  for(s = stats.head; s; s = s->next)
+  {
+    for(i = 0; i < OP_MAX; ++i)
+    {
+      xmp_stats_merge(&total->ops[i], &s->ops[i]);
+    }
+    xmp_stats_merge(&total->meta, &s->meta);
+    for(i = 0; i < MAX_STORAGE; ++i)
+    {
+      xmp_stats_merge(&total->data[i], &s->data[i]);
+    }
+  }
+
+  pthread_mutex_unlock(&stats.lock);
+
+  fp = open_memstream(data, size);
+  if(fp == NULL)
+  {
+    free(total);
+    return -ENOMEM;
+  }
+
+  nmounts = xmp_space_get(table);
+
+  cfg = xmp_config_enter();
+
+  if(nmounts > cfg->nmounts) nmounts = cfg->nmounts;
+
+  if(raw)
+  {
+    for(i = 0; i < OP_MAX; ++i)
+    {
+      snprintf(name, sizeof(name), "op.%s", op_names[i]);
+      xmp_stats_raw(fp, name, &total->ops[i]);
+    }
+
+    xmp_stats_raw(fp, "meta", &total->meta);
+
+    for(i = 1; i < nmounts; ++i)
+    {
+      snprintf(name, sizeof(name), "data.%d", i);
+      fprintf(fp, "%s.path %s\n", name, cfg->mounts[i]);
+      fprintf(fp, "%s.state %s\n", name, table[i].state == MOUNT_UP ? "up" : "down");
+      fprintf(fp, "%s.probes %lu\n", name, table[i].probes);
+      fprintf(fp, "%s.timeouts %lu\n", name, table[i].timeouts);
+      fprintf(fp, "%s.transitions %lu\n", name, table[i].transitions);
+      fprintf(fp, "%s.placed %lu\n", name, placement.placed[i]);
+      fprintf(fp, "%s.writers %ld\n", name, placement.writers[i]);
+      fprintf(fp, "%s.reserved %lld\n", name, placement.reserved[i]);
+      fprintf(fp, "%s.reads %lu\n", name, handles.reads[i]);
+      fprintf(fp, "%s.writes %lu\n", name, handles.writes[i]);
+      fprintf(fp, "%s.bytes_read %llu\n", name, handles.bytes_read[i]);
+      fprintf(fp, "%s.bytes_written %llu\n", name, handles.bytes_written[i]);
+      fprintf(fp, "%s.inflight %d\n", name, iosched.mounts[i].inflight);
+      fprintf(fp, "%s.waiting %d\n", name, iosched.mounts[i].waiting);
+      fprintf(fp, "%s.requests %lu\n", name, iosched.mounts[i].requests);
+      fprintf(fp, "%s.queued %lu\n", name, iosched.mounts[i].queued);
+      fprintf(fp, "%s.wait_us %llu\n", name, iosched.mounts[i].wait_usecs);
+      fprintf(fp, "%s.max_wait_us %lu\n", name, iosched.mounts[i].max_usecs);
+      xmp_stats_raw(fp, name, &total->data[i]);
+    }
+
+    fprintf(fp, "placement.relocated %lu\n", placement.relocated);
+    fprintf(fp, "handles.opened %lu\n", handles.opened);
+    fprintf(fp, "handles.open %lu\n", handles.opened - handles.released);
+    fprintf(fp, "inodes.known %lu\n", nodes.count);
+    fprintf(fp, "inodes.hits %lu\n", nodes.hits);
+    fprintf(fp, "inodes.forgotten %lu\n", nodes.forgotten);
+    fprintf(fp, "dirindex.hits %lu\n", dirindex.hits);
+    fprintf(fp, "dirindex.probes %lu\n", dirindex.probes);
+    fprintf(fp, "mirror.copies %lu\n", mirrors.copies);
+    fprintf(fp, "mirror.failed %lu\n", mirrors.failed);
+    fprintf(fp, "mirror.dropped %lu\n", mirrors.dropped);
+    fprintf(fp, "mirror.reads %lu\n", mirrors.reads);
+    fprintf(fp, "mirror.bytes %lu\n", mirrors.bytes);
+    fprintf(fp, "localcache.hits %lu\n", localcache.hits);
+    fprintf(fp, "localcache.misses %lu\n", localcache.misses);
+    fprintf(fp, "localcache.stale %lu\n", localcache.stale);
+    fprintf(fp, "localcache.copies %lu\n", localcache.copies);
+    fprintf(fp, "localcache.failed %lu\n", localcache.failed);
+    fprintf(fp, "localcache.evictions %lu\n", localcache.evictions);
+    fprintf(fp, "localcache.bytes %lu\n", localcache.bytes);
+    fprintf(fp, "localcache.used %zu\n", localcache.used);
+    fprintf(fp, "stripe.converted %lu\n", stripes.converted);
+    fprintf(fp, "stripe.failed %lu\n", stripes.failed);
+    fprintf(fp, "stripe.split %lu\n", stripes.split);
+    fprintf(fp, "stripe.bytes %lu\n", stripes.bytes);
+    fprintf(fp, "locindex.entries %u\n", locindex.header ? locindex.header->used : 0);
+    fprintf(fp, "locindex.hits %lu\n", locindex.hits);
+    fprintf(fp, "locindex.misses %lu\n", locindex.misses);
+    fprintf(fp, "locindex.expired %lu\n", locindex.expired);
+    fprintf(fp, "locindex.puts %lu\n", locindex.puts);
+    fprintf(fp, "locindex.drops %lu\n", locindex.drops);
+    fprintf(fp, "locindex.checkpoints %lu\n", locindex.checkpoints);
+    fprintf(fp, "uring.entries %u\n", uring.entries);
+    fprintf(fp, "uring.inflight %u\n", uring.inflight);
+    fprintf(fp, "uring.submitted %lu\n", uring.submitted);
+    fprintf(fp, "uring.completed %lu\n", uring.completed);
+    fprintf(fp, "uring.full %lu\n", uring.full);
+    fprintf(fp, "readahead.hits %lu\n", streams.hits);
+    fprintf(fp, "readahead.misses %lu\n", streams.misses);
+    fprintf(fp, "readahead.throttled %lu\n", streams.throttled);
+    fprintf(fp, "readahead.bytes %lu\n", streams.bytes);
+    fprintf(fp, "readahead.memory %zu\n", streams.memory);
+    fprintf(fp, "writebehind.writes %lu\n", writebehind.writes);
+    fprintf(fp, "writebehind.bypassed %lu\n", writebehind.bypassed);
+    fprintf(fp, "writebehind.flushes %lu\n", writebehind.flushes);
+    fprintf(fp, "writebehind.bytes %lu\n", writebehind.bytes);
+    fprintf(fp, "writebehind.memory %zu\n", writebehind.memory);
+  }
+  else
+  {
+    fprintf(fp, "%-24s %10s %8s %10s %10s %10s %10s\n", "operation",
+      "calls", "errors", "avg_us", "p50_us", "p90_us", "p99_us");
+
+    for(i = 0; i < OP_MAX; ++i)
+    {
+      xmp_stats_text(fp, op_names[i], &total->ops[i]);
+    }
+
+    fprintf(fp, "\n");
+    xmp_stats_text(fp, "meta", &total->meta);
+
+    for(i = 1; i < nmounts; ++i)
+    {
+      xmp_stats_text(fp, cfg->mounts[i], &total->data[i]);
+    }
+
+    fprintf(fp, "\n%-24s %6s %10s %8s %14s %10s %9s %12s\n", "mount",
+      "state", "placed", "writers", "reserved", "probes", "timeouts", "transitions");
+
+    for(i = 1; i < nmounts; ++i)
+    {
+      fprintf(fp, "%-24s %6s %10lu %8ld %14lld %10lu %9lu %12lu\n", cfg->mounts[i],
+        table[i].state == MOUNT_UP ? "up" : "down", placement.placed[i],
+        placement.writers[i], placement.reserved[i], table[i].probes,
+        table[i].timeouts, table[i].transitions);
+    }
+
+    fprintf(fp, "%-24s %lu\n", "relocated", placement.relocated);
+
+    fprintf(fp, "\n%-24s %10s %10s %16s %16s\n", "released handles",
+      "reads", "writes", "bytes_read", "bytes_written");
+
+    for(i = 1; i < nmounts; ++i)
+    {
+      fprintf(fp, "%-24s %10lu %10lu %16llu %16llu\n", cfg->mounts[i],
+        handles.reads[i], handles.writes[i], handles.bytes_read[i],
+        handles.bytes_written[i]);
+    }
+
+    fprintf(fp, "%-24s %lu opened, %lu open\n", "handles", handles.opened,
+      handles.opened - handles.released);
+
+    fprintf(fp, "%-24s %lu known, %lu hits, %lu forgotten\n", "inodes",
+      nodes.count, nodes.hits, nodes.forgotten);
+
+    fprintf(fp, "\n%-24s %8s %8s %12s %10s %12s %12s\n", "scheduler",
+      "inflight", "waiting", "requests", "queued", "avg_wait_us", "max_wait_us");
+
+    for(i = 1; i < nmounts; ++i)
+    {
+      q = &iosched.mounts[i];
+      fprintf(fp, "%-24s %8d %8d %12lu %10lu %12llu %12lu\n", cfg->mounts[i],
+        q->inflight, q->waiting, q->requests, q->queued,
+        q->queued ? q->wait_usecs / q->queued : 0, q->max_usecs);
+    }
+
+    fprintf(fp, "\n%-24s %10s %10s\n", "dirindex", "hits", "probes");
+    fprintf(fp, "%-24s %10lu %10lu\n", "total", dirindex.hits, dirindex.probes);
+
+    fprintf(fp, "\n%-24s %10s %10s %10s %10s %14s\n", "mirror",
+      "copies", "failed", "dropped", "reads", "bytes");
+    fprintf(fp, "%-24s %10lu %10lu %10lu %10lu %14lu\n", "total",
+      mirrors.copies, mirrors.failed, mirrors.dropped, mirrors.reads,
+      mirrors.bytes);
+
+    calls = localcache.hits + localcache.misses;
+
+    fprintf(fp, "\n%-24s %10s %10s %8s %10s %10s %10s %10s %14s %14s\n",
+      "localcache", "hits", "misses", "hit_pct", "stale", "copies", "failed",
+      "evictions", "bytes", "used");
+    fprintf(fp, "%-24s %10lu %10lu %8.1f %10lu %10lu %10lu %10lu %14lu %14zu\n",
+      "total", localcache.hits, localcache.misses,
+      calls ? 100.0 * localcache.hits / calls : 0.0, localcache.stale,
+      localcache.copies, localcache.failed, localcache.evictions,
+      localcache.bytes, localcache.used);
+
+    fprintf(fp, "\n%-24s %10s %10s %10s %14s\n", "stripe",
+      "converted", "failed", "split", "bytes");
+    fprintf(fp, "%-24s %10lu %10lu %10lu %14lu\n", "total",
+      stripes.converted, stripes.failed, stripes.split, stripes.bytes);
+
+    fprintf(fp, "\n%-24s %10s %10s %10s %10s %10s %10s %11s\n", "locindex",
+      "entries", "hits", "misses", "expired", "puts", "drops", "checkpoints");
+    fprintf(fp, "%-24s %10u %10lu %10lu %10lu %10lu %10lu %11lu\n", "total",
+      locindex.header ? locindex.header->used : 0, locindex.hits,
+      locindex.misses, locindex.expired, locindex.puts, locindex.drops,
+      locindex.checkpoints);
+
+    fprintf(fp, "\n%-24s %10s %10s %14s %14s %10s\n", "uring",
+      "entries", "inflight", "submitted", "completed", "full");
+    fprintf(fp, "%-24s %10u %10u %14lu %14lu %10lu\n", "total",
+      uring.entries, uring.inflight, uring.submitted, uring.completed,
+      uring.full);
+
+    calls = streams.hits + streams.misses;
+
+    fprintf(fp, "\n%-24s %10s %10s %8s %10s %14s %12s\n", "readahead",
+      "hits", "misses", "hit_pct", "throttled", "bytes", "memory");
+    fprintf(fp, "%-24s %10lu %10lu %8.1f %10lu %14lu %12zu\n", "total",
+      streams.hits, streams.misses,
+      calls ? 100.0 * streams.hits / calls : 0.0,
+      streams.throttled, streams.bytes, streams.memory);
+
+    fprintf(fp, "\n%-24s %10s %10s %10s %14s %12s\n", "writebehind",
+      "writes", "bypassed", "flushes", "bytes", "memory");
+    fprintf(fp, "%-24s %10lu %10lu %10lu %14lu %12zu\n", "total",
+      writebehind.writes, writebehind.bypassed, writebehind.flushes,
+      writebehind.bytes, writebehind.memory);
+  }
+
+  xmp_config_leave();
+
+  fclose(fp);
+  free(total);
+
+  return 0;
+}
+
+static int xmp_stats_path(const char *path)
+{
+  size_t size = sizeof(STATS_DIR) - 1;
+  return strncmp(path, STATS_DIR, size) == 0 && (path[size] == '\0' || path[size] == '/');
+}
+
+static int xmp_stats_getattr(const char *path, struct stat *stbuf)
+{
+  memset(stbuf, 0, sizeof(struct stat));
+
+  stbuf->st_uid = fsuid;
+  stbuf->st_gid = fsgid;
+
+  if(strcmp(path, STATS_DIR) == 0)
+  {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  if(strcmp(path, STATS_TEXT) == 0 || strcmp(path, STATS_RAW) == 0)
+  {
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    return 0;
+  }
+
+  return -ENOENT;
+}
+
+/*
+  Also returns the mount of the file and the sequence number of its
+  path cache slot from before the lookup, which the inode table keeps
+  with the attributes.
+*/
+
+static int xmp_getattr(const char *path, struct stat *stbuf, int *mount,
+  unsigned int *seq)
+{
+  int res;
+  int index;
+  struct timespec start;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  *mount = 0;
+  *seq = 0;
+
+  if(xmp_stats_path(path)) return xmp_stats_getattr(path, stbuf);
+
+  if(xmp_cache_getattr(path, stbuf, mount, seq) == 0) return 0;
+
+  res = xmp_realpath(path, real_path, meta_path, &index);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = xmp_lstat(path, real_path, stbuf);
+
+  if(index > 0) xmp_stats_data(index, &start, res);
+  else xmp_stats_meta(&start, res);
+
+  if(res == -1) return -errno;
+
+  xmp_cache_setattr(path, stbuf, *seq);
+
+  *mount = index;
+
+  return 0;
+}
+
+static int xmp_access(const char *path, int mask)
+{
+  int res;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_stats_path(path)) return mask & W_OK ? -EACCES : 0;
+
+  res = xmp_realpath(path, real_path, meta_path, NULL);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  res = access(real_path, mask);
+
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_readlink(const char *path, char *buf, size_t size)
+{
+  int res;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  res = xmp_realpath(path, real_path, meta_path, NULL);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  res = readlink(real_path, buf, size - 1);
+
+  if(res == -1) return -errno;
+
+  buf[res] = '\0';
+  return 0;
+}
+
+static int xmp_getxattr(const char *path, const char *name, char *value,
+  size_t size)
+{
+  int res;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_stats_path(path)) return -ENODATA;
+
+  res = xmp_realpath(path, real_path, meta_path, NULL);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  res = getxattr(real_path[0] ? real_path : meta_path, name, value, size);
+
+  if(res == -1) return -errno;
+
+  return res;
+}
+
+static int xmp_listxattr(const char *path, char *list, size_t size)
+{
+  int res;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  if(xmp_stats_path(path)) return 0;
+
+  res = xmp_realpath(path, real_path, meta_path, NULL);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  res = listxattr(real_path[0] ? real_path : meta_path, list, size);
+
+  if(res == -1) return -errno;
+
+  return res;
+}
+
+/* Adds one entry to a readdir reply, returns 1 once the reply is full */
+typedef int (*xmp_fill_t)(void *buf, const char *name, const struct stat *stbuf,
+  off_t off);
+
+struct xmp_dirent
+{
+  char name[NAME_MAX + 1];
+  off_t nextoff;
+  struct stat st;
+};
+
+struct xmp_fetch
+{
+  const char *dir;
+  struct xmp_dirent *entry;
+  struct xmp_batch *batch;
+};
+
+struct xmp_dirp
+{
+  DIR *dp;
+  struct dirent *entry;
+  off_t offset;
+  char *path;
+  struct xmp_dirent *batch;
+  int count;
+  int pos;
+};
+
+static int xmp_opendir(const char *path, struct fuse_file_info *fi)
+{
+  DIR *dp;
+  struct xmp_dirp *d;
+  char meta_path[MAX_PATH];
+
+  if(xmp_stats_path(path))
+  {
+    if(strcmp(path, STATS_DIR) != 0) return -ENOTDIR;
+    dp = NULL;
+  }
+  else
+  {
+    if(xmp_metapath(path, meta_path) == -1) return -ENAMETOOLONG;
+
+    dp = opendir(meta_path);
+
+    if(dp == NULL) return -errno;
+  }
+
+  d = malloc(sizeof(struct xmp_dirp));
+  if(d == NULL)
+  {
+    if(dp) closedir(dp);
+    return -ENOMEM;
+  }
+
+  d->dp = dp;
+  d->entry = NULL;
+  d->offset = 0;
+  d->path = NULL;
+  d->batch = NULL;
+  d->count = 0;
+  d->pos = 0;
+
+  /* without the attribute cache there is nothing to prefetch into */
+  if(cache.size > 0 && dp)
+  {
+    d->path = strdup(path);
+    d->batch = malloc(PREFETCH_BATCH * sizeof(struct xmp_dirent));
+  }
+
+  fi->fh = (unsigned long) d;
+  return 0;
+}
+
+/*
+  Resolves one directory entry and stores its attributes both in
+  the batch and in the attribute cache, so the getattr calls that
+  the kernel issues after readdir do not go to NFS.
+*/
+
+static void xmp_prefetch(void *arg)
+{
+  int res;
+  unsigned int seq;
+  struct stat st;
+  struct xmp_fetch *f = arg;
+  char path[MAX_PATH];
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  snprintf(path, MAX_PATH, "%s/%s", strcmp(f->dir, "/") ? f->dir : "", f->entry->name);
+
+  if(xmp_cache_getattr(path, &st, NULL, &seq) == 0)
+  {
+    f->entry->st = st;
+  }
+  else
+  {
+    res = xmp_realpath(path, real_path, meta_path, NULL);
+    if(res >= 0 && xmp_lstat(path, real_path, &st) == 0)
+    {
+      f->entry->st = st;
+      xmp_cache_setattr(path, &st, seq);
+    }
+  }
+
+  pthread_mutex_lock(&f->batch->lock);
+  if(--f->batch->pending == 0) pthread_cond_signal(&f->batch->cond);
+  pthread_mutex_unlock(&f->batch->lock);
+}
+
+static void xmp_readdir_batch(struct xmp_dirp *d)
+{
+  int i;
+  struct dirent *entry;
+  struct xmp_dirent *e;
+  struct xmp_batch batch;
+  struct xmp_fetch fetch[PREFETCH_BATCH];
+
+  d->count = 0;
+  d->pos = 0;
+
+  while(d->count < PREFETCH_BATCH && (entry = readdir(d->dp)))
+  {
+    e = &d->batch[d->count++];
+    strncpy(e->name, entry->d_name, NAME_MAX);
+    e->name[NAME_MAX] = '\0';
+    memset(&e->st, 0, sizeof(struct stat));
+    e->st.st_ino = entry->d_ino;
+    e->st.st_mode = entry->d_type << 12;
+    e->nextoff = telldir(d->dp);
+  }
+
+  batch.pending = 1;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.cond, NULL);
+
+  for(i = 0; i < d->count; ++i)
+  {
+    if(strcmp(d->batch[i].name, ".") == 0 || strcmp(d->batch[i].name, "..") == 0 ||
+       xmp_hidden_name(d->batch[i].name)) continue;
+
+    pthread_mutex_lock(&batch.lock);
+    ++batch.pending;
+    pthread_mutex_unlock(&batch.lock);
+
+    fetch[i].dir = d->path;
+    fetch[i].entry = &d->batch[i];
+    fetch[i].batch = &batch;
+    xmp_pool_submit(&prefetch, xmp_prefetch, &fetch[i]);
+  }
+
+  pthread_mutex_lock(&batch.lock);
+  --batch.pending;
+  while(batch.pending > 0)
+  {
+    pthread_cond_wait(&batch.cond, &batch.lock);
+  }
+  pthread_mutex_unlock(&batch.lock);
+
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.cond);
+}
+
+static int xmp_readdir(const char *path, void *buf, xmp_fill_t filler,
+  off_t offset, struct fuse_file_info *fi)
+{
+  struct stat st;
+  off_t nextoff;
+  struct xmp_dirent *e;
+  struct xmp_dirp *d = (struct xmp_dirp *) (uintptr_t) fi->fh;
+
+  (void) path;
+
+  if(d->dp == NULL)
+  {
+    static const char *names[] = {".", "..", "stats", "stats.raw"};
+    memset(&st, 0, sizeof(st));
+    for(; offset < 4; ++offset)
+    {
+      st.st_mode = offset < 2 ? S_IFDIR : S_IFREG;
+      if(filler(buf, names[offset], &st, offset + 1)) break;
+    }
+    return 0;
+  }
+
+  if(offset != d->offset)
+  {
+    seekdir(d->dp, offset);
+    d->entry = NULL;
+    d->offset = offset;
+    d->count = 0;
+    d->pos = 0;
+  }
+
+  if(d->batch && d->path)
+  {
+    while(1)
+    {
+      if(d->pos == d->count)
+      {
+        xmp_readdir_batch(d);
+        if(d->count == 0) break;
+      }
+
+      e = &d->batch[d->pos];
+
+      if(!xmp_hidden_name(e->name) &&
+         filler(buf, e->name, &e->st, e->nextoff)) break;
+
+      ++d->pos;
+      d->offset = e->nextoff;
+    }
+
+    return 0;
+  }
+
+  while (1)
+  {
+    if(!d->entry)
+    {
+      d->entry = readdir(d->dp);
+      if(!d->entry) break;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = d->entry->d_ino;
+    st.st_mode = d->entry->d_type << 12;
+    nextoff = telldir(d->dp);
+
+    if(!xmp_hidden_name(d->entry->d_name) &&
+       filler(buf, d->entry->d_name, &st, nextoff)) break;
+
+    d->entry = NULL;
+    d->offset = nextoff;
+  }
+
+  return 0;
+
+}
+
+static int xmp_releasedir(const char *path, struct fuse_file_info *fi)
+{
+  struct xmp_dirp *d = (struct xmp_dirp *) (uintptr_t) fi->fh;
+  (void) path;
+  if(d->dp) closedir(d->dp);
+  free(d->path);
+  free(d->batch);
+  free(d);
+  return 0;
+}
+
+static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+  int res;
+  struct timespec start;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  res = xmp_makepath(path, real_path, meta_path, 0, NULL);
+
+  if(res == -1) return -ENOSPC;
+
+  xmp_setfsid();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = mknod(real_path, mode|S_IWUSR, rdev);
+
+  xmp_stats_data(xmp_mountindex(real_path), &start, res);
+
+  /* the directory index may be stale, retry once with probing */
+  if(res == -1 && errno == ENOENT)
+  {
+    xmp_dirindex_forget(path);
+
+    res = xmp_makepath(path, real_path, meta_path, 0, NULL);
+
+    if(res == -1) return -ENOSPC;
+
+    xmp_setfsid();
+
+    res = mknod(real_path, mode|S_IWUSR, rdev);
+  }
+
+  if(res == -1) return -errno;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = symlink(real_path, meta_path);
+
+  xmp_stats_meta(&start, res);
+
+  xmp_cache_invalidate(path);
+
+  if(res == -1) return -errno;
+
+  xmp_locindex_put(path, real_path, NULL);
+
+  return 0;
+}
+
+static int xmp_symlink(const char *from, const char *to)
+{
+  int res;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  res = xmp_makepath(to, real_path, meta_path, 0, NULL);
+
+  if(res == -1) return -ENOSPC;
+
+  xmp_setfsid();
+
+  res = symlink(from, real_path);
+
+  /* the directory index may be stale, retry once with probing */
+  if(res == -1 && errno == ENOENT)
+  {
+    xmp_dirindex_forget(to);
+
+    res = xmp_makepath(to, real_path, meta_path, 0, NULL);
+
+    if(res == -1) return -ENOSPC;
+
+    xmp_setfsid();
+
+    res = symlink(from, real_path);
+  }
+
+  if(res == -1) return -errno;
+
+  res = symlink(real_path, meta_path);
+
+  xmp_cache_invalidate(to);
+
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_mkdir(const char *path, mode_t mode)
+{
+  int res;
+  struct timespec start;
+  char meta_path[MAX_PATH];
+
+  if(xmp_metapath(path, meta_path) == -1) return -ENAMETOOLONG;
+
+  xmp_setfsid();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = mkdir(meta_path, mode|S_IWUSR);
+
+  xmp_stats_meta(&start, res);
+
+  xmp_dirindex_drop(path);
+  xmp_cache_invalidate(path);
+
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_unlink(const char *path)
+{
+  int res;
+  int index;
+  struct timespec start;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  res = xmp_realpath(path, real_path, meta_path, &index);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  xmp_setfsid();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = unlink(real_path);
+
+  xmp_stats_data(index, &start, res);
+
+  if(res == -1) return -errno;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = unlink(meta_path);
+
+  xmp_stats_meta(&start, res);
+
+  xmp_cache_invalidate(path);
+
+  if(res == -1) return -errno;
+
+  if(xmp_striped(real_path)) xmp_layout_unlink(path);
+
+  xmp_ofile_unlink(path);
+  xmp_mirror_drop(path);
+  xmp_local_drop(path);
+
+  return 0;
+}
+
+static int xmp_rmdir(const char *path)
+{
+  int res, error, busy;
+  int i, n;
+  int mounts[MAX_STORAGE];
+  char dir_path[MAX_PATH];
+  struct xmp_config *cfg;
+
+  res = 0;
+
+  xmp_setfsid();
+
+  cfg = xmp_config_enter();
+
+  n = xmp_dirmounts(cfg, path, mounts);
+
+  for(i = 0; i < n; ++i)
+  {
+    if(snprintf(dir_path, MAX_PATH, "%s/%s", cfg->mounts[mounts[i]], path) >= MAX_PATH)
+    {
+      errno = ENAMETOOLONG;
+      res = -1;
+      break;
+    }
+
+    res = rmdir(dir_path);
+
+    if(res == -1 && errno == ENOENT) res = 0;
+
+    if(res == -1) break;
+  }
+
+  if(res == 0 && snprintf(dir_path, MAX_PATH, "%s/%s", cfg->mounts[0], path) >= MAX_PATH)
+  {
+    errno = ENAMETOOLONG;
+    res = -1;
+  }
+
+  busy = 0;
+
+  if(res == 0)
+  {
+    res = rmdir(dir_path);
+    busy = res == -1 && errno == ENOTEMPTY;
+  }
+
+  error = errno;
+
+  /* the directory stays, so probe the mounts the index had as absent */
+  xmp_dirindex_drop(path);
+  if(busy) xmp_dirmounts(cfg, path, mounts);
+
+  xmp_config_leave();
+
+  xmp_cache_invalidate(path);
+
+  if(res == -1) return -error;
+
+  return 0;
+}
+
+static int xmp_rename_file(const char *from, const char *to, char *real_to)
+{
+  int res;
+  int index;
+  char *real_ptr;
+  char *meta_ptr;
+  char meta_to[MAX_PATH];
+  char real_prfx[MAX_PATH];
+  char meta_prfx[MAX_PATH];
+  char real_from[MAX_PATH];
+  char meta_from[MAX_PATH];
+
+  res = xmp_realpath(from, real_from, meta_from, &index);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  if(res == 1) return -EISDIR;
+
+  res = xmp_realpath(to, real_to, meta_to, NULL);
+
+  if(res == -2) return -EIO;
+
+  xmp_local_drop(from);
+  xmp_local_drop(to);
+
+  xmp_setfsid();
+
+  if(res == 0)
+  {
+    res = unlink(real_to);
+
+    if(res == -1) return -errno;
+
+    res = unlink(meta_to);
+
+    if(xmp_striped(real_to)) xmp_layout_unlink(to);
+  }
+
+  if(xmp_striped(real_from))
+  {
+    res = xmp_layout_rename(from, to, real_to);
+
+    if(res < 0) return res;
+  }
+  else
+  {
+    strncpy(real_prfx, real_from, MAX_PATH);
+    real_ptr = strstr(real_prfx, from);
+    *real_ptr = '\0';
+
+    strncpy(meta_prfx, meta_from, MAX_PATH);
+    meta_ptr = strstr(meta_prfx, from);
+    *meta_ptr = '\0';
+
+    res = xmp_makerealdir(to, index, real_prfx, meta_prfx, real_to, meta_to);
+
+    res = rename(real_from, real_to);
+
+    /* the directory index may be stale, retry once with probing */
+    if(res == -1 && errno == ENOENT)
+    {
+      xmp_dirindex_forget(to);
+
+      xmp_makerealdir(to, index, real_prfx, meta_prfx, real_to, meta_to);
+
+      xmp_setfsid();
+
+      res = rename(real_from, real_to);
+    }
+
+    if(res == -1) return -errno;
+  }
+
+  res = unlink(meta_from);
+  if(res == -1) return -errno;
+
+  res = symlink(real_to, meta_to);
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_rename(const char *from, const char *to)
+{
+  int res;
+  char real_to[MAX_PATH];
+
+  /* an open of to must not find the copy of the file it replaces */
+  xmp_mirror_drop(to);
+
+  res = xmp_rename_file(from, to, real_to);
+
+  /* a failed rename may stop halfway, drop both names either way */
+  xmp_cache_invalidate(from);
+  xmp_cache_invalidate(to);
+
+  if(res < 0)
+  {
+    xmp_mirror_queue(to);
+    return res;
+  }
+
+  xmp_mirror_drop(from);
+
+  xmp_ofile_rename(from, to);
+
+  xmp_locindex_put(to, real_to, NULL);
+
+  xmp_mirror_queue(to);
+
+  return res;
+}
+
+static int xmp_chmod(const char *path, mode_t mode)
+{
+  int i, n;
+  int res;
+  int mounts[MAX_STORAGE];
+  char dir_path[MAX_PATH];
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+  struct xmp_config *cfg;
+
+  res = xmp_realpath(path, real_path, meta_path, NULL);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  xmp_setfsid();
+
+  if(res == 1)
+  {
+    cfg = xmp_config_enter();
+
+    n = xmp_dirmounts(cfg, path, mounts);
+
+    for(i = 0; i < n; ++i)
+    {
+      if(snprintf(dir_path, MAX_PATH, "%s/%s", cfg->mounts[mounts[i]], path) >= MAX_PATH)
+      {
+        errno = ENAMETOOLONG;
+        res = -1;
+        break;
+      }
+
+      res = chmod(dir_path, mode);
+
+      if(res == -1 && errno == ENOENT)
+      {
+        xmp_dirindex_drop(path);
+        res = 0;
+      }
+
+      if(res == -1) break;
+    }
+
+    if(res == 0) res = chmod(meta_path, mode);
+
+    xmp_config_leave();
+  }
+  else
+  {
+    res = chmod(real_path, mode);
+    xmp_cache_touch(xmp_cache_slot(path));
+  }
+
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_chown(const char *path, uid_t uid, gid_t gid)
+{
+  int i, n;
+  int res;
+  int mounts[MAX_STORAGE];
+  char dir_path[MAX_PATH];
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+  struct xmp_config *cfg;
+
+  res = xmp_realpath(path, real_path, meta_path, NULL);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  xmp_setfsid();
+
+  if(res == 1)
+  {
+    cfg = xmp_config_enter();
+
+    n = xmp_dirmounts(cfg, path, mounts);
+
+    for(i = 0; i < n; ++i)
+    {
+      if(snprintf(dir_path, MAX_PATH, "%s/%s", cfg->mounts[mounts[i]], path) >= MAX_PATH)
+      {
+        errno = ENAMETOOLONG;
+        res = -1;
+        break;
+      }
+
+      res = lchown(dir_path, uid, gid);
+
+      if(res == -1 && errno == ENOENT)
+      {
+        xmp_dirindex_drop(path);
+        res = 0;
+      }
+
+      if(res == -1) break;
+    }
+
+    if(res == 0) res = lchown(meta_path, uid, gid);
+
+    xmp_config_leave();
+
+  }
+  else
+  {
+    res = lchown(real_path, uid, gid);
+    xmp_cache_touch(xmp_cache_slot(path));
+  }
+
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_statfs(const char *path, struct statvfs *stbuf)
+{
+  struct statvfs st;
+  struct xmp_space table[MAX_STORAGE];
+  int bfac;
+  int i;
+  int nmounts;
+  int ret = -1;
+
+  (void) path;
+
+  nmounts = xmp_space_get(table);
+
+  stbuf->f_namemax = 0;
+  stbuf->f_bsize   = 0;
+  stbuf->f_blocks  = 0;
+  stbuf->f_bavail  = 0;
+  stbuf->f_bfree   = 0;
+  stbuf->f_files   = 0;
+  stbuf->f_ffree   = 0;
+
+  for(i = 1; i < nmounts; ++i)
+  {
+    if(table[i].error || table[i].state == MOUNT_DOWN) continue;
+
+    st = table[i].st;
+
+    if(st.f_bsize != 1048576)
+    {
+      if(st.f_bsize == 0) continue;
+
+      bfac = 1048576 / st.f_bsize;
+
+      if(bfac == 0) continue;
+
+      st.f_blocks /= bfac;
+      st.f_bavail /= bfac;
+      st.f_bfree  /= bfac;
+
+      st.f_bsize = 1048576;
+    }
+
+    stbuf->f_blocks += st.f_blocks;
+    stbuf->f_bavail += st.f_bavail;
+    stbuf->f_bfree  += st.f_bfree;
+    stbuf->f_files  += st.f_files;
+    stbuf->f_ffree  += st.f_ffree;
+
+    if(stbuf->f_namemax == 0)
+    {
+      stbuf->f_namemax = st.f_namemax;
+      stbuf->f_bsize = st.f_bsize;
+    }
+
+    ret = 0;
+  }
+
+  return ret;
+}
+
+static int xmp_utimens(const char *path, const struct timespec ts[2])
+{
+  int res;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  res = xmp_realpath(path, real_path, meta_path, NULL);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  xmp_setfsid();
+
+  res = utimensat(0, real_path, ts, AT_SYMLINK_NOFOLLOW);
+
+  if(res == 0) xmp_cache_touch(xmp_cache_slot(path));
+
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_truncate(const char *path, off_t size)
+{
+  int res;
+  int index;
+  struct timespec start;
+  struct xmp_layout l;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  res = xmp_realpath(path, real_path, meta_path, &index);
+
+  if(res == -1) return -ENOENT;
+
+  if(res == -2) return -EIO;
+
+  if(res == 1) return -EISDIR;
+
+  xmp_setfsid();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if(xmp_striped(real_path))
+  {
+    /* stripe 0 goes first, as the caller, to check the permissions */
+    res = xmp_layout_read(path, &l);
+    if(res == 0) res = truncate(real_path, xmp_stripe_length(&l, 0, size));
+    if(res == 0)
+    {
+      xmp_resetfsid();
+      res = xmp_layout_truncate(&l, size);
+    }
+  }
+  else
+  {
+    res = truncate(real_path, size);
+  }
+
+  if(index > 0) xmp_stats_data(index, &start, res);
+  else xmp_stats_meta(&start, res);
+
+  if(res == -1) return -errno;
+
+  /* a stored checksum no longer matches the contents */
+  removexattr(real_path, ADLER_XATTR);
+
+  xmp_cache_touch(xmp_cache_slot(path));
+
+  xmp_mirror_drop(path);
+  xmp_mirror_queue(path);
+  xmp_local_drop(path);
+
+  return 0;
+}
+
+static uint32_t xmp_adler32(uint32_t adler, const unsigned char *buf, size_t size)
+{
+  size_t n;
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+
+  while(size > 0)
+  {
+    n = size < ADLER_NMAX ? size : ADLER_NMAX;
+    size -= n;
+    while(n--)
+    {
+      a += *buf++;
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+  }
+
+  return (b << 16) | a;
+}
+
+/*
+  Extends the running checksum of a handle with a completed write.
+  Anything but a write at the current end of the checksummed range
+  invalidates the checksum for the rest of the handle's life.
+*/
+
+static void xmp_adler_update(struct xmp_file *f, const char *buf, off_t offset, int res)
+{
+  if(!f->adler_valid) return;
+
+  pthread_mutex_lock(&f->lock);
+
+  if(res < 0 || offset != f->adler_pos)
+  {
+    f->adler_valid = 0;
+  }
+  else if(f->adler_valid)
+  {
+    f->adler = xmp_adler32(f->adler, (const unsigned char *) buf, res);
+    f->adler_pos += res;
+  }
+
+  pthread_mutex_unlock(&f->lock);
+}
+
+/*
+  The stored value carries the size and modification time the checksum
+  was computed for, so readers can tell when the file changed later,
+  for example through a handle on another node.
+*/
+
+static void xmp_adler_store(struct xmp_file *f)
+{
+  int size;
+  struct stat st;
+  char value[64];
+  static int warned = 0;
+
+  if(!f->adler_valid || f->adler_pos == 0) return;
+
+  if(!xmp_ofile_sole(f->ofile, f->wopens)) return;
+
+  if(fstat(f->fd, &st) == -1 || st.st_size != f->adler_pos) return;
+
+  size = snprintf(value, sizeof(value), "%08x %lld %lld.%09ld", f->adler,
+    (long long) st.st_size, (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+
+  if(fsetxattr(f->fd, ADLER_XATTR, value, size, 0) == -1 &&
+    (errno != ENOTSUP || !__sync_lock_test_and_set(&warned, 1)))
+  {
+    syslog(LOG_WARNING, "Cannot store checksum: %s\n", strerror(errno));
+  }
+}
+
+static struct xmp_stream *xmp_stream_open(int fd, int index, uid_t uid,
+  size_t window)
+{
+  int i;
+  struct xmp_stream *s;
+
+  s = malloc(sizeof(struct xmp_stream));
+  if(s == NULL) return NULL;
+
+  memset(s, 0, sizeof(struct xmp_stream));
+
+  s->fd = fd;
+  s->index = index;
+  s->uid = uid;
+  s->window = window / READAHEAD_SEGMENTS;
+  s->eof = -1;
+
+  for(i = 0; i < READAHEAD_SEGMENTS; ++i)
+  {
+    s->seg[i].stream = s;
+    s->seg[i].state = SEGMENT_EMPTY;
+  }
+
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+
+  return s;
+}
+
+static void xmp_stream_close(struct xmp_stream *s)
+{
+  int i;
+
+  pthread_mutex_lock(&s->lock);
+  while(s->pending > 0) pthread_cond_wait(&s->cond, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+
+  for(i = 0; i < READAHEAD_SEGMENTS; ++i) free(s->seg[i].buf);
+
+  __sync_fetch_and_sub(&streams.memory, s->reserved);
+
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  free(s);
+}
+
+/*
+  Buffers are only allocated once a handle turns out to be sequential,
+  and only while the total stays below storage.readaheadmem.
+*/
+
+static int xmp_stream_reserve(struct xmp_stream *s)
+{
+  int i;
+  size_t size, limit;
+
+  if(s->reserved) return 1;
+
+  limit = xmp_config_enter()->readaheadmem;
+  xmp_config_leave();
+
+  size = s->window * READAHEAD_SEGMENTS;
+
+  if(__sync_add_and_fetch(&streams.memory, size) > limit)
+  {
+    __sync_fetch_and_sub(&streams.memory, size);
+    __sync_fetch_and_add(&streams.throttled, 1);
+    return 0;
+  }
+
+  for(i = 0; i < READAHEAD_SEGMENTS; ++i)
+  {
+    s->seg[i].buf = malloc(s->window);
+    if(s->seg[i].buf == NULL)
+    {
+      while(i > 0) free(s->seg[--i].buf);
+      __sync_fetch_and_sub(&streams.memory, size);
+      return 0;
+    }
+  }
+
+  s->reserved = size;
+
+  return 1;
+}
+
+static void xmp_stream_filled(struct xmp_uop *op)
+{
+  int res = op->res;
+  struct xmp_segment *seg = op->arg;
+  struct xmp_stream *s = seg->stream;
+
+  pthread_mutex_lock(&s->lock);
+
+  if(res >= 0 && (size_t) res < s->window) s->eof = seg->offset + res;
+
+  if(res > 0)
+  {
+    seg->size = res;
+    seg->state = SEGMENT_READY;
+    __sync_fetch_and_add(&streams.bytes, res);
+  }
+  else
+  {
+    seg->state = SEGMENT_EMPTY;
+  }
+
+  --s->pending;
+  pthread_cond_broadcast(&s->cond);
+
+  pthread_mutex_unlock(&s->lock);
+}
+
+/*
+  Runs on the readahead pool, or in the reading thread when the
+  ring is in use, as it then only waits for a free entry.
+*/
+
+static void xmp_stream_fill(void *arg)
+{
+  struct xmp_segment *seg = arg;
+  struct xmp_stream *s = seg->stream;
+
+  seg->op.fd = s->fd;
+  seg->op.index = s->index;
+  seg->op.uid = s->uid;
+  seg->op.write = 0;
+  seg->op.buf = seg->buf;
+  seg->op.size = s->window;
+  seg->op.offset = seg->offset;
+  seg->op.done = xmp_stream_filled;
+  seg->op.arg = seg;
+
+  xmp_uring_submit(&seg->op);
+}
+
+static off_t xmp_segment_end(struct xmp_stream *s, struct xmp_segment *seg)
+{
+  return seg->offset + (seg->state == SEGMENT_PENDING ? s->window : seg->size);
+}
+
+static struct xmp_segment *xmp_stream_find(struct xmp_stream *s, off_t offset)
+{
+  int i;
+  struct xmp_segment *seg;
+
+  for(i = 0; i < READAHEAD_SEGMENTS; ++i)
+  {
+    seg = &s->seg[i];
+    if(seg->state != SEGMENT_EMPTY && offset >= seg->offset &&
+      offset < xmp_segment_end(s, seg)) return seg;
+  }
+
+  return NULL;
+}
+
+/*
+  Picks a segment to fill past the end of the window, or NULL if the
+  window already reaches the end of the file or no segment is free.
+*/
+
+static struct xmp_segment *xmp_stream_schedule(struct xmp_stream *s, off_t offset)
+{
+  int i;
+  off_t end = s->next;
+  struct xmp_segment *seg, *fill = NULL;
+
+  if(s->sequential < READAHEAD_TRIGGER || !xmp_stream_reserve(s)) return NULL;
+
+  while((seg = xmp_stream_find(s, end)) != NULL)
+  {
+    end = xmp_segment_end(s, seg);
+  }
+
+  if(s->eof >= 0 && end >= s->eof) return NULL;
+
+  for(i = 0; i < READAHEAD_SEGMENTS; ++i)
+  {
+    seg = &s->seg[i];
+    if(seg->state == SEGMENT_EMPTY ||
+      (seg->state == SEGMENT_READY && xmp_segment_end(s, seg) <= offset))
+    {
+      fill = seg;
+      break;
+    }
+  }
+
+  if(fill == NULL) return NULL;
+
+  fill->offset = end;
+  fill->size = 0;
+  fill->state = SEGMENT_PENDING;
+  ++s->pending;
+
+  return fill;
+}
+
+static int xmp_stream_read(struct xmp_stream *s, char *buf, size_t size, off_t offset)
+{
+  int res;
+  size_t n, done = 0;
+  struct timespec start;
+  struct xmp_segment *seg, *fill;
+
+  pthread_mutex_lock(&s->lock);
+
+  s->sequential = offset == s->next ? s->sequential + 1 : 0;
+  s->next = offset + size;
+
+  while(size > 0 && (seg = xmp_stream_find(s, offset)) != NULL)
+  {
+    if(seg->state == SEGMENT_PENDING)
+    {
+      pthread_cond_wait(&s->cond, &s->lock);
+      continue;
+    }
+
+    n = xmp_segment_end(s, seg) - offset;
+    if(n > size) n = size;
+
+    memcpy(buf + done, seg->buf + (offset - seg->offset), n);
+
+    done += n;
+    offset += n;
+    size -= n;
+  }
+
+  fill = xmp_stream_schedule(s, offset);
+
+  pthread_mutex_unlock(&s->lock);
+
+  if(fill && uring.entries > 0) xmp_stream_fill(fill);
+  else if(fill) xmp_pool_submit(&streams.pool, xmp_stream_fill, fill);
+
+  if(size == 0)
+  {
+    __sync_fetch_and_add(&streams.hits, 1);
+    return done;
+  }
+
+  __sync_fetch_and_add(&streams.misses, 1);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = pread(s->fd, buf + done, size, offset);
+
+  xmp_stats_data(s->index, &start, res);
+
+  if(res == -1) return done > 0 ? done : -errno;
+
+  /* the file has grown since a fill hit its end */
+  pthread_mutex_lock(&s->lock);
+  if(res > 0 && s->eof >= 0 && offset + res > s->eof) s->eof = -1;
+  pthread_mutex_unlock(&s->lock);
+
+  return done + res;
+}
+
+/*
+  Tells read_buf whether the window holds the start of a read. A read
+  it does not hold is left to the library on the fd, but still counts
+  for sequential detection and may start a fill, like a miss in
+  xmp_stream_read.
+*/
+
+static int xmp_stream_serves(struct xmp_stream *s, size_t size, off_t offset)
+{
+  struct xmp_segment *fill = NULL;
+
+  pthread_mutex_lock(&s->lock);
+
+  if(xmp_stream_find(s, offset) != NULL)
+  {
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+  }
+
+  s->sequential = offset == s->next ? s->sequential + 1 : 0;
+  s->next = offset + size;
+
+  fill = xmp_stream_schedule(s, offset);
+
+  pthread_mutex_unlock(&s->lock);
+
+  if(fill && uring.entries > 0) xmp_stream_fill(fill);
+  else if(fill) xmp_pool_submit(&streams.pool, xmp_stream_fill, fill);
+
+  __sync_fetch_and_add(&streams.misses, 1);
+
+  return 0;
+}
+
+static struct xmp_behind *xmp_behind_open(int fd, int index, uid_t uid,
+  struct xmp_ofile *ofile, size_t capacity)
+{
+  struct xmp_behind *b;
+
+  b = malloc(sizeof(struct xmp_behind));
+  if(b == NULL) return NULL;
+
+  memset(b, 0, sizeof(struct xmp_behind));
+
+  b->fd = fd;
+  b->index = index;
+  b->uid = uid;
+  b->ofile = ofile;
+  b->capacity = capacity;
+
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->cond, NULL);
+
+  return b;
+}
+
+static void xmp_behind_run(struct xmp_flush *job)
+{
+  int res = 0;
+  size_t done = 0;
+  struct timespec start;
+  struct xmp_behind *b = job->behind;
+  size_t capacity = b->capacity;
+
+  while(done < job->size)
+  {
+    xmp_io_begin(b->index, b->uid);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    res = pwrite(b->fd, job->buf + done, job->size - done, job->offset + done);
+
+    xmp_stats_data(b->index, &start, res);
+
+    xmp_io_end(b->index);
+
+    if(res == -1) break;
+
+    done += res;
+  }
+
+  __sync_fetch_and_add(&writebehind.flushes, 1);
+  __sync_fetch_and_add(&writebehind.bytes, done);
+
+  xmp_ofile_touch(b->ofile);
+
+  free(job->buf);
+  free(job);
+
+  __sync_fetch_and_sub(&writebehind.memory, capacity);
+
+  /* the handle may be gone as soon as its lock is released */
+  pthread_mutex_lock(&b->lock);
+
+  if(res == -1 && b->error == 0) b->error = errno;
+
+  --b->inflight;
+  pthread_cond_broadcast(&b->cond);
+
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Runs a flush and then the flushes queued for its mount meanwhile */
+
+static void xmp_behind_flush(void *arg)
+{
+  struct xmp_flush *job = arg;
+  int index = job->behind->index;
+
+  while(job)
+  {
+    xmp_behind_run(job);
+
+    pthread_mutex_lock(&writebehind.lock);
+
+    job = writebehind.head[index];
+    if(job)
+    {
+      writebehind.head[index] = job->next;
+      if(job->next == NULL) writebehind.tail[index] = NULL;
+    }
+    else
+    {
+      --writebehind.busy[index];
+    }
+
+    pthread_mutex_unlock(&writebehind.lock);
+  }
+}
+
+static void xmp_behind_submit(struct xmp_flush *job)
+{
+  int limit;
+  int index = job->behind->index;
+
+  limit = xmp_config_enter()->flushmount;
+  xmp_config_leave();
+
+  job->next = NULL;
+
+  pthread_mutex_lock(&writebehind.lock);
+
+  if(limit > 0 && writebehind.busy[index] >= limit)
+  {
+    if(writebehind.tail[index]) writebehind.tail[index]->next = job;
+    else writebehind.head[index] = job;
+    writebehind.tail[index] = job;
+    job = NULL;
+  }
+  else
+  {
+    ++writebehind.busy[index];
+  }
+
+  pthread_mutex_unlock(&writebehind.lock);
+
+  if(job) xmp_pool_submit(&writebehind.pool, xmp_behind_flush, job);
+}
+
+/*
+  Takes the filled buffer away from the handle. Buffers of a handle
+  are written one at a time and in order, so this waits for the
+  previous one first. Called with the handle locked.
+*/
+
+static struct xmp_flush *xmp_behind_detach(struct xmp_behind *b)
+{
+  struct xmp_flush *job;
+
+  while(b->job && b->inflight > 0) pthread_cond_wait(&b->cond, &b->lock);
+
+  job = b->job;
+  if(job == NULL) return NULL;
+
+  job->size = b->size;
+
+  b->job = NULL;
+  ++b->inflight;
+
+  return job;
+}
+
+/* Queues the detached buffer, dropping the handle lock meanwhile */
+
+static void xmp_behind_queue(struct xmp_behind *b)
+{
+  struct xmp_flush *job = xmp_behind_detach(b);
+
+  if(job == NULL) return;
+
+  pthread_mutex_unlock(&b->lock);
+  xmp_behind_submit(job);
+  pthread_mutex_lock(&b->lock);
+}
+
+static int xmp_behind_reserve(struct xmp_behind *b, off_t offset)
+{
+  size_t limit;
+  struct xmp_flush *job;
+
+  limit = xmp_config_enter()->writebehindmem;
+  xmp_config_leave();
+
+  if(__sync_add_and_fetch(&writebehind.memory, b->capacity) > limit) goto fail;
+
+  job = malloc(sizeof(struct xmp_flush));
+  if(job == NULL) goto fail;
+
+  job->buf = malloc(b->capacity);
+  if(job->buf == NULL)
+  {
+    free(job);
+    goto fail;
+  }
+
+  /* buffers end on multiples of the capacity, so flushes stay aligned */
+  job->behind = b;
+  job->offset = offset;
+  job->size = 0;
+
+  b->job = job;
+  b->size = 0;
+  b->limit = b->capacity - offset % b->capacity;
+
+  return 1;
+
+fail:
+  __sync_fetch_and_sub(&writebehind.memory, b->capacity);
+  return 0;
+}
+
+/* Writes out everything buffered and returns the first flush error */
+
+static int xmp_behind_drain(struct xmp_behind *b)
+{
+  int res;
+
+  pthread_mutex_lock(&b->lock);
+
+  xmp_behind_queue(b);
+
+  while(b->inflight > 0) pthread_cond_wait(&b->cond, &b->lock);
+
+  res = -b->error;
+  b->error = 0;
+
+  pthread_mutex_unlock(&b->lock);
+
+  return res;
+}
+
+/*
+  Copies a write into the handle's buffer, queueing full buffers and
+  the buffer in front of a discontinuity. Writes of a whole buffer or
+  more, and writes over the memory budget, go straight to the file
+  once everything queued before them is written.
+*/
+
+static int xmp_behind_write(struct xmp_behind *b, const char *buf, size_t size,
+  off_t offset)
+{
+  int res;
+  size_t n, done = 0;
+  struct timespec start;
+
+  pthread_mutex_lock(&b->lock);
+
+  if(b->error)
+  {
+    res = -b->error;
+    b->error = 0;
+    pthread_mutex_unlock(&b->lock);
+    return res;
+  }
+
+  while(size > 0)
+  {
+    if(b->job && offset != b->job->offset + (off_t) b->size)
+    {
+      xmp_behind_queue(b);
+      continue;
+    }
+
+    if(b->job == NULL && (size >= b->capacity || !xmp_behind_reserve(b, offset))) break;
+
+    n = b->limit - b->size;
+    if(n > size) n = size;
+
+    memcpy(b->job->buf + b->size, buf + done, n);
+    b->size += n;
+
+    done += n;
+    offset += n;
+    size -= n;
+
+    if(b->size == b->limit) xmp_behind_queue(b);
+  }
+
+  pthread_mutex_unlock(&b->lock);
+
+  if(size == 0)
+  {
+    __sync_fetch_and_add(&writebehind.writes, 1);
+    return done;
+  }
+
+  res = xmp_behind_drain(b);
+  if(res < 0) return res;
+
+  __sync_fetch_and_add(&writebehind.bypassed, 1);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = pwrite(b->fd, buf + done, size, offset);
+
+  xmp_stats_data(b->index, &start, res);
+
+  if(res == -1) return -errno;
+
+  return done + res;
+}
+
+static void xmp_behind_close(struct xmp_behind *b)
+{
+  xmp_behind_drain(b);
+
+  pthread_mutex_destroy(&b->lock);
+  pthread_cond_destroy(&b->cond);
+  free(b);
+}
+
+static void xmp_handle_io(struct xmp_file *f, ssize_t res, int write)
+{
+  if(res <= 0) return;
+
+  if(write)
+  {
+    __sync_fetch_and_add(&f->writes, 1);
+    __sync_fetch_and_add(&f->bytes_written, res);
+  }
+  else
+  {
+    __sync_fetch_and_add(&f->reads, 1);
+    __sync_fetch_and_add(&f->bytes_read, res);
+  }
+}
+
+static int xmp_stats_open(const char *path, struct fuse_file_info *fi)
+{
+  int res;
+  struct xmp_file *f;
+
+  if(strcmp(path, STATS_DIR) == 0) return -EISDIR;
+
+  if(strcmp(path, STATS_TEXT) != 0 && strcmp(path, STATS_RAW) != 0) return -ENOENT;
+
+  if((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+  f = calloc(1, sizeof(struct xmp_file));
+  if(f == NULL) return -ENOMEM;
+
+  f->fd = -1;
+  f->index = -1;
+
+  res = xmp_stats_report(strcmp(path, STATS_RAW) == 0, &f->data, &f->size);
+  if(res < 0)
+  {
+    free(f);
+    return res;
+  }
+
+  fi->direct_io = 1;
+  fi->fh = (unsigned long) f;
+  return 0;
+}
+
+static int xmp_open_file(const char *path, struct fuse_file_info *fi,
+  struct xmp_ofile *ofile, unsigned long wopens)
+{
+  int fd;
+  int res;
+  int index;
+  int flags;
+  size_t window;
+  size_t capacity;
+  struct xmp_config *cfg;
+  struct xmp_file *f;
+  struct xmp_layout *layout;
+  struct timespec start;
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+
+  res = xmp_realpath(path, real_path, meta_path, &index);
+
+  if(res == -1) return -ENOENT;
+
+  if((res == 0 || res == -2) && xmp_mirrored(path))
+  {
+    if((fi->flags & O_ACCMODE) == O_RDONLY)
+    {
+      res = xmp_mirror_pick(path, real_path, &index, res);
+    }
+    else
+    {
+      xmp_mirror_drop(path);
+    }
+  }
+
+  if(res == -2) return -EIO;
+
+  flags = fi->flags;
+  layout = NULL;
+
+  /* appends go to the stripe that holds the end of the file */
+  if(xmp_striped(real_path)) flags &= ~O_APPEND;
+
+  xmp_setfsid();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  fd = open(real_path, flags);
+
+  xmp_stats_data(index, &start, fd);
+
+  if(fd == -1) return -errno;
+
+  if(xmp_striped(real_path))
+  {
+    layout = xmp_layout_open(path, fd, flags);
+    if(layout == NULL)
+    {
+      close(fd);
+      return -EIO;
+    }
+  }
+
+  /* a local copy is read like a meta file, outside of any data mount */
+  if((fi->flags & O_ACCMODE) == O_RDONLY && index > 0 && layout == NULL)
+  {
+    res = xmp_local_open(path, fd);
+    if(res != -1)
+    {
+      close(fd);
+      fd = res;
+      index = 0;
+    }
+  }
+
+  f = malloc(sizeof(struct xmp_file));
+  if(f == NULL)
+  {
+    if(layout) xmp_layout_close(layout);
+    close(fd);
+    return -ENOMEM;
+  }
+
+  f->fd = fd;
+  f->index = index;
+  f->uid = xmp_io_uid();
+  f->data = NULL;
+  f->size = 0;
+  f->writer = (fi->flags & O_ACCMODE) != O_RDONLY && f->index > 0;
+  f->stream = NULL;
+  f->behind = NULL;
+  f->access = fi->flags & O_ACCMODE;
+  f->reserved = 0;
+  f->adler_valid = 0;
+  f->adler = 1;
+  f->adler_pos = 0;
+  f->reads = 0;
+  f->writes = 0;
+  f->bytes_read = 0;
+  f->bytes_written = 0;
+  f->layout = layout;
+  f->ofile = ofile;
+  f->wopens = wopens;
+  f->pending = 0;
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->idle, NULL);
+
+  __sync_fetch_and_add(&handles.opened, 1);
+
+  cfg = xmp_config_enter();
+  window = cfg->readahead;
+  capacity = cfg->writebehind;
+  xmp_config_leave();
+
+  if((fi->flags & O_ACCMODE) == O_RDONLY && f->index > 0 && window > 0 &&
+     layout == NULL)
+  {
+    f->stream = xmp_stream_open(fd, index, f->uid, window);
+  }
+
+  if(f->writer && !(fi->flags & O_APPEND) && capacity > 0 && layout == NULL)
+  {
+    f->behind = xmp_behind_open(fd, index, f->uid, f->ofile, capacity);
+  }
+
+  if(f->writer)
+  {
+    __sync_fetch_and_add(&placement.writers[f->index], 1);
+    xmp_ofile_touch(f->ofile);
+
+    /* a stored checksum is stale as soon as the file is opened for writing */
+    fremovexattr(fd, ADLER_XATTR);
+
+    /* a checksum only covers what this handle wrote if no one else writes */
+    f->adler_valid = xmp_config_enter()->checksum && layout == NULL &&
+      f->wopens && ((fi->flags & O_TRUNC) || lseek(fd, 0, SEEK_END) == 0);
+    xmp_config_leave();
+  }
+
+  fi->fh = (unsigned long) f;
+  return 0;
+}
+
+/*
+  The handle is registered in the open file table before the path is
+  resolved, which waits out a move of the file to another mount.
+*/
+
+static int xmp_open(const char *path, struct fuse_file_info *fi)
+{
+  int res;
+  int writer;
+  unsigned long wopens = 0;
+  struct xmp_ofile *ofile;
+
+  if(xmp_stats_path(path)) return xmp_stats_open(path, fi);
+
+  writer = (fi->flags & O_ACCMODE) != O_RDONLY;
+
+  ofile = xmp_ofile_add(path, writer, &wopens);
+
+  res = xmp_open_file(path, fi, ofile, wopens);
+
+  if(res < 0) xmp_ofile_remove(ofile, writer);
+
+  return res;
+}
+
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+  struct fuse_file_info *fi)
+{
+  int res;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+
+  (void) path;
+
+  if(f->data)
+  {
+    if(offset >= f->size) return 0;
+    if(size > f->size - offset) size = f->size - offset;
+    memcpy(buf, f->data + offset, size);
+    return size;
+  }
+
+  if(xmp_mountdown(f->index)) return -EIO;
+
+  if(f->layout)
+  {
+    res = xmp_stripe_io(f, buf, size, offset, 0);
+    xmp_handle_io(f, res, 0);
+    return res;
+  }
+
+  if(f->stream)
+  {
+    res = xmp_stream_read(f->stream, buf, size, offset);
+    xmp_handle_io(f, res, 0);
+    return res;
+  }
+
+  if(f->behind)
+  {
+    res = xmp_behind_drain(f->behind);
+    if(res < 0) return res;
+  }
+
+  res = xmp_uring_io(f->fd, f->index, f->uid, buf, size, offset, 0);
+
+  xmp_handle_io(f, res, 0);
+
+  return res;
+}
+
+static int xmp_write(const char *path, const char *buf, size_t size,
+  off_t offset, struct fuse_file_info *fi)
+{
+  int res;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+
+  (void) path;
+
+  if(xmp_mountdown(f->index)) return -EIO;
+
+  if(f->behind)
+  {
+    res = xmp_behind_write(f->behind, buf, size, offset);
+  }
+  else if(f->layout)
+  {
+    res = xmp_stripe_io(f, (char *) buf, size, offset, 1);
+  }
+  else
+  {
+    res = xmp_uring_io(f->fd, f->index, f->uid, (char *) buf, size, offset, 1);
+  }
+
+  xmp_adler_update(f, buf, offset, res);
+
+  xmp_handle_io(f, res, 1);
+
+  if(res > 0 && f->reserved > 0) xmp_unreserve(f, res);
+
+  xmp_ofile_touch(f->ofile);
+
+  return res;
+}
+
+/*
+  The buffer variants hand the kernel fd-backed buffers, so the
+  library can splice data between /dev/fuse and the backing file
+  without copying it through user space.
+*/
+
+static int xmp_read_buf(const char *path, struct fuse_bufvec **bufp,
+  size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  int res;
+  int limit, throttled;
+  char *data;
+  struct fuse_bufvec *src;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+
+  /* memory buffers are freed after the reply, so the stats report is copied */
+  if(f->data)
+  {
+    if(offset > f->size) offset = f->size;
+    if(size > f->size - offset) size = f->size - offset;
+
+    src = malloc(sizeof(struct fuse_bufvec));
+    data = malloc(size ? size : 1);
+    if(src == NULL || data == NULL)
+    {
+      free(data);
+      free(src);
+      return -ENOMEM;
+    }
+
+    memcpy(data, f->data + offset, size);
+
+    *src = FUSE_BUFVEC_INIT(size);
+    src->buf[0].mem = data;
+    *bufp = src;
+
+    return 0;
+  }
+
+  if(xmp_mountdown(f->index)) return -EIO;
+
+  /* the library reads the fd later, so buffered writes go out first */
+  if(f->behind)
+  {
+    res = xmp_behind_drain(f->behind);
+    if(res < 0) return res;
+  }
+
+  src = malloc(sizeof(struct fuse_bufvec));
+  if(src == NULL) return -ENOMEM;
+
+  *src = FUSE_BUFVEC_INIT(size);
+
+  limit = xmp_config_enter()->iolimit;
+  xmp_config_leave();
+
+  throttled = limit > 0 && f->index > 0 && xmp_io_load(f->index) >= limit;
+
+  /*
+    Memory buffers are freed after the reply, so they always get their
+    own copy. The scheduler can only hold back reads done here, so the fd
+    is not handed to the library once the mount is at its limit, nor
+    when reads of data mounts go through the ring. Readahead only
+    copies the reads its window holds.
+  */
+  if(f->layout || throttled || (uring.entries > 0 && f->index > 0) ||
+     (f->stream && xmp_stream_serves(f->stream, size, offset)))
+  {
+    data = malloc(size);
+    res = data ? xmp_read(path, data, size, offset, fi) : -ENOMEM;
+    if(res < 0)
+    {
+      free(data);
+      free(src);
+      return res;
+    }
+    src->buf[0].mem = data;
+    src->buf[0].size = res;
+  }
+  else
+  {
+    src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src->buf[0].fd = f->fd;
+    src->buf[0].pos = offset;
+
+    /* the library reads the fd later, so the requested size is counted */
+    xmp_handle_io(f, size, 0);
+  }
+
+  *bufp = src;
+
+  return 0;
+}
+
+static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
+  off_t offset, struct fuse_file_info *fi)
+{
+  int res;
+  char *data;
+  struct timespec start;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+  (void) path;
+
+  if(xmp_mountdown(f->index)) return -EIO;
+
+  /* the checksum, write-behind, stripes and the ring need the data in memory */
+  if(f->adler_valid || f->behind || f->layout ||
+     (uring.entries > 0 && f->index > 0))
+  {
+    data = malloc(dst.buf[0].size);
+    if(data == NULL) return -ENOMEM;
+
+    dst.buf[0].mem = data;
+
+    res = fuse_buf_copy(&dst, buf, 0);
+    if(res >= 0) res = xmp_write(path, data, res, offset, fi);
+
+    free(data);
+
+    return res;
+  }
+
+  dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  dst.buf[0].fd = f->fd;
+  dst.buf[0].pos = offset;
+
+  xmp_io_begin(f->index, f->uid);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+
+  xmp_stats_data(f->index, &start, res);
+
+  xmp_io_end(f->index);
+
+  xmp_handle_io(f, res, 1);
+
+  if(res > 0 && f->reserved > 0) xmp_unreserve(f, res);
+
+  xmp_ofile_touch(f->ofile);
+
+  return res;
+}
+
+static int xmp_flush(const char *path, struct fuse_file_info *fi)
+{
+  int i;
+  int res;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+  (void) path;
+  if(f->fd == -1) return 0;
+  if(xmp_mountdown(f->index)) return -EIO;
+  if(f->behind)
+  {
+    res = xmp_behind_drain(f->behind);
+    if(res < 0) return res;
+  }
+  res = close(dup(f->fd));
+  for(i = 1; f->layout && i < f->layout->count && res == 0; ++i)
+  {
+    res = close(dup(f->layout->fds[i]));
+  }
+  if(res == -1) return -errno;
+  return 0;
+}
+
+static int xmp_release(const char *path, struct fuse_file_info *fi)
+{
+  int named;
+  char name[MAX_PATH];
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+  (void) path;
+  /* transfers still on the ring answer through the handle */
+  if(f->fd != -1)
+  {
+    pthread_mutex_lock(&f->lock);
+    while(f->pending > 0) pthread_cond_wait(&f->idle, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+  }
+  /* the file may have been renamed or unlinked since it was opened */
+  named = f->writer && xmp_ofile_path(f->ofile, name) == 0;
+  if(f->behind) xmp_behind_close(f->behind);
+  if(f->writer)
+  {
+    xmp_adler_store(f);
+    xmp_unreserve(f, LLONG_MAX);
+    __sync_fetch_and_sub(&placement.writers[f->index], 1);
+    xmp_ofile_touch(f->ofile);
+  }
+  if(f->stream) xmp_stream_close(f->stream);
+  if(f->index > 0)
+  {
+    __sync_fetch_and_add(&handles.reads[f->index], f->reads);
+    __sync_fetch_and_add(&handles.writes[f->index], f->writes);
+    __sync_fetch_and_add(&handles.bytes_read[f->index], f->bytes_read);
+    __sync_fetch_and_add(&handles.bytes_written[f->index], f->bytes_written);
+  }
+  if(named && f->layout == NULL) xmp_stripe_queue(name, f->fd);
+  if(f->layout) xmp_layout_close(f->layout);
+  if(f->fd != -1)
+  {
+    __sync_fetch_and_add(&handles.released, 1);
+    close(f->fd);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->idle);
+  }
+  if(named) xmp_mirror_queue(name);
+  xmp_ofile_remove(f->ofile, f->access != O_RDONLY);
+  free(f->data);
+  free(f);
+  return 0;
+}
+
+static int xmp_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+  int i;
+  int res;
+  struct timespec start;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+  (void) path;
+  if(f->fd == -1) return 0;
+  if(xmp_mountdown(f->index)) return -EIO;
+  if(f->behind)
+  {
+    res = xmp_behind_drain(f->behind);
+    if(res < 0) return res;
+  }
+  xmp_io_begin(f->index, f->uid);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  res = isdatasync ? fdatasync(f->fd) : fsync(f->fd);
+  xmp_stats_data(f->index, &start, res);
+  xmp_io_end(f->index);
+  for(i = 1; f->layout && i < f->layout->count && res == 0; ++i)
+  {
+    res = isdatasync ? fdatasync(f->layout->fds[i]) : fsync(f->layout->fds[i]);
+  }
+  if(res == -1) return -errno;
+  return 0;
+}
+
+/*
+  The kernel passes the handle for fstat and ftruncate on open files,
+  so these work on the descriptor and never resolve the meta symlink.
+*/
+
+static int xmp_fgetattr(const char *path, struct stat *stbuf,
+  struct fuse_file_info *fi)
+{
+  int res;
+  struct timespec start;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+
+  (void) path;
+
+  if(f->fd == -1)
+  {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_uid = fsuid;
+    stbuf->st_gid = fsgid;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = f->size;
+    return 0;
+  }
+
+  if(xmp_mountdown(f->index)) return -EIO;
+
+  /* the size has to include buffered writes */
+  if(f->behind)
+  {
+    res = xmp_behind_drain(f->behind);
+    if(res < 0) return res;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = fstat(f->fd, stbuf);
+
+  if(res == 0 && f->layout) res = xmp_layout_stat(NULL, f->layout, stbuf);
+
+  if(f->index > 0) xmp_stats_data(f->index, &start, res);
+  else xmp_stats_meta(&start, res);
+
+  if(res == -1) return -errno;
+
+  return 0;
+}
+
+static int xmp_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+  int res;
+  struct timespec start;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+
+  (void) path;
+
+  if(f->fd == -1) return -EACCES;
+
+  if(xmp_mountdown(f->index)) return -EIO;
+
+  if(f->behind)
+  {
+    res = xmp_behind_drain(f->behind);
+    if(res < 0) return res;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if(f->layout) res = xmp_layout_truncate(f->layout, size);
+  else res = ftruncate(f->fd, size);
+
+  if(f->index > 0) xmp_stats_data(f->index, &start, res);
+  else xmp_stats_meta(&start, res);
+
+  if(res == -1) return -errno;
+
+  pthread_mutex_lock(&f->lock);
+
+  /* cutting the file to zero starts the checksum over */
+  if(size == 0 && f->writer && f->wopens)
+  {
+    f->adler_valid = xmp_config_enter()->checksum;
+    xmp_config_leave();
+    f->adler = 1;
+    f->adler_pos = 0;
+  }
+  else if(size < f->adler_pos)
+  {
+    f->adler_valid = 0;
+  }
+
+  pthread_mutex_unlock(&f->lock);
+
+  xmp_ofile_touch(f->ofile);
+
+  return 0;
+}
+
+/*
+  Moves a file that is still empty to a data mount that can hold size
+  bytes. The meta symlink is swapped with a rename, and the new file
+  takes over the descriptor number, so the handle stays valid. The
+  file is left alone if its meta entry no longer leads to it.
+*/
+
+static int xmp_relocate_file(struct xmp_file *f, const char *path, off_t size)
+{
+  int fd;
+  int res;
+  int index;
+  struct stat st;
+  struct stat real_st;
+  char old_path[MAX_PATH];
+  char real_path[MAX_PATH];
+  char meta_path[MAX_PATH];
+  char temp_path[MAX_PATH + 16];
+
+  if(fstat(f->fd, &st) == -1 || st.st_size > 0 ||
+     xmp_metapath(path, meta_path) == -1) return -ENOSPC;
+
+  res = readlink(meta_path, old_path, MAX_PATH - 1);
+  if(res == -1) return -ENOSPC;
+
+  old_path[res] = '\0';
+
+  if(stat(old_path, &real_st) == -1 ||
+     real_st.st_dev != st.st_dev || real_st.st_ino != st.st_ino) return -ENOSPC;
+
+  res = xmp_makepath(path, real_path, meta_path, size, NULL);
+  if(res == -1) return -ENOSPC;
+
+  index = xmp_mountindex(real_path);
+  if(index == f->index || index == 0) return -ENOSPC;
+
+  xmp_setfsid();
+
+  fd = open(real_path, O_RDWR|O_CREAT|O_EXCL, st.st_mode & 07777);
+  if(fd == -1 && errno == ENOENT) xmp_dirindex_forget(path);
+  if(fd == -1) return -errno;
+
+  fchmod(fd, st.st_mode & 07777);
+
+  snprintf(temp_path, sizeof(temp_path), "%s.relocate", meta_path);
+
+  res = symlink(real_path, temp_path);
+  if(res == 0)
+  {
+    res = rename(temp_path, meta_path);
+    if(res == -1) unlink(temp_path);
+  }
+
+  if(res == -1 || dup2(fd, f->fd) == -1)
+  {
+    res = errno;
+    close(fd);
+    unlink(real_path);
+    return -res;
+  }
+
+  close(fd);
+  unlink(old_path);
+
+  __sync_fetch_and_sub(&placement.writers[f->index], 1);
+  __sync_fetch_and_add(&placement.writers[index], 1);
+  __sync_fetch_and_add(&placement.relocated, 1);
+
+  f->index = index;
+  if(f->behind) f->behind->index = index;
+
+  xmp_cache_invalidate(path);
+
+  return 0;
+}
+
+/*
+  Other handles of the file would keep writing to the old copy after
+  the swap, so only the sole handle on this node may move it, and new
+  opens wait until the move is done.
+*/
+
+static int xmp_relocate(struct xmp_file *f, off_t size)
+{
+  int res;
+  char path[MAX_PATH];
+
+  if(!xmp_ofile_move(f->ofile)) return -ENOSPC;
+
+  res = xmp_ofile_path(f->ofile, path);
+  if(res == 0) res = xmp_relocate_file(f, path, size);
+  else res = -ENOSPC;
+
+  xmp_ofile_moved(f->ofile);
+
+  return res;
+}
+
+/*
+  Reserves the range beyond the current end of the file before the
+  allocation is passed on. A file that is still empty moves to a
+  mount that can hold the range, any other file gets ENOSPC early.
+  The reservation stays when the data mount cannot preallocate, so
+  it still steers placement while the file is written.
+*/
+
+static int xmp_fallocate(const char *path, int mode, off_t offset,
+  off_t length, struct fuse_file_info *fi)
+{
+  int res;
+  long long need;
+  struct stat st;
+  struct timespec start;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
+
+  (void) path;
+
+  if(f->fd == -1) return -EBADF;
+  if(f->layout) return -EOPNOTSUPP;
+  if(xmp_mountdown(f->index)) return -EIO;
+
+  if(f->behind)
+  {
+    res = xmp_behind_drain(f->behind);
+    if(res < 0) return res;
+  }
+
+  if(fstat(f->fd, &st) == -1) return -errno;
+
+  need = 0;
+  if(f->writer && !(mode & FALLOC_FL_PUNCH_HOLE))
+  {
+    need = offset + length - st.st_size - f->reserved;
+  }
+
+  if(need > 0 && !xmp_reserve(f, need))
+  {
+    pthread_mutex_lock(&f->lock);
+    xmp_unreserve(f, LLONG_MAX);
+    res = xmp_relocate(f, offset + length);
+    pthread_mutex_unlock(&f->lock);
+
+    if(res < 0) return res;
+
+    need = offset + length;
+
+    if(!xmp_reserve(f, need)) return -ENOSPC;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = fallocate(f->fd, mode, offset, length);
+
+  xmp_stats_data(f->index, &start, res);
+
+  if(res == -1)
+  {
+    res = errno;
+    if(res != EOPNOTSUPP && need > 0) xmp_unreserve(f, need);
+    return -res;
+  }
+
+  if(need > 0) xmp_claim(f, need);
+
+  xmp_ofile_touch(f->ofile);
+
+  return 0;
+}
+
+static void *xmp_reload(void *arg);
+
+static void xmp_init(void *userdata, struct fuse_conn_info *conn)
+{
+  pthread_t thread;
+  struct xmp_space table[MAX_STORAGE];
+
+  (void) userdata;
+
+  if(storage->splice)
+  {
+    conn->want |= conn->capable &
+      (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  }
+
+  srandom(time(NULL) ^ getpid());
+
+  xmp_space_get(table);
+
+  xmp_pool_init(&prefetch, storage->prefetchthreads);
+  xmp_pool_init(&streams.pool, storage->readaheadthreads);
+  xmp_pool_init(&writebehind.pool, storage->flushthreads);
+  xmp_pool_init(&mirrors.pool, storage->mirrorthreads);
+
+  if(localcache.size > 0)
+  {
+    xmp_pool_init(&localcache.pool, storage->localcachethreads);
+  }
+
+  xmp_pool_init(&stripes.pool, storage->stripethreads);
+  xmp_pool_init(&stripes.convert, 1);
+  pthread_mutex_init(&stripes.lock, NULL);
+
+  /* the ring is set up once, a reload does not switch backends */
+  if(storage->iobackend == IO_URING && storage->uringentries > 0 &&
+     xmp_uring_init(storage->uringentries) == -1)
+  {
+    syslog(LOG_WARNING, "Cannot set up io_uring, using threads: %s\n", strerror(errno));
+  }
+
+  if(pthread_create(&thread, NULL, xmp_space_monitor, NULL) != 0)
+  {
+    syslog(LOG_WARNING, "Cannot start free space monitor\n");
+  }
+  else
+  {
+    pthread_detach(thread);
+  }
+
+  if(pthread_create(&thread, NULL, xmp_stripe_reaper, NULL) != 0)
+  {
+    syslog(LOG_WARNING, "Cannot start stripe reaper thread, striping disabled\n");
+  }
+  else
+  {
+    pthread_detach(thread);
+    stripes.reaping = 1;
+  }
+
+  if(pthread_create(&thread, NULL, xmp_ofile_publisher, NULL) != 0)
+  {
+    syslog(LOG_WARNING, "Cannot start open file list thread\n");
+  }
+  else
+  {
+    pthread_detach(thread);
+  }
+
+  if(pthread_create(&thread, NULL, xmp_reload, NULL) != 0)
+  {
+    syslog(LOG_WARNING, "Cannot start config reload thread\n");
+  }
+  else
+  {
+    pthread_detach(thread);
+  }
 }
-storage;
 
-static pthread_mutex_t exclusive_lock;
-static pthread_rwlock_t rw_lock;
+/*
+  Wrappers that account calls, errors and latency of each handler
+*/
 
-static int fsuid = 0;
-static int fsgid = 0;
-static char *config_file = NULL;
+#define XMP_TIMED(name, op, params, args) \
+static int name##_timed params \
+{ \
+  int res; \
+  struct timespec start; \
+  clock_gettime(CLOCK_MONOTONIC, &start); \
+  res = name args; \
+  xmp_stats_op(op, &start, res); \
+  return res; \
+}
 
-static int xmp_setfsid(void)
+XMP_TIMED(xmp_access, OP_ACCESS, (const char *path, int mask), (path, mask))
+XMP_TIMED(xmp_readlink, OP_READLINK, (const char *path, char *buf, size_t size), (path, buf, size))
+XMP_TIMED(xmp_opendir, OP_OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+XMP_TIMED(xmp_readdir, OP_READDIR, (const char *path, void *buf, xmp_fill_t filler,
+  off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+XMP_TIMED(xmp_releasedir, OP_RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+XMP_TIMED(xmp_mknod, OP_MKNOD, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+XMP_TIMED(xmp_symlink, OP_SYMLINK, (const char *from, const char *to), (from, to))
+XMP_TIMED(xmp_mkdir, OP_MKDIR, (const char *path, mode_t mode), (path, mode))
+XMP_TIMED(xmp_unlink, OP_UNLINK, (const char *path), (path))
+XMP_TIMED(xmp_rmdir, OP_RMDIR, (const char *path), (path))
+XMP_TIMED(xmp_rename, OP_RENAME, (const char *from, const char *to), (from, to))
+XMP_TIMED(xmp_chmod, OP_CHMOD, (const char *path, mode_t mode), (path, mode))
+XMP_TIMED(xmp_chown, OP_CHOWN, (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+XMP_TIMED(xmp_statfs, OP_STATFS, (const char *path, struct statvfs *stbuf), (path, stbuf))
+XMP_TIMED(xmp_utimens, OP_UTIMENS, (const char *path, const struct timespec ts[2]), (path, ts))
+XMP_TIMED(xmp_truncate, OP_TRUNCATE, (const char *path, off_t size), (path, size))
+XMP_TIMED(xmp_open, OP_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi))
+XMP_TIMED(xmp_read, OP_READ, (const char *path, char *buf, size_t size, off_t offset,
+  struct fuse_file_info *fi), (path, buf, size, offset, fi))
+XMP_TIMED(xmp_write, OP_WRITE, (const char *path, const char *buf, size_t size,
+  off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+XMP_TIMED(xmp_read_buf, OP_READ, (const char *path, struct fuse_bufvec **bufp,
+  size_t size, off_t offset, struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+XMP_TIMED(xmp_write_buf, OP_WRITE, (const char *path, struct fuse_bufvec *buf,
+  off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi))
+XMP_TIMED(xmp_flush, OP_FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi))
+XMP_TIMED(xmp_release, OP_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+XMP_TIMED(xmp_fsync, OP_FSYNC, (const char *path, int isdatasync, struct fuse_file_info *fi),
+  (path, isdatasync, fi))
+XMP_TIMED(xmp_fgetattr, OP_FGETATTR, (const char *path, struct stat *stbuf,
+  struct fuse_file_info *fi), (path, stbuf, fi))
+XMP_TIMED(xmp_ftruncate, OP_FTRUNCATE, (const char *path, off_t size,
+  struct fuse_file_info *fi), (path, size, fi))
+XMP_TIMED(xmp_getxattr, OP_GETXATTR, (const char *path, const char *name, char *value,
+  size_t size), (path, name, value, size))
+XMP_TIMED(xmp_listxattr, OP_LISTXATTR, (const char *path, char *list, size_t size),
+  (path, list, size))
+XMP_TIMED(xmp_fallocate, OP_FALLOCATE, (const char *path, int mode, off_t offset,
+  off_t length, struct fuse_file_info *fi), (path, mode, offset, length, fi))
+
+static void xmp_node_init(void)
 {
-  struct fuse_context *fc = fuse_get_context();
-  setfsuid(fc->uid);
-  setfsgid(fc->gid);
-  return 0;
+  struct xmp_node *n;
+
+  pthread_mutex_init(&nodes.lock, NULL);
+
+  n = calloc(1, sizeof(struct xmp_node));
+  if(n) n->path = strdup("/");
+  if(n == NULL || n->path == NULL)
+  {
+    perror("Cannot allocate root inode");
+    exit(-1);
+  }
+
+  n->ino = FUSE_ROOT_ID;
+  n->nlookup = 1;
+  n->slot = xmp_cache_slot(n->path);
+
+  nodes.inos[n->ino % NODE_BUCKETS] = n;
+  nodes.paths[xmp_hash(n->path) % NODE_BUCKETS] = n;
+  nodes.last = FUSE_ROOT_ID;
+  nodes.count = 1;
 }
 
-static int xmp_resetfsid(void)
+static struct xmp_node **xmp_node_find(fuse_ino_t ino)
 {
-  setfsuid(fsuid);
-  setfsgid(fsgid);
-  return 0;
+  struct xmp_node **link = &nodes.inos[ino % NODE_BUCKETS];
+
+  while(*link && (*link)->ino != ino) link = &(*link)->next_ino;
+
+  return link;
 }
 
-static void xmp_metapath(const char *path, char *meta_path)
+static struct xmp_node **xmp_node_lookup(const char *path)
 {
-  pthread_rwlock_rdlock(&rw_lock);
+  struct xmp_node **link = &nodes.paths[xmp_hash(path) % NODE_BUCKETS];
 
-  snprintf(meta_path, MAX_PATH, "%s/%s", storage.mounts[0], path);
+  while(*link && strcmp((*link)->path, path) != 0) link = &(*link)->next_path;
 
-  pthread_rwlock_unlock(&rw_lock);
+  return link;
 }
 
-static int xmp_realpath(const char *path, char *real_path, char *meta_path)
+static void xmp_node_attach(struct xmp_node *n, char *path)
 {
-  int res;
-  struct stat stbuf;
+  struct xmp_node **link = &nodes.paths[xmp_hash(path) % NODE_BUCKETS];
 
-  real_path[0] = '\0';
-  meta_path[0] = '\0';
+  n->path = path;
+  n->slot = xmp_cache_slot(path);
+  n->expires = 0;
+  n->next_path = *link;
+  *link = n;
+}
 
-  xmp_metapath(path, meta_path);
+/* The node stays known by number until the kernel forgets it */
 
-  res = lstat(meta_path, &stbuf);
+static void xmp_node_detach(struct xmp_node *n)
+{
+  struct xmp_node **link;
 
-  if(res == -1)
-    return -1;
+  if(n->path == NULL) return;
 
-  if(S_ISDIR(stbuf.st_mode)) {
-    strncpy(real_path, meta_path, MAX_PATH);
-    return 1;
-  }
-  else if(!S_ISLNK(stbuf.st_mode))
-    return 0;
+  link = &nodes.paths[xmp_hash(n->path) % NODE_BUCKETS];
+  while(*link != n) link = &(*link)->next_path;
+  *link = n->next_path;
 
-  res = readlink(meta_path, real_path, MAX_PATH - 1);
+  free(n->path);
+  n->path = NULL;
+  n->expires = 0;
+}
 
-  if(res == -1)
-    return -1;
+static void xmp_node_store(struct xmp_node *n, const struct stat *stbuf,
+  int index, unsigned int seq)
+{
+  struct xmp_config *cfg = xmp_config_enter();
 
-  real_path[res] = '\0';
+  memcpy(&n->st, stbuf, sizeof(struct stat));
+  n->index = index;
+  n->seq = seq;
+  n->generation = cfg->generation;
 
-  return 0;
+  /* directory attributes change with every entry, like in the path cache */
+  n->expires = cache.size > 0 && S_ISREG(stbuf->st_mode) ? time(NULL) + cfg->cachettl : 0;
+
+  xmp_config_leave();
 }
 
-static int xmp_makerealdir(const char *path, const char *real_prfx,
-  const char *meta_prfx, char *real_path, char *meta_path)
+/* Copies the path of an inode, fails for unknown and unlinked ones */
+
+static int xmp_node_path(fuse_ino_t ino, char *path)
 {
   int res;
-  struct stat st;
-  char *copy_ptr;
-  char *real_ptr;
-  char *meta_ptr;
-  char *curr_dir;
-  char *next_dir;
-  char copy_path[MAX_PATH + 1];
+  struct xmp_node *n;
 
-  real_path[0] = '\0';
-  meta_path[0] = '\0';
-  copy_path[MAX_PATH] = '\0';
+  pthread_mutex_lock(&nodes.lock);
 
-  res = 0;
+  n = *xmp_node_find(ino);
+  res = n == NULL ? -ESTALE : n->path == NULL ? -ENOENT : 0;
+  if(res == 0) strcpy(path, n->path);
 
-  real_ptr = real_path + sprintf(real_path, "%s", real_prfx);
-  meta_ptr = meta_path + sprintf(meta_path, "%s", meta_prfx);
+  pthread_mutex_unlock(&nodes.lock);
 
-  strncpy(copy_path, path, MAX_PATH);
-  curr_dir = strtok_r(copy_path, "/", &copy_ptr);
-  while((next_dir = strtok_r(NULL, "/", &copy_ptr)))
-  {
-    if((real_ptr - real_path + next_dir - curr_dir + 2 > MAX_PATH) ||
-       (meta_ptr - meta_path + next_dir - curr_dir + 2 > MAX_PATH))
-    {
-      res = -1;
-      break;
-    }
+  return res;
+}
 
-    real_ptr += sprintf(real_ptr, "/%s", curr_dir);
-    meta_ptr += sprintf(meta_ptr, "/%s", curr_dir);
+static int xmp_node_child(fuse_ino_t parent, const char *name, char *path)
+{
+  int res;
+  size_t size;
 
-    curr_dir = next_dir;
+  res = xmp_node_path(parent, path);
+  if(res < 0) return res;
 
-    res = access(real_path, F_OK);
-    if(res == 0) continue;
+  size = strcmp(path, "/") ? strlen(path) : 0;
 
-    res = stat(meta_path, &st);
-    if(res == -1) break;
+  if(size + strlen(name) + 2 > MAX_PATH) return -ENAMETOOLONG;
 
-    xmp_resetfsid();
+  path[size] = '/';
+  strcpy(path + size + 1, name);
 
-    res = mkdir(real_path, 0755);
-    if(res == -1) break;
+  return 0;
+}
 
-    res = chmod(real_path, st.st_mode|S_IWUSR);
-    if(res == -1) break;
+/*
+  Returns the attributes the node got at its last lookup while they
+  are valid. The node is found by path if one is given.
+*/
 
-    res = lchown(real_path, st.st_uid, st.st_gid);
-    if(res == -1) break;
-  }
+static int xmp_node_getattr(fuse_ino_t ino, const char *path, struct stat *stbuf)
+{
+  int res;
+  int index;
+  unsigned int slot;
+  unsigned int seq;
+  unsigned int generation;
+  struct xmp_node *n;
 
-  if((res == -1) ||
-     (real_ptr - real_path + strlen(curr_dir) > MAX_PATH) ||
-     (meta_ptr - meta_path + strlen(curr_dir) > MAX_PATH))
+  if(cache.size == 0) return -1;
+
+  generation = xmp_config_enter()->generation;
+  xmp_config_leave();
+
+  res = -1;
+
+  pthread_mutex_lock(&nodes.lock);
+
+  n = path ? *xmp_node_lookup(path) : *xmp_node_find(ino);
+
+  if(n && n->path && n->expires > time(NULL) && n->generation == generation)
   {
-    return -1;
+    memcpy(stbuf, &n->st, sizeof(struct stat));
+    stbuf->st_ino = n->ino;
+    index = n->index;
+    slot = n->slot;
+    seq = n->seq;
+    res = 0;
   }
 
-  real_ptr += sprintf(real_ptr, "/%s", curr_dir);
-  meta_ptr += sprintf(meta_ptr, "/%s", curr_dir);
+  pthread_mutex_unlock(&nodes.lock);
 
-  return 0;
+  if(res == 0 && (xmp_cache_seq(slot) != seq || xmp_mountdown(index))) res = -1;
+
+  if(res == 0) __sync_fetch_and_add(&nodes.hits, 1);
+
+  return res;
 }
 
-static int xmp_makepath(const char *path, char *real_path, char *meta_path)
+/* Stores the attributes unless the node was renamed in the meantime */
+
+static void xmp_node_fill(fuse_ino_t ino, const char *path,
+  const struct stat *stbuf, int index, unsigned int seq)
 {
-  int i, index, res;
-  struct statvfs stvfs;
-  fsblkcnt_t spaces[MAX_STORAGE];
+  struct xmp_node *n;
 
-  index = 0;
+  pthread_mutex_lock(&nodes.lock);
+
+  n = *xmp_node_find(ino);
+  if(n && n->path && strcmp(n->path, path) == 0) xmp_node_store(n, stbuf, index, seq);
+
+  pthread_mutex_unlock(&nodes.lock);
+}
+
+/*
+  Counts a lookup of path and returns the number of its node, which
+  the first lookup creates. With fill set, the attributes are stored
+  together with the mount and the sequence number they were read
+  under, otherwise they came from the node. Returns 0 if no node can
+  be allocated.
+*/
 
-  pthread_rwlock_rdlock(&rw_lock);
+static fuse_ino_t xmp_node_add(const char *path, const struct stat *stbuf,
+  int fill, int index, unsigned int seq)
+{
+  char *copy;
+  fuse_ino_t ino;
+  struct xmp_node *n;
+  struct xmp_node **link;
+
+  copy = NULL;
+
+  pthread_mutex_lock(&nodes.lock);
+
+  n = *xmp_node_lookup(path);
 
-  for(i = 1; i < storage.nmounts; ++i)
+  if(n == NULL)
   {
-    res = statvfs(storage.mounts[i], &stvfs);
-    if(res == 0 && stvfs.f_bavail > MIN_FREE_BLOCKS)
+    n = calloc(1, sizeof(struct xmp_node));
+    if(n) copy = strdup(path);
+    if(n && copy == NULL)
     {
-      spaces[index] = i;
-      ++index;
+      free(n);
+      n = NULL;
+    }
+    if(n)
+    {
+      n->ino = ++nodes.last;
+      link = &nodes.inos[n->ino % NODE_BUCKETS];
+      n->next_ino = *link;
+      *link = n;
+      xmp_node_attach(n, copy);
+      ++nodes.count;
+      fill = 1;
     }
   }
 
-  if(index == 0)
+  ino = 0;
+
+  if(n)
   {
-    pthread_rwlock_unlock(&rw_lock);
-    return -1;
+    ++n->nlookup;
+    if(fill) xmp_node_store(n, stbuf, index, seq);
+    ino = n->ino;
   }
 
-  index = spaces[time(NULL) % index];
-
-  res = xmp_makerealdir(path, storage.mounts[index], storage.mounts[0], real_path, meta_path);
+  pthread_mutex_unlock(&nodes.lock);
 
-  pthread_rwlock_unlock(&rw_lock);
-
-  return res;
+  return ino;
 }
 
-static int xmp_getattr(const char *path, struct stat *stbuf)
+static void xmp_node_forget(fuse_ino_t ino, unsigned long nlookup)
 {
-  int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  struct xmp_node *n;
+  struct xmp_node **link;
 
-  res = xmp_realpath(path, real_path, meta_path);
+  pthread_mutex_lock(&nodes.lock);
 
-  if(res == -1) return -ENOENT;
+  link = xmp_node_find(ino);
+  n = *link;
 
-  res = lstat(real_path, stbuf);
+  if(n && n->ino != FUSE_ROOT_ID)
+  {
+    n->nlookup -= nlookup < n->nlookup ? nlookup : n->nlookup;
+    if(n->nlookup == 0)
+    {
+      *link = n->next_ino;
+      xmp_node_detach(n);
+      free(n);
+      --nodes.count;
+      ++nodes.forgotten;
+    }
+  }
 
-  if(res == -1) return -errno;
+  pthread_mutex_unlock(&nodes.lock);
+}
 
-  return 0;
+static void xmp_node_unlink(const char *path)
+{
+  struct xmp_node *n;
+
+  pthread_mutex_lock(&nodes.lock);
+  n = *xmp_node_lookup(path);
+  if(n) xmp_node_detach(n);
+  pthread_mutex_unlock(&nodes.lock);
 }
 
-static int xmp_access(const char *path, int mask)
+/*
+  Moves the node of a renamed file to its new path. Directories are
+  never renamed, so no node below the old path has to follow.
+*/
+
+static void xmp_node_rename(const char *from, const char *to)
 {
-  int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  char *copy;
+  struct xmp_node *n;
 
-  res = xmp_realpath(path, real_path, meta_path);
+  copy = strdup(to);
 
-  if(res == -1) return -ENOENT;
+  pthread_mutex_lock(&nodes.lock);
 
-  res = access(real_path, mask);
+  /* the kernel keeps the inode of a replaced target until it forgets it */
+  n = *xmp_node_lookup(to);
+  if(n) xmp_node_detach(n);
 
-  if(res == -1) return -errno;
+  n = *xmp_node_lookup(from);
+  if(n) xmp_node_detach(n);
 
-  return 0;
+  if(n && copy)
+  {
+    xmp_node_attach(n, copy);
+    copy = NULL;
+  }
+
+  pthread_mutex_unlock(&nodes.lock);
+
+  free(copy);
 }
 
-static int xmp_readlink(const char *path, char *buf, size_t size)
+static struct fuse_lowlevel_ops xmp_oper;
+
+/*
+  Low-level handlers. Each one turns the inode into the path its node
+  keeps and calls the path handler above, so the kernel never waits
+  for the library to rebuild a path from the parent inodes.
+*/
+
+static void xmp_ll_entry(fuse_req_t req, const char *path,
+  const struct stat *stbuf, int fill, int index, unsigned int seq)
 {
-  int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  struct fuse_entry_param e;
 
-  res = xmp_realpath(path, real_path, meta_path);
+  memset(&e, 0, sizeof(e));
 
-  if(res == -1) return -ENOENT;
+  e.ino = xmp_node_add(path, stbuf, fill, index, seq);
 
-  res = readlink(real_path, buf, size - 1);
+  if(e.ino == 0)
+  {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
 
-  if(res == -1) return -errno;
+  e.attr = *stbuf;
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = ATTR_TIMEOUT;
+  e.entry_timeout = ENTRY_TIMEOUT;
 
-  buf[res] = '\0';
-  return 0;
+  /* the kernel never saw an interrupted reply, so it will not forget it */
+  if(fuse_reply_entry(req, &e) == -ENOENT) xmp_node_forget(e.ino, 1);
 }
 
-struct xmp_dirp
-{
-  DIR *dp;
-  struct dirent *entry;
-  off_t offset;
-};
+/* Replies to a request that created path with the new entry */
 
-static int xmp_opendir(const char *path, struct fuse_file_info *fi)
+static void xmp_ll_created(fuse_req_t req, const char *path, int res)
 {
-  DIR *dp;
-  struct xmp_dirp *d;
-  char meta_path[MAX_PATH];
-
-  xmp_metapath(path, meta_path);
-
-  dp = opendir(meta_path);
+  int index;
+  unsigned int seq;
+  struct stat st;
 
-  if(dp == NULL) return -errno;
+  if(res == 0) res = xmp_getattr(path, &st, &index, &seq);
 
-  d = malloc(sizeof(struct xmp_dirp));
-  if(d == NULL)
+  if(res < 0)
   {
-    closedir(dp);
-    return -ENOMEM;
+    fuse_reply_err(req, -res);
+    return;
   }
 
-  d->dp = dp;
-  d->entry = NULL;
-  d->offset = 0;
-
-  fi->fh = (unsigned long) d;
-  return 0;
+  xmp_ll_entry(req, path, &st, 1, index, seq);
 }
 
-static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-  off_t offset, struct fuse_file_info *fi)
+static void xmp_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+  int res;
+  int index;
+  unsigned int seq;
   struct stat st;
-  off_t nextoff;
-  struct xmp_dirp *d = (struct xmp_dirp *) (uintptr_t) fi->fh;
+  struct timespec start;
+  char path[MAX_PATH];
 
-  (void) path;
+  request = req;
 
-  if(offset != d->offset)
-  {
-    seekdir(d->dp, offset);
-    d->entry = NULL;
-    d->offset = offset;
-  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  while (1)
+  res = xmp_node_child(parent, name, path);
+
+  if(res == 0 && xmp_node_getattr(0, path, &st) == 0)
   {
-    if(!d->entry)
-    {
-      d->entry = readdir(d->dp);
-      if(!d->entry) break;
-    }
+    xmp_stats_op(OP_LOOKUP, &start, 0);
+    xmp_ll_entry(req, path, &st, 0, 0, 0);
+    return;
+  }
 
-    memset(&st, 0, sizeof(st));
-    st.st_ino = d->entry->d_ino;
-    st.st_mode = d->entry->d_type << 12;
-    nextoff = telldir(d->dp);
+  if(res == 0) res = xmp_getattr(path, &st, &index, &seq);
 
-    if(filler(buf, d->entry->d_name, &st, nextoff)) break;
+  xmp_stats_op(OP_LOOKUP, &start, res);
 
-    d->entry = NULL;
-    d->offset = nextoff;
+  if(res < 0)
+  {
+    fuse_reply_err(req, -res);
+    return;
   }
 
-  return 0;
+  xmp_ll_entry(req, path, &st, 1, index, seq);
+}
 
+static void xmp_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  xmp_node_forget(ino, nlookup);
+  fuse_reply_none(req);
 }
 
-static int xmp_releasedir(const char *path, struct fuse_file_info *fi)
+static void xmp_ll_forget_multi(fuse_req_t req, size_t count,
+  struct fuse_forget_data *forgets)
 {
-  struct xmp_dirp *d = (struct xmp_dirp *) (uintptr_t) fi->fh;
-  (void) path;
-  closedir(d->dp);
-  free(d);
-  return 0;
+  size_t i;
+
+  for(i = 0; i < count; ++i)
+  {
+    xmp_node_forget(forgets[i].ino, forgets[i].nlookup);
+  }
+
+  fuse_reply_none(req);
 }
 
-static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
+/* The kernel passes the handle of an open file, which needs no path */
+
+static void xmp_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
   int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
-
-  res = xmp_makepath(path, real_path, meta_path);
+  int index;
+  unsigned int seq;
+  struct stat st;
+  struct timespec start;
+  char path[MAX_PATH];
 
-  if(res == -1) return -ENOSPC;
+  request = req;
 
-  xmp_setfsid();
+  if(fi)
+  {
+    res = xmp_fgetattr_timed(NULL, &st, fi);
+  }
+  else
+  {
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-  res = mknod(real_path, mode|S_IWUSR, rdev);
+    res = xmp_node_getattr(ino, NULL, &st);
 
-  if(res == -1) return -errno;
+    if(res < 0)
+    {
+      res = xmp_node_path(ino, path);
+      if(res == 0) res = xmp_getattr(path, &st, &index, &seq);
+      if(res == 0) xmp_node_fill(ino, path, &st, index, seq);
+    }
 
-  res = symlink(real_path, meta_path);
+    xmp_stats_op(OP_GETATTR, &start, res);
+  }
 
-  if(res == -1) return -errno;
+  if(res < 0)
+  {
+    fuse_reply_err(req, -res);
+    return;
+  }
 
-  return 0;
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
 }
 
-static int xmp_symlink(const char *from, const char *to)
+static void xmp_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+  int to_set, struct fuse_file_info *fi)
 {
   int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  int named;
+  int index;
+  unsigned int seq;
+  struct stat st;
+  struct timespec ts[2];
+  char path[MAX_PATH];
 
-  res = xmp_makepath(to, real_path, meta_path);
+  request = req;
 
-  if(res == -1) return -ENOSPC;
+  /* an open file can still be cut after it was unlinked */
+  named = xmp_node_path(ino, path);
+  res = (to_set & ~FUSE_SET_ATTR_SIZE) || fi == NULL ? named : 0;
 
-  xmp_setfsid();
+  if(res == 0 && (to_set & FUSE_SET_ATTR_MODE))
+  {
+    res = xmp_chmod_timed(path, attr->st_mode);
+  }
 
-  res = symlink(from, real_path);
+  if(res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+  {
+    res = xmp_chown_timed(path,
+      to_set & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t) -1,
+      to_set & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t) -1);
+  }
 
-  if(res == -1) return -errno;
+  if(res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+  {
+    res = fi ? xmp_ftruncate_timed(NULL, attr->st_size, fi) :
+      xmp_truncate_timed(path, attr->st_size);
+  }
 
-  res = symlink(real_path, meta_path);
+  if(res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+  {
+    ts[0] = attr->st_atim;
+    ts[1] = attr->st_mtim;
+    if(to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+    else if(!(to_set & FUSE_SET_ATTR_ATIME)) ts[0].tv_nsec = UTIME_OMIT;
+    if(to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+    else if(!(to_set & FUSE_SET_ATTR_MTIME)) ts[1].tv_nsec = UTIME_OMIT;
+    res = xmp_utimens_timed(path, ts);
+  }
 
-  if(res == -1) return -errno;
+  if(res == 0)
+  {
+    if(fi) res = xmp_fgetattr_timed(NULL, &st, fi);
+    else res = xmp_getattr(path, &st, &index, &seq);
+    if(res == 0 && fi == NULL) xmp_node_fill(ino, path, &st, index, seq);
+  }
 
-  return 0;
+  if(res < 0)
+  {
+    fuse_reply_err(req, -res);
+    return;
+  }
+
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
 }
 
-static int xmp_mkdir(const char *path, mode_t mode)
+static void xmp_ll_readlink(fuse_req_t req, fuse_ino_t ino)
 {
   int res;
-  char meta_path[MAX_PATH];
-
-  xmp_metapath(path, meta_path);
-
-  xmp_setfsid();
+  char path[MAX_PATH];
+  char link[PATH_MAX + 1];
 
-  res = mkdir(meta_path, mode|S_IWUSR);
+  request = req;
 
-  if(res == -1) return -errno;
+  res = xmp_node_path(ino, path);
+  if(res == 0) res = xmp_readlink_timed(path, link, sizeof(link));
 
-  return 0;
+  if(res < 0) fuse_reply_err(req, -res);
+  else fuse_reply_readlink(req, link);
 }
 
-static int xmp_unlink(const char *path)
+static void xmp_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+  mode_t mode, dev_t rdev)
 {
   int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  char path[MAX_PATH];
 
-  res = xmp_realpath(path, real_path, meta_path);
-
-  if(res == -1) return -ENOENT;
+  request = req;
 
-  xmp_setfsid();
+  res = xmp_node_child(parent, name, path);
+  if(res == 0) res = xmp_mknod_timed(path, mode, rdev);
 
-  res = unlink(real_path);
+  xmp_ll_created(req, path, res);
+}
 
-  if(res == -1) return -errno;
+static void xmp_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+  mode_t mode)
+{
+  int res;
+  char path[MAX_PATH];
 
-  res = unlink(meta_path);
+  request = req;
 
-  if(res == -1) return -errno;
+  res = xmp_node_child(parent, name, path);
+  if(res == 0) res = xmp_mkdir_timed(path, mode);
 
-  return 0;
+  xmp_ll_created(req, path, res);
 }
 
-static int xmp_rmdir(const char *path)
+static void xmp_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+  const char *name)
 {
   int res;
-  int i;
-  char dir_path[MAX_PATH];
-
-  res = 0;
-
-  xmp_setfsid();
+  char path[MAX_PATH];
 
-  pthread_rwlock_rdlock(&rw_lock);
+  request = req;
 
-  for(i = storage.nmounts - 1; i >= 0; --i)
-  {
-    snprintf(dir_path, MAX_PATH, "%s/%s", storage.mounts[i], path);
-    res = access(dir_path, F_OK);
+  res = xmp_node_child(parent, name, path);
+  if(res == 0) res = xmp_symlink_timed(link, path);
 
-    if(res == -1)
-    {
-      res = 0;
-      continue;
-    }
-    res = rmdir(dir_path);
+  xmp_ll_created(req, path, res);
+}
 
-    if(res == -1) break;
-  }
+static void xmp_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  int res;
+  char path[MAX_PATH];
 
-  pthread_rwlock_unlock(&rw_lock);
+  request = req;
 
-  if(res == -1) return -errno;
+  res = xmp_node_child(parent, name, path);
+  if(res == 0) res = xmp_unlink_timed(path);
+  if(res == 0) xmp_node_unlink(path);
 
-  return 0;
+  fuse_reply_err(req, -res);
 }
 
-static int xmp_rename(const char *from, const char *to)
+static void xmp_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
   int res;
-  char *real_ptr;
-  char *meta_ptr;
-  char real_to[MAX_PATH];
-  char meta_to[MAX_PATH];
-  char real_prfx[MAX_PATH];
-  char meta_prfx[MAX_PATH];
-  char real_from[MAX_PATH];
-  char meta_from[MAX_PATH];
-
-  res = xmp_realpath(from, real_from, meta_from);
+  char path[MAX_PATH];
 
-  if(res == -1) return -ENOENT;
-
-  if(res == 1) return -EISDIR;
+  request = req;
 
-  res = xmp_realpath(to, real_to, meta_to);
+  res = xmp_node_child(parent, name, path);
+  if(res == 0) res = xmp_rmdir_timed(path);
+  if(res == 0) xmp_node_unlink(path);
 
-  xmp_setfsid();
+  fuse_reply_err(req, -res);
+}
 
-  if(res == 0)
-  {
-    res = unlink(real_to);
+static void xmp_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+  fuse_ino_t newparent, const char *newname)
+{
+  int res;
+  char from[MAX_PATH];
+  char to[MAX_PATH];
 
-    if(res == -1) return -errno;
+  request = req;
 
-    res = unlink(meta_to);
-  }
+  res = xmp_node_child(parent, name, from);
+  if(res == 0) res = xmp_node_child(newparent, newname, to);
+  if(res == 0) res = xmp_rename_timed(from, to);
+  if(res == 0) xmp_node_rename(from, to);
 
-  strncpy(real_prfx, real_from, MAX_PATH);
-  real_ptr = strstr(real_prfx, from);
-  *real_ptr = '\0';
+  fuse_reply_err(req, -res);
+}
 
-  strncpy(meta_prfx, meta_from, MAX_PATH);
-  meta_ptr = strstr(meta_prfx, from);
-  *meta_ptr = '\0';
+static void xmp_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  int res;
+  char path[MAX_PATH];
 
-  res = xmp_makerealdir(to, real_prfx, meta_prfx, real_to, meta_to);
+  request = req;
 
-  res = rename(real_from, real_to);
-  if(res == -1) return -errno;
+  res = xmp_node_path(ino, path);
+  if(res == 0) res = xmp_open_timed(path, fi);
 
-  res = unlink(meta_from);
-  if(res == -1) return -errno;
+  if(res < 0)
+  {
+    fuse_reply_err(req, -res);
+    return;
+  }
 
-  res = symlink(real_to, meta_to);
-  if(res == -1) return -errno;
+  if(direct_io) fi->direct_io = 1;
 
-  return 0;
+  if(fuse_reply_open(req, fi) == -ENOENT) xmp_release_timed(NULL, fi);
 }
 
-static int xmp_chmod(const char *path, mode_t mode)
-{
-  int i;
-  int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+/*
+  Plain transfers of data mounts are answered by the ring's completion
+  thread, so the worker only queues them and takes the next request.
+  Write data is copied, since the library reuses its buffer once the
+  handler returns, and release waits until the handle has nothing
+  left on the ring.
+*/
 
-  res = xmp_realpath(path, real_path, meta_path);
+struct xmp_aio
+{
+  struct xmp_uop op;
+  fuse_req_t req;
+  struct xmp_file *f;
+  struct timespec start;
+  char data[];
+};
 
-  if(res == -1) return -ENOENT;
+static int xmp_aio_ready(struct xmp_file *f, int write)
+{
+  return uring.entries > 0 && f->index > 0 && f->fd != -1 && !f->layout &&
+    !f->behind && (write || !f->stream) && !xmp_mountdown(f->index);
+}
 
-  xmp_setfsid();
+static void xmp_aio_done(struct xmp_uop *op)
+{
+  struct xmp_aio *a = op->arg;
+  struct xmp_file *f = a->f;
 
-  if(res == 1)
+  if(op->write)
   {
-    pthread_rwlock_rdlock(&rw_lock);
-    for(i = storage.nmounts - 1; i >= 0; --i)
-    {
-      snprintf(meta_path, MAX_PATH, "%s/%s", storage.mounts[i], path);
-      if(access(meta_path, F_OK) == 0)
-      {
-        res = chmod(meta_path, mode);
-        if(res == -1) break;
-      }
-
-    }
-    pthread_rwlock_unlock(&rw_lock);
+    xmp_adler_update(f, a->data, op->offset, op->res);
+    xmp_handle_io(f, op->res, 1);
+    if(op->res > 0 && f->reserved > 0) xmp_unreserve(f, op->res);
+    xmp_ofile_touch(f->ofile);
   }
   else
   {
-    res = chmod(real_path, mode);
+    xmp_handle_io(f, op->res, 0);
   }
 
-  if(res == -1) return -errno;
+  xmp_stats_op(op->write ? OP_WRITE : OP_READ, &a->start, op->res);
 
-  return 0;
+  if(op->res < 0) fuse_reply_err(a->req, -op->res);
+  else if(op->write) fuse_reply_write(a->req, op->res);
+  else fuse_reply_buf(a->req, a->data, op->res);
+
+  free(a);
+
+  /* release may free the handle once the count drops */
+  pthread_mutex_lock(&f->lock);
+  if(--f->pending == 0) pthread_cond_broadcast(&f->idle);
+  pthread_mutex_unlock(&f->lock);
 }
 
-static int xmp_chown(const char *path, uid_t uid, gid_t gid)
+static struct xmp_aio *xmp_aio_new(fuse_req_t req, struct xmp_file *f,
+  size_t size, off_t offset, int write)
+{
+  struct xmp_aio *a;
+
+  a = malloc(sizeof(struct xmp_aio) + (size ? size : 1));
+  if(a == NULL) return NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &a->start);
+
+  a->req = req;
+  a->f = f;
+  a->op.fd = f->fd;
+  a->op.index = f->index;
+  a->op.uid = f->uid;
+  a->op.write = write;
+  a->op.buf = a->data;
+  a->op.size = size;
+  a->op.offset = offset;
+  a->op.done = xmp_aio_done;
+  a->op.arg = a;
+
+  return a;
+}
+
+static void xmp_aio_submit(struct xmp_aio *a)
+{
+  pthread_mutex_lock(&a->f->lock);
+  ++a->f->pending;
+  pthread_mutex_unlock(&a->f->lock);
+
+  xmp_uring_submit(&a->op);
+}
+
+/*
+  With splice enabled, the reply gets the buffers of xmp_read_buf,
+  which may leave the read of the backing file to the library.
+*/
+
+static void xmp_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+  off_t off, struct fuse_file_info *fi)
 {
-  int i;
   int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  char *buf;
+  struct xmp_aio *a;
+  struct fuse_bufvec *bufv;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
 
-  res = xmp_realpath(path, real_path, meta_path);
+  (void) ino;
 
-  if(res == -1) return -ENOENT;
+  request = req;
 
-  xmp_setfsid();
+  if(xmp_aio_ready(f, 0) && (a = xmp_aio_new(req, f, size, off, 0)))
+  {
+    xmp_aio_submit(a);
+    return;
+  }
 
-  if(res == 1)
+  if(xmp_oper.write_buf)
   {
-    pthread_rwlock_rdlock(&rw_lock);
-    for(i = storage.nmounts - 1; i >= 0; --i)
-    {
-      snprintf(meta_path, MAX_PATH, "%s/%s", storage.mounts[i], path);
-      if(access(meta_path, F_OK) == 0)
-      {
-        res = lchown(meta_path, uid, gid);
-        if(res == -1) break;
-      }
+    res = xmp_read_buf_timed(NULL, &bufv, size, off, fi);
 
+    if(res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
     }
-    pthread_rwlock_unlock(&rw_lock);
 
-  }
-  else
-  {
-    res = lchown(real_path, uid, gid);
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+
+    if(!(bufv->buf[0].flags & FUSE_BUF_IS_FD)) free(bufv->buf[0].mem);
+    free(bufv);
+
+    return;
   }
 
-  if(res == -1) return -errno;
+  buf = malloc(size ? size : 1);
+  res = buf ? xmp_read_timed(NULL, buf, size, off, fi) : -ENOMEM;
 
-  return 0;
+  if(res < 0) fuse_reply_err(req, -res);
+  else fuse_reply_buf(req, buf, res);
+
+  free(buf);
 }
 
-static int xmp_statfs(const char *path, struct statvfs *stbuf)
+static void xmp_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+  size_t size, off_t off, struct fuse_file_info *fi)
 {
-  struct statvfs st;
-  int bfac;
-  int i;
   int res;
-  int ret = -1;
-
-  (void) path;
+  struct xmp_aio *a;
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
 
-  pthread_rwlock_rdlock(&rw_lock);
+  (void) ino;
 
-  stbuf->f_namemax = 0;
-  stbuf->f_bsize   = 0;
-  stbuf->f_blocks  = 0;
-  stbuf->f_bavail  = 0;
-  stbuf->f_bfree   = 0;
-  stbuf->f_files   = 0;
-  stbuf->f_ffree   = 0;
+  request = req;
 
-  for(i = 1; i < storage.nmounts; ++i)
+  if(xmp_aio_ready(f, 1) && (a = xmp_aio_new(req, f, size, off, 1)))
   {
-    res = statvfs(storage.mounts[i], &st);
-
-    if(res == -1) continue;
-
-    if(st.f_bsize != 1048576)
-    {
-      if(st.f_bsize == 0) continue;
+    memcpy(a->data, buf, size);
+    xmp_aio_submit(a);
+    return;
+  }
 
-      bfac = 1048576 / st.f_bsize;
+  res = xmp_write_timed(NULL, buf, size, off, fi);
 
-      if(bfac == 0) continue;
+  if(res < 0) fuse_reply_err(req, -res);
+  else fuse_reply_write(req, res);
+}
 
-      st.f_blocks /= bfac;
-      st.f_bavail /= bfac;
-      st.f_bfree  /= bfac;
+static void xmp_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+  struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+  int res;
+  struct xmp_aio *a;
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+  struct xmp_file *f = (struct xmp_file *) (uintptr_t) fi->fh;
 
-      st.f_bsize = 1048576;
-    }
+  (void) ino;
 
-    stbuf->f_blocks += st.f_blocks;
-    stbuf->f_bavail += st.f_bavail;
-    stbuf->f_bfree  += st.f_bfree;
-    stbuf->f_files  += st.f_files;
-    stbuf->f_ffree  += st.f_ffree;
+  request = req;
 
-    if(stbuf->f_namemax == 0)
+  if(xmp_aio_ready(f, 1) && (a = xmp_aio_new(req, f, dst.buf[0].size, off, 1)))
+  {
+    dst.buf[0].mem = a->data;
+    res = fuse_buf_copy(&dst, bufv, 0);
+    if(res < 0)
     {
-      stbuf->f_namemax = st.f_namemax;
-      stbuf->f_bsize = st.f_bsize;
+      free(a);
+      fuse_reply_err(req, -res);
+      return;
     }
-
-    ret = 0;
+    a->op.size = res;
+    xmp_aio_submit(a);
+    return;
   }
 
-  pthread_rwlock_unlock(&rw_lock);
+  res = xmp_write_buf_timed(NULL, bufv, off, fi);
 
-  return ret;
+  if(res < 0) fuse_reply_err(req, -res);
+  else fuse_reply_write(req, res);
 }
 
-static int xmp_utimens(const char *path, const struct timespec ts[2])
+static void xmp_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  (void) ino;
+  request = req;
+  fuse_reply_err(req, -xmp_flush_timed(NULL, fi));
+}
+
+static void xmp_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  (void) ino;
+  request = req;
+  fuse_reply_err(req, -xmp_release_timed(NULL, fi));
+}
+
+static void xmp_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+  struct fuse_file_info *fi)
+{
+  (void) ino;
+  request = req;
+  fuse_reply_err(req, -xmp_fsync_timed(NULL, datasync, fi));
+}
+
+static void xmp_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+  off_t offset, off_t length, struct fuse_file_info *fi)
+{
+  (void) ino;
+  request = req;
+  fuse_reply_err(req, -xmp_fallocate_timed(NULL, mode, offset, length, fi));
+}
+
+static void xmp_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
   int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  char path[MAX_PATH];
 
-  res = xmp_realpath(path, real_path, meta_path);
+  request = req;
 
-  if(res == -1) return -ENOENT;
+  res = xmp_node_path(ino, path);
+  if(res == 0) res = xmp_opendir_timed(path, fi);
 
-  xmp_setfsid();
+  if(res < 0)
+  {
+    fuse_reply_err(req, -res);
+    return;
+  }
 
-  res = utimensat(0, real_path, ts, AT_SYMLINK_NOFOLLOW);
+  if(fuse_reply_open(req, fi) == -ENOENT) xmp_releasedir_timed(NULL, fi);
+}
 
-  if(res == -1) return -errno;
+struct xmp_dirbuf
+{
+  fuse_req_t req;
+  char *data;
+  size_t size;
+  size_t used;
+};
+
+static int xmp_ll_fill(void *buf, const char *name, const struct stat *stbuf,
+  off_t off)
+{
+  size_t size;
+  struct xmp_dirbuf *b = buf;
+
+  size = fuse_add_direntry(b->req, b->data + b->used, b->size - b->used,
+    name, stbuf, off);
 
+  if(size > b->size - b->used) return 1;
+
+  b->used += size;
   return 0;
 }
 
-static int xmp_open(const char *path, struct fuse_file_info *fi)
+static void xmp_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+  off_t off, struct fuse_file_info *fi)
 {
-  int fd;
   int res;
-  char real_path[MAX_PATH];
-  char meta_path[MAX_PATH];
+  struct xmp_dirbuf b;
 
-  res = xmp_realpath(path, real_path, meta_path);
+  (void) ino;
 
-  if(res == -1) return -ENOENT;
+  request = req;
 
-  xmp_setfsid();
+  b.req = req;
+  b.data = malloc(size);
+  b.size = size;
+  b.used = 0;
 
-  fd = open(real_path, fi->flags);
+  res = b.data ? xmp_readdir_timed(NULL, &b, xmp_ll_fill, off, fi) : -ENOMEM;
 
-  if(fd == -1) return -errno;
+  if(res < 0) fuse_reply_err(req, -res);
+  else fuse_reply_buf(req, b.data, b.used);
 
-  fi->fh = fd;
-  return 0;
+  free(b.data);
 }
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+static void xmp_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
   struct fuse_file_info *fi)
+{
+  (void) ino;
+  request = req;
+  fuse_reply_err(req, -xmp_releasedir_timed(NULL, fi));
+}
+
+static void xmp_ll_statfs(fuse_req_t req, fuse_ino_t ino)
 {
   int res;
+  struct statvfs st;
 
-  (void) path;
-  res = pread(fi->fh, buf, size, offset);
-  if(res == -1) res = -errno;
+  (void) ino;
 
-  return res;
+  request = req;
+
+  res = xmp_statfs_timed("/", &st);
+
+  if(res < 0) fuse_reply_err(req, -res);
+  else fuse_reply_statfs(req, &st);
 }
 
-static int xmp_write(const char *path, const char *buf, size_t size,
-  off_t offset, struct fuse_file_info *fi)
+static void xmp_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+  size_t size)
 {
   int res;
+  char *value;
+  char path[MAX_PATH];
 
-  (void) path;
-  res = pwrite(fi->fh, buf, size, offset);
-  if(res == -1) res = -errno;
+  request = req;
 
-  return res;
+  value = NULL;
+
+  res = xmp_node_path(ino, path);
+  if(res == 0 && size > 0 && (value = malloc(size)) == NULL) res = -ENOMEM;
+  if(res == 0) res = xmp_getxattr_timed(path, name, value, size);
+
+  if(res < 0) fuse_reply_err(req, -res);
+  else if(size == 0) fuse_reply_xattr(req, res);
+  else fuse_reply_buf(req, value, res);
+
+  free(value);
 }
 
-static int xmp_flush(const char *path, struct fuse_file_info *fi)
+static void xmp_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
   int res;
-  (void) path;
-  res = close(dup(fi->fh));
-  if(res == -1) return -errno;
-  return 0;
-}
+  char *list;
+  char path[MAX_PATH];
 
-static int xmp_release(const char *path, struct fuse_file_info *fi)
-{
-  (void) path;
-  close(fi->fh);
-  return 0;
+  request = req;
+
+  list = NULL;
+
+  res = xmp_node_path(ino, path);
+  if(res == 0 && size > 0 && (list = malloc(size)) == NULL) res = -ENOMEM;
+  if(res == 0) res = xmp_listxattr_timed(path, list, size);
+
+  if(res < 0) fuse_reply_err(req, -res);
+  else if(size == 0) fuse_reply_xattr(req, res);
+  else fuse_reply_buf(req, list, res);
+
+  free(list);
 }
 
-static int xmp_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+static void xmp_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
   int res;
-  (void) path;
-  res = isdatasync ? fdatasync(fi->fh) : fsync(fi->fh);
-  if(res == -1) return -errno;
-  return 0;
+  char path[MAX_PATH];
+
+  request = req;
+
+  res = xmp_node_path(ino, path);
+  if(res == 0) res = xmp_access_timed(path, mask);
+
+  fuse_reply_err(req, -res);
 }
 
-static struct fuse_operations xmp_oper = {
-  .getattr    = xmp_getattr,
-  .access     = xmp_access,
-  .readlink   = xmp_readlink,
-  .opendir    = xmp_opendir,
-  .readdir    = xmp_readdir,
-  .releasedir = xmp_releasedir,
-  .mknod      = xmp_mknod,
-  .symlink    = xmp_symlink,
-  .mkdir      = xmp_mkdir,
-  .unlink     = xmp_unlink,
-  .rmdir      = xmp_rmdir,
-  .rename     = xmp_rename,
-  .chmod      = xmp_chmod,
-  .chown      = xmp_chown,
-  .statfs     = xmp_statfs,
-  .utimens    = xmp_utimens,
-  .open       = xmp_open,
-  .read       = xmp_read,
-  .write      = xmp_write,
-  .flush      = xmp_flush,
-  .release    = xmp_release,
-  .fsync      = xmp_fsync
-};
-
-static int get_config(const char *cfile)
+static struct fuse_lowlevel_ops xmp_oper = {
+  .init         = xmp_init,
+  .lookup       = xmp_ll_lookup,
+  .forget       = xmp_ll_forget,
+  .forget_multi = xmp_ll_forget_multi,
+  .getattr      = xmp_ll_getattr,
+  .setattr      = xmp_ll_setattr,
+  .readlink     = xmp_ll_readlink,
+  .mknod        = xmp_ll_mknod,
+  .mkdir        = xmp_ll_mkdir,
+  .symlink      = xmp_ll_symlink,
+  .unlink       = xmp_ll_unlink,
+  .rmdir        = xmp_ll_rmdir,
+  .rename       = xmp_ll_rename,
+  .open         = xmp_ll_open,
+  .read         = xmp_ll_read,
+  .write        = xmp_ll_write,
+  .write_buf    = xmp_ll_write_buf,
+  .flush        = xmp_ll_flush,
+  .release      = xmp_ll_release,
+  .fsync        = xmp_ll_fsync,
+  .fallocate    = xmp_ll_fallocate,
+  .opendir      = xmp_ll_opendir,
+  .readdir      = xmp_ll_readdir,
+  .releasedir   = xmp_ll_releasedir,
+  .statfs       = xmp_ll_statfs,
+  .getxattr     = xmp_ll_getxattr,
+  .listxattr    = xmp_ll_listxattr,
+  .access       = xmp_ll_access
+};
+
+static struct xmp_config *get_config(const char *cfile)
 {
   FILE *fp;
+  struct xmp_config *cfg;
   char temp[132];
   char text[132];
 
@@ -772,85 +9049,332 @@ static int get_config(const char *cfile)
 
   if(!(fp = fopen(cfile, "r")))
   {
-    perror("fopen");
-    printf("Couldn't open config file: \"%s\"\n", cfile);
-    exit(-1);
+    syslog(LOG_ERR, "Couldn't open config file: \"%s\": %s\n", cfile, strerror(errno));
+    return NULL;
+  }
+
+  cfg = calloc(1, sizeof(struct xmp_config));
+  if(cfg == NULL)
+  {
+    fclose(fp);
+    return NULL;
   }
 
-  storage.nmounts = 1;
+  cfg->nmounts = 1;
+  cfg->cachesize = CACHE_SIZE;
+  cfg->cachettl = CACHE_TTL;
+  cfg->cachenegttl = CACHE_NEG_TTL;
+  cfg->dirindex = DIRINDEX_SIZE;
+  cfg->dirindexttl = DIRINDEX_TTL;
+  cfg->refresh = SPACE_REFRESH;
+  cfg->probetimeout = PROBE_TIMEOUT;
+  cfg->placement = PLACE_WEIGHTED;
+  cfg->splice = 1;
+  cfg->checksum = 1;
+  cfg->readahead = READAHEAD_WINDOW;
+  cfg->readaheadmem = READAHEAD_MEMORY;
+  cfg->readaheadthreads = READAHEAD_THREADS;
+  cfg->writebehind = 0;
+  cfg->writebehindmem = WRITEBEHIND_MEMORY;
+  cfg->flushthreads = FLUSH_THREADS;
+  cfg->flushmount = FLUSH_MOUNT;
+  cfg->iolimit = 0;
+  cfg->mirrorthreads = MIRROR_THREADS;
+  cfg->localcachesize = LOCAL_SIZE;
+  cfg->localcachehits = LOCAL_HITS;
+  cfg->localcacheentries = LOCAL_ENTRIES;
+  cfg->localcachethreads = LOCAL_THREADS;
+  cfg->stripethreshold = 0;
+  cfg->stripesize = STRIPE_SIZE;
+  cfg->stripecount = STRIPE_COUNT;
+  cfg->stripethreads = STRIPE_THREADS;
+  cfg->iobackend = IO_THREADS;
+  cfg->uringentries = URING_ENTRIES;
+  cfg->locindexsize = LOCINDEX_SLOTS;
+  cfg->locindexsync = 1;
+  cfg->locindexttl = LOCINDEX_TTL;
+  cfg->prefetchthreads = PREFETCH_THREADS;
 
   while (fgets(text, 131, fp))
   {
     if(strncmp("storage.metapath", text, 16) == 0)
     {
       sscanf(text, "storage.metapath %s", temp);
-      storage.mounts[0] = strdup(temp);
+      free(cfg->mounts[0]);
+      cfg->mounts[0] = strdup(temp);
     }
     else if(strncmp("storage.datapath", text, 16) == 0)
     {
 
-      if(storage.nmounts == MAX_STORAGE)
+      if(cfg->nmounts == MAX_STORAGE)
       {
-        printf("Too many storage mount points, %d max\n", MAX_STORAGE);
-        exit(-1);
+        syslog(LOG_ERR, "Too many storage mount points, %d max\n", MAX_STORAGE);
+        fclose(fp);
+        xmp_config_free(cfg);
+        return NULL;
       }
 
       sscanf(text, "storage.datapath %s", temp);
 
-      storage.mounts[storage.nmounts] = strdup(temp);
+      cfg->mounts[cfg->nmounts] = strdup(temp);
+
+      ++cfg->nmounts;
+    }
+    else if(strncmp("storage.cachesize", text, 17) == 0)
+    {
+      sscanf(text, "storage.cachesize %d", &cfg->cachesize);
+    }
+    else if(strncmp("storage.cachenegttl", text, 19) == 0)
+    {
+      sscanf(text, "storage.cachenegttl %d", &cfg->cachenegttl);
+    }
+    else if(strncmp("storage.cachettl", text, 16) == 0)
+    {
+      sscanf(text, "storage.cachettl %d", &cfg->cachettl);
+    }
+    else if(strncmp("storage.dirindexttl", text, 19) == 0)
+    {
+      sscanf(text, "storage.dirindexttl %d", &cfg->dirindexttl);
+    }
+    else if(strncmp("storage.dirindex", text, 16) == 0)
+    {
+      sscanf(text, "storage.dirindex %d", &cfg->dirindex);
+    }
+    else if(strncmp("storage.refresh", text, 15) == 0)
+    {
+      sscanf(text, "storage.refresh %d", &cfg->refresh);
+    }
+    else if(strncmp("storage.probetimeout", text, 20) == 0)
+    {
+      sscanf(text, "storage.probetimeout %d", &cfg->probetimeout);
+    }
+    else if(strncmp("storage.prefetchthreads", text, 23) == 0)
+    {
+      sscanf(text, "storage.prefetchthreads %d", &cfg->prefetchthreads);
+    }
+    else if(strncmp("storage.splice", text, 14) == 0)
+    {
+      sscanf(text, "storage.splice %d", &cfg->splice);
+    }
+    else if(strncmp("storage.readaheadthreads", text, 24) == 0)
+    {
+      sscanf(text, "storage.readaheadthreads %d", &cfg->readaheadthreads);
+    }
+    else if(strncmp("storage.readaheadmem", text, 20) == 0)
+    {
+      sscanf(text, "storage.readaheadmem %zu", &cfg->readaheadmem);
+    }
+    else if(strncmp("storage.readahead", text, 17) == 0)
+    {
+      sscanf(text, "storage.readahead %zu", &cfg->readahead);
+    }
+    else if(strncmp("storage.writebehindmem", text, 22) == 0)
+    {
+      sscanf(text, "storage.writebehindmem %zu", &cfg->writebehindmem);
+    }
+    else if(strncmp("storage.writebehind", text, 19) == 0)
+    {
+      sscanf(text, "storage.writebehind %zu", &cfg->writebehind);
+    }
+    else if(strncmp("storage.flushthreads", text, 20) == 0)
+    {
+      sscanf(text, "storage.flushthreads %d", &cfg->flushthreads);
+    }
+    else if(strncmp("storage.mirrorthreads", text, 21) == 0)
+    {
+      sscanf(text, "storage.mirrorthreads %d", &cfg->mirrorthreads);
+    }
+    else if(strncmp("storage.mirror", text, 14) == 0)
+    {
+      if(cfg->nmirrors == MAX_MIRRORS)
+      {
+        syslog(LOG_WARNING, "Too many mirrored prefixes, %d max\n", MAX_MIRRORS);
+        continue;
+      }
+
+      if(sscanf(text, "storage.mirror %s", temp) != 1) continue;
+
+      /* "/a/b/" and "/a/b" mean the same prefix */
+      while(strlen(temp) > 1 && temp[strlen(temp) - 1] == '/')
+        temp[strlen(temp) - 1] = '\0';
 
-      ++storage.nmounts;
+      cfg->mirrors[cfg->nmirrors++] = strdup(temp);
+    }
+    else if(strncmp("storage.stripethreshold", text, 23) == 0)
+    {
+      sscanf(text, "storage.stripethreshold %zu", &cfg->stripethreshold);
+    }
+    else if(strncmp("storage.stripesize", text, 18) == 0)
+    {
+      sscanf(text, "storage.stripesize %zu", &cfg->stripesize);
+    }
+    else if(strncmp("storage.stripecount", text, 19) == 0)
+    {
+      sscanf(text, "storage.stripecount %d", &cfg->stripecount);
+    }
+    else if(strncmp("storage.iobackend", text, 17) == 0)
+    {
+      sscanf(text, "storage.iobackend %s", temp);
+      if(strcmp(temp, "threads") == 0)
+        cfg->iobackend = IO_THREADS;
+      else if(strcmp(temp, "uring") == 0)
+        cfg->iobackend = IO_URING;
+      else
+        syslog(LOG_WARNING, "Unknown I/O backend \"%s\"\n", temp);
+    }
+    else if(strncmp("storage.uringentries", text, 20) == 0)
+    {
+      sscanf(text, "storage.uringentries %d", &cfg->uringentries);
+    }
+    else if(strncmp("storage.stripethreads", text, 21) == 0)
+    {
+      sscanf(text, "storage.stripethreads %d", &cfg->stripethreads);
+    }
+    else if(strncmp("storage.localcachesize", text, 22) == 0)
+    {
+      sscanf(text, "storage.localcachesize %zu", &cfg->localcachesize);
+    }
+    else if(strncmp("storage.localcachehits", text, 22) == 0)
+    {
+      sscanf(text, "storage.localcachehits %d", &cfg->localcachehits);
+    }
+    else if(strncmp("storage.localcacheentries", text, 25) == 0)
+    {
+      sscanf(text, "storage.localcacheentries %d", &cfg->localcacheentries);
+    }
+    else if(strncmp("storage.localcachethreads", text, 25) == 0)
+    {
+      sscanf(text, "storage.localcachethreads %d", &cfg->localcachethreads);
+    }
+    else if(strncmp("storage.locindexsize", text, 20) == 0)
+    {
+      sscanf(text, "storage.locindexsize %d", &cfg->locindexsize);
+    }
+    else if(strncmp("storage.locindexsync", text, 20) == 0)
+    {
+      sscanf(text, "storage.locindexsync %d", &cfg->locindexsync);
+    }
+    else if(strncmp("storage.locindexttl", text, 19) == 0)
+    {
+      sscanf(text, "storage.locindexttl %d", &cfg->locindexttl);
+    }
+    else if(strncmp("storage.locindex", text, 16) == 0)
+    {
+      if(sscanf(text, "storage.locindex %s", temp) != 1) continue;
+      free(cfg->locindex);
+      cfg->locindex = strdup(temp);
+    }
+    else if(strncmp("storage.openlist", text, 16) == 0)
+    {
+      if(sscanf(text, "storage.openlist %s", temp) != 1) continue;
+      free(cfg->openlist);
+      cfg->openlist = strdup(temp);
+    }
+    else if(strncmp("storage.localcache", text, 18) == 0)
+    {
+      if(sscanf(text, "storage.localcache %s", temp) != 1) continue;
+      free(cfg->localcache);
+      cfg->localcache = strdup(temp);
+    }
+    else if(strncmp("storage.iolimit", text, 15) == 0)
+    {
+      sscanf(text, "storage.iolimit %d", &cfg->iolimit);
+    }
+    else if(strncmp("storage.flushmount", text, 18) == 0)
+    {
+      sscanf(text, "storage.flushmount %d", &cfg->flushmount);
+    }
+    else if(strncmp("storage.checksum", text, 16) == 0)
+    {
+      sscanf(text, "storage.checksum %d", &cfg->checksum);
+    }
+    else if(strncmp("storage.placement", text, 17) == 0)
+    {
+      sscanf(text, "storage.placement %s", temp);
+      if(strcmp(temp, "weighted") == 0)
+        cfg->placement = PLACE_WEIGHTED;
+      else if(strcmp(temp, "inflight") == 0)
+        cfg->placement = PLACE_INFLIGHT;
+      else if(strcmp(temp, "roundrobin") == 0)
+        cfg->placement = PLACE_ROUNDROBIN;
+      else
+        syslog(LOG_WARNING, "Unknown placement policy \"%s\"\n", temp);
     }
   }
 
   fclose(fp);
 
-  if(!storage.mounts[0])
+  if(!cfg->mounts[0])
   {
-      printf("No meta mount point defined\n");
-      exit(-1);
+      syslog(LOG_ERR, "No meta mount point defined\n");
+      xmp_config_free(cfg);
+      return NULL;
   }
 
-  if(storage.nmounts < 2)
+  if(cfg->nmounts < 2)
   {
-      printf("No data mount point defined\n");
-      exit(-1);
+      syslog(LOG_ERR, "No data mount point defined\n");
+      xmp_config_free(cfg);
+      return NULL;
   }
 
   fflush(NULL);
 
-  return 0;
+  return cfg;
 }
 
-static void sig_handler(int sig)
-{
-  (void)sig;
+/*
+  Configuration reloads run in a dedicated thread, the SIGHUP
+  handler only wakes it up through a pipe.
+*/
 
-  if(pthread_mutex_lock(&exclusive_lock) == EBUSY)
-  {
-    syslog(LOG_WARNING, "ERROR calling pthread_mutex_lock while in handler, already locked");
-    return;
-  }
+static void *xmp_reload(void *arg)
+{
+  char c;
+  struct pollfd pfd;
+  struct xmp_config *cfg;
 
-  pthread_rwlock_wrlock(&rw_lock);
+  (void) arg;
 
-  syslog(LOG_INFO, "Received HUP signal, reloading config..\n");
+  pfd.fd = reload_pipe[0];
+  pfd.events = POLLIN;
 
-  if(storage.nmounts)
+  while(1)
   {
-    int i;
-    for(i = 0; i < storage.nmounts; ++i)
+    if(poll(&pfd, 1, retired ? 1000 : -1) > 0 && read(reload_pipe[0], &c, 1) == 1)
     {
-      if(storage.mounts[i]) free(storage.mounts[i]);
-      storage.mounts[i] = (char *)NULL;
+      syslog(LOG_INFO, "Received HUP signal, reloading config..\n");
+
+      cfg = get_config(config_file);
+      if(cfg) xmp_config_publish(cfg);
+      else syslog(LOG_WARNING, "Keeping previous configuration\n");
     }
-    storage.nmounts = 0;
+
+    xmp_config_reclaim();
   }
 
-  get_config(config_file);
+  return NULL;
+}
+
+static void sig_handler(int sig)
+{
+  int err = errno;
+  ssize_t res;
+
+  (void)sig;
+
+  /* a full pipe means that a reload is already pending */
+  res = write(reload_pipe[1], "h", 1);
+  (void)res;
+
+  errno = err;
+}
+
+static void dump_handler(int sig)
+{
+  (void)sig;
 
-  pthread_mutex_unlock(&exclusive_lock);
-  pthread_rwlock_unlock(&rw_lock);
+  placement.dump = 1;
 }
 
 static void set_sig_handler()
@@ -866,15 +9390,99 @@ static void set_sig_handler()
     perror("Cannot set signal handler");
     _exit(1);
   }
+
+  sa.sa_handler = dump_handler;
+
+  if(sigaction(SIGUSR1, &sa, NULL) == -1)
+  {
+    perror("Cannot set signal handler");
+    _exit(1);
+  }
+}
+
+/*
+  direct_io used to be an option of the high-level library, so it is
+  taken out of the mount options here and set on every open file.
+*/
+
+#define KEY_DIRECT_IO 0
+
+static struct fuse_opt xmp_opts[] = {
+  FUSE_OPT_KEY("direct_io", KEY_DIRECT_IO),
+  FUSE_OPT_END
+};
+
+static int xmp_opt_proc(void *data, const char *arg, int key,
+  struct fuse_args *outargs)
+{
+  (void) data;
+  (void) arg;
+  (void) outargs;
+
+  if(key != KEY_DIRECT_IO) return 1;
+
+  direct_io = 1;
+  return 0;
+}
+
+static int xmp_session(int argc, char *argv[])
+{
+  int res;
+  int foreground;
+  int multithreaded;
+  char *mountpoint;
+  struct fuse_chan *ch;
+  struct fuse_session *se;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+  if(fuse_opt_parse(&args, NULL, xmp_opts, xmp_opt_proc) == -1 ||
+     fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+  {
+    return 1;
+  }
+
+  if(mountpoint == NULL)
+  {
+    printf("Please, specify mount point\n");
+    return 1;
+  }
+
+  ch = fuse_mount(mountpoint, &args);
+  if(ch == NULL) return 1;
+
+  res = -1;
+
+  se = fuse_lowlevel_new(&args, &xmp_oper, sizeof(xmp_oper), NULL);
+
+  if(se)
+  {
+    if(fuse_daemonize(foreground) != -1 && fuse_set_signal_handlers(se) != -1)
+    {
+      fuse_session_add_chan(se, ch);
+      res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+      fuse_remove_signal_handlers(se);
+      fuse_session_remove_chan(ch);
+    }
+    fuse_session_destroy(se);
+  }
+
+  fuse_unmount(mountpoint, ch);
+  fuse_opt_free_args(&args);
+  free(mountpoint);
+
+  return res == -1 ? 1 : 0;
 }
 
 int main(int argc, char *argv[])
 {
-  pthread_mutexattr_t exclusive_attr;
-  pthread_mutexattr_settype(&exclusive_attr, PTHREAD_MUTEX_ERRORCHECK);
+  struct xmp_config *cfg;
 
-  pthread_mutex_init(&exclusive_lock, &exclusive_attr);
-  pthread_rwlock_init(&rw_lock, NULL);
+  pthread_key_create(&reader_key, xmp_reader_release);
+  pthread_key_create(&stats.key, xmp_stats_release);
+  pthread_mutex_init(&stats.lock, NULL);
+  pthread_mutex_init(&space.lock, NULL);
+  pthread_cond_init(&space.cond, NULL);
+  pthread_mutex_init(&writebehind.lock, NULL);
 
   fsuid = getuid();
   fsgid = getgid();
@@ -901,9 +9509,43 @@ int main(int argc, char *argv[])
   openlog("srmlite", LOG_PERROR|LOG_PID, LOG_DAEMON);
   syslog(LOG_INFO, "Starting for uid %d\n", fsuid);
 
-  get_config(config_file);
+  cfg = get_config(config_file);
+
+  if(!cfg) exit(-1);
+
+  xmp_config_publish(cfg);
+
+  xmp_cache_init();
+
+  xmp_dirindex_init();
+
+  xmp_local_init();
+
+  xmp_locindex_init();
+
+  xmp_ofile_init();
+
+  xmp_io_init();
+
+  xmp_node_init();
+
+  if(pipe(reload_pipe) == -1)
+  {
+    perror("Cannot create reload pipe");
+    exit(-1);
+  }
+
+  fcntl(reload_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(reload_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK);
+
+  /* without write_buf, reads do not use xmp_read_buf either */
+  if(!storage->splice)
+  {
+    xmp_oper.write_buf = NULL;
+  }
 
   set_sig_handler();
 
-  return fuse_main(new_argc, new_argv, &xmp_oper, NULL);
+  return xmp_session(new_argc, new_argv);
 }